@@ -0,0 +1,133 @@
+/// @file bin/readdir-bench.cpp
+/// @brief Time DiskFileTree::readDir() against a readdir(3) loop on a
+///     large directory
+/// @author Christopher White <cxwembedded@gmail.com>
+/// @copyright Copyright (c) 2021--2022 Christopher White
+/// SPDX-License-Identifier: BSD-3-Clause
+
+#include <chrono>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <smallcxx/globstari.hpp>
+
+using smallcxx::DiskFileTree;
+using smallcxx::Entry;
+using smallcxx::EntryType;
+using smallcxx::glob::Path;
+
+using Entries = std::vector< std::shared_ptr<Entry> >;
+
+/// readdir(3)-based reader, as DiskFileTree::readDir() used to be
+static Entries
+readDirReference(const Path& dirName)
+{
+    Entries retval;
+    DIR *dirp = opendir(dirName.c_str());
+    if(!dirp) {
+        return retval;
+    }
+
+    struct dirent *ent;
+    while((ent = readdir(dirp)) != NULL) {
+        const auto canonPath = dirName + "/" + ent->d_name;
+        if(ent->d_type == DT_REG) {
+            retval.push_back(std::make_shared<Entry>(EntryType::File,
+                             canonPath));
+        } else if(ent->d_type == DT_DIR && strcmp(ent->d_name, ".") != 0 &&
+                  strcmp(ent->d_name, "..") != 0) {
+            retval.push_back(std::make_shared<Entry>(EntryType::Dir,
+                             canonPath));
+        }
+    }
+
+    closedir(dirp);
+    return retval;
+}
+
+/// Best time, in seconds, of @p rounds calls of @p reader on @p dir
+template<class Reader>
+static double
+bestTime(Reader reader, const Path& dir, int rounds, size_t& count)
+{
+    double best = 1e9;
+    for(int i = 0; i < rounds; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto entries = reader(dir);
+        const std::chrono::duration<double> took =
+            std::chrono::steady_clock::now() - start;
+        count = entries.size();
+        if(took.count() < best) {
+            best = took.count();
+        }
+    }
+    return best;
+}
+
+int
+main(int argc, char **argv)
+{
+    if(argc > 1 && argv[1][0] == '-') {
+        fprintf(stderr, "Usage: %s [NFILES [ROUNDS [DIR]]]\n"
+                "Creates NFILES (default 100000) empty files in a new "
+                "directory under DIR\n(default $TMPDIR or /tmp), times "
+                "reading it ROUNDS (default 5) times, and\ncleans up.\n",
+                argv[0]);
+        return 2;
+    }
+
+    const long nfiles = (argc > 1) ? atol(argv[1]) : 100000;
+    const int rounds = (argc > 2) ? atoi(argv[2]) : 5;
+    const char *tmpdir = getenv("TMPDIR");
+    std::string dirTemplate = std::string((argc > 3) ? argv[3] :
+                                          tmpdir ? tmpdir : "/tmp") +
+                              "/readdir-bench-XXXXXX";
+    if(!mkdtemp(&dirTemplate[0])) {
+        perror("mkdtemp");
+        return 1;
+    }
+    const Path dir(dirTemplate);
+
+    printf("Creating %ld files in %s\n", nfiles, dir.c_str());
+    for(long i = 0; i < nfiles; ++i) {
+        const auto path = dir + "/file-" + std::to_string(i);
+        const int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if(fd < 0) {
+            perror(path.c_str());
+            break;
+        }
+        close(fd);
+    }
+
+    size_t refCount = 0, treeCount = 0, fdCount = 0;
+    DiskFileTree tree, fdTree(16);
+    const double refTime = bestTime(readDirReference, dir, rounds, refCount);
+    const double treeTime = bestTime([&tree](const Path & p) {
+        return tree.readDir(p);
+    }, dir, rounds, treeCount);
+    const double fdTime = bestTime([&fdTree](const Path & p) {
+        return fdTree.readDir(p);
+    }, dir, rounds, fdCount);
+
+    printf("readdir(3) loop:          %9.3f ms (%zu entries)\n",
+           refTime * 1000, refCount);
+    printf("DiskFileTree::readDir():  %9.3f ms (%zu entries)\n",
+           treeTime * 1000, treeCount);
+    printf("DiskFileTree(16):         %9.3f ms (%zu entries)\n",
+           fdTime * 1000, fdCount);
+
+    for(long i = 0; i < nfiles; ++i) {
+        unlink((dir + "/file-" + std::to_string(i)).c_str());
+    }
+    rmdir(dir.c_str());
+
+    return (refCount == treeCount && treeCount == fdCount) ? 0 : 1;
+}
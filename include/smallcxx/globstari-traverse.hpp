@@ -0,0 +1,1283 @@
+/// @file include/smallcxx/globstari-traverse.hpp
+/// @brief globstar + ignore routines --- statically-dispatched globstari()
+/// @details Part of smallcxx
+/// @author Christopher White <cxwembedded@gmail.com>
+/// @copyright Copyright (c) 2021--2022 Christopher White
+/// SPDX-License-Identifier: BSD-3-Clause
+///
+/// The primary function in this file is
+/// globstari(FileTree&, Processor&, const smallcxx::glob::Path&,
+/// const std::vector<smallcxx::glob::Path>&, const GlobstariOptions&).
+/// This file includes smallcxx/logging.hpp, so if you use a log domain,
+/// define `SMALLCXX_LOG_DOMAIN` before including this file.
+
+#ifndef SMALLCXX_GLOBSTARI_TRAVERSE_HPP_
+#define SMALLCXX_GLOBSTARI_TRAVERSE_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "smallcxx/globstari.hpp"
+#include "smallcxx/logging.hpp"
+
+namespace smallcxx
+{
+
+// === Internal classes ==================================================
+// The rest of this section is the implementation of globstari().  It is
+// here only so the compiler can see it when instantiating Traverser.
+
+/// Implementation details of Traverser.  Not part of the API.
+namespace detail
+{
+
+/// Control exception used to stop traversal early
+struct StopTraversal {};
+
+using MatcherPtr = std::shared_ptr<glob::Matcher>;
+
+/// Entries to look up directly, without reading their parents.
+/// Each node is an entry; its children are keyed by name.  A node with
+/// no children and @c read false is an entry a needle names exactly.
+struct DescentNode {
+    /// If true, read this directory normally.  @c children is then empty.
+    bool read = false;
+
+    std::map<smallcxx::glob::Path, DescentNode> children;
+};
+
+// --- Seen paths ---
+
+/// The paths a traversal has seen.  Each path is stored as its parent's
+/// index and its own name, so the names of the directories above it are
+/// stored only once however many entries they contain.  Paths that aren't
+/// in the usual canonical form (absolute, no empty components, no trailing
+/// `/`) are kept whole instead.
+class PathTable
+{
+public:
+    using Id = uint32_t;
+    static constexpr Id NONE = UINT32_MAX;  ///< not in the table
+    static constexpr Id ROOT = 0;           ///< `/`
+
+private:
+    /// One path
+    struct Node {
+        Id parent;          ///< NONE for ROOT
+        uint32_t nameSize;
+        size_t nameStart;   ///< index in names_
+    };
+    std::vector<Node> nodes_;
+    std::vector<bool> seen_;    ///< seen_[id]: has the path been seen?
+    std::string names_;         ///< all the names, one after another
+
+    /// Hashes a node by its parent and name
+    struct NodeHash {
+        const PathTable *table;
+
+        size_t
+        operator()(Id id) const
+        {
+            const Node& node = table->nodes_[id];
+            size_t hash = node.parent * (size_t)0x9e3779b97f4a7c15ULL;
+            const char *name = &table->names_[node.nameStart];
+            for(uint32_t i = 0; i < node.nameSize; ++i) {
+                hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+            }
+            return hash;
+        }
+    };
+
+    /// Compares nodes by their parents and names
+    struct NodeEqual {
+        const PathTable *table;
+
+        bool
+        operator()(Id lhs, Id rhs) const
+        {
+            const Node& l = table->nodes_[lhs];
+            const Node& r = table->nodes_[rhs];
+            return l.parent == r.parent && l.nameSize == r.nameSize &&
+                   !memcmp(&table->names_[l.nameStart],
+                           &table->names_[r.nameStart], l.nameSize);
+        }
+    };
+
+    /// Every node except ROOT
+    std::unordered_set<Id, NodeHash, NodeEqual> index_;
+
+    /// Paths that aren't canonical
+    glob::PathSet odd_;
+
+    /// Find or add the node for @p name in @p parent
+    Id
+    child(Id parent, const char *name, size_t size)
+    {
+        const Id candidate = nodes_.size();
+        nodes_.push_back({parent, (uint32_t)size, names_.size()});
+        names_.append(name, size);
+
+        const auto found = index_.insert(candidate);
+        if(!found.second) {
+            nodes_.pop_back();
+            names_.resize(names_.size() - size);
+            return *found.first;
+        }
+
+        seen_.push_back(false);
+        return candidate;
+    }
+
+public:
+    PathTable()
+        : index_(0, NodeHash{this}, NodeEqual{this})
+    {
+        nodes_.push_back({NONE, 0, 0});
+        seen_.push_back(false);
+    }
+
+    PathTable(const PathTable&) = delete;
+    PathTable& operator=(const PathTable&) = delete;
+
+    /// Note that @p path has been seen.
+    /// @param[in]  parent - if not NONE, the Id of the directory
+    ///     @p path is in.  The caller has checked that @p path is that
+    ///     directory's path, `/`, and a name.
+    /// @param[in]  path - the path
+    /// @param[out] id - the Id of @p path, or NONE if it isn't canonical
+    /// @return true if @p path had not been seen before
+    bool
+    insert(Id parent, const smallcxx::glob::Path& path, Id& id)
+    {
+        if(parent != NONE) {
+            const size_t slash = path.rfind('/');
+            id = child(parent, path.data() + slash + 1,
+                       path.size() - slash - 1);
+
+        } else if(isCanonical(path)) {
+            id = ROOT;
+            for(size_t start = 1; start < path.size(); ) {
+                size_t end = path.find('/', start);
+                if(end == path.npos) {
+                    end = path.size();
+                }
+                id = child(id, path.data() + start, end - start);
+                start = end + 1;
+            }
+
+        } else {
+            id = NONE;
+            return odd_.insert(path).second;
+        }
+
+        if(seen_[id]) {
+            return false;
+        }
+        seen_[id] = true;
+        return true;
+    }
+
+    /// Whether @p path is absolute with no empty components and no
+    /// trailing `/`, unless it is `/`
+    static bool
+    isCanonical(const smallcxx::glob::Path& path)
+    {
+        if(path.empty() || path[0] != '/') {
+            return false;
+        }
+        if(path.size() == 1) {
+            return true;
+        }
+        return path.back() != '/' && path.find("//") == path.npos;
+    }
+
+    /// Whether @p path is @p dirPath, `/`, and a name
+    static bool
+    isChild(const smallcxx::glob::Path& dirPath,
+            const smallcxx::glob::Path& path)
+    {
+        const size_t prefix = dirPath.size() + (dirPath == "/" ? 0 : 1);
+        return path.size() > prefix &&
+               !path.compare(0, dirPath.size(), dirPath) &&
+               path[prefix - 1] == '/' &&
+               path.find('/', prefix) == path.npos;
+    }
+}; // class PathTable
+
+/// A set of (device, inode number) pairs.  Open addressing, so each pair
+/// takes 16 bytes plus slack, with no per-element allocation.
+class FileIdSet
+{
+    /// (dev, ino).  ino == 0 means empty.
+    std::vector< std::pair<uint64_t, uint64_t> > slots_;
+    size_t size_ = 0;
+
+    static size_t
+    hash(uint64_t dev, uint64_t ino)
+    {
+        uint64_t h = (ino ^ (dev << 32 | dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+        return (size_t)(h ^ (h >> 29));
+    }
+
+    /// Put a pair known not to be present into a free slot
+    void
+    place(uint64_t dev, uint64_t ino)
+    {
+        const size_t mask = slots_.size() - 1;
+        size_t i = hash(dev, ino) & mask;
+        while(slots_[i].second != 0) {
+            i = (i + 1) & mask;
+        }
+        slots_[i] = std::make_pair(dev, ino);
+    }
+
+public:
+    /// Add (@p dev, @p ino).  @p ino must not be 0.
+    /// @return true if it wasn't already there
+    bool
+    insert(uint64_t dev, uint64_t ino)
+    {
+        if((size_ + 1) * 2 > slots_.size()) {
+            std::vector< std::pair<uint64_t, uint64_t> > old(
+                std::max<size_t>(16, slots_.size() * 2));
+            old.swap(slots_);
+            for(const auto& slot : old) {
+                if(slot.second != 0) {
+                    place(slot.first, slot.second);
+                }
+            }
+        }
+
+        const size_t mask = slots_.size() - 1;
+        for(size_t i = hash(dev, ino) & mask; ; i = (i + 1) & mask) {
+            auto& slot = slots_[i];
+            if(slot.second == 0) {
+                slot = std::make_pair(dev, ino);
+                ++size_;
+                return true;
+            } else if(slot.first == dev && slot.second == ino) {
+                return false;
+            }
+        }
+    }
+}; // class FileIdSet
+
+// --- Traverser ---
+
+/// An entry and corresponding ignores
+/// @invariant WorkItem::ignores is not NULL (but may be empty).
+struct WorkItem {
+    std::shared_ptr<Entry> entry;
+    MatcherPtr ignores;
+
+    /// The directory @c entry is in, if @c entry->canonPath is that
+    /// directory's path and a name.  Otherwise, PathTable::NONE.
+    PathTable::Id parent = PathTable::NONE;
+
+    /// If true, @c entry->ignored and @c match have already been filled in
+    /// by a batch check.
+    bool checked = false;
+
+    /// Result of checking @c entry against the needle.  Only valid if
+    /// @c checked is true and @c entry is not skipped as ignored.
+    glob::PathCheckResult match = glob::PathCheckResult::Unknown;
+
+    /// If true, @c entry is a directory that has already been visited and
+    /// given to an IProcessEntryBatch, and only needs to be read.
+    bool processed = false;
+
+    /// If @c processed is true, @c entry's Id in the seen paths
+    PathTable::Id id = PathTable::NONE;
+
+    WorkItem(std::shared_ptr<Entry> newEntry)
+        : WorkItem(std::move(newEntry), std::make_shared<glob::Matcher>())
+    {}
+    WorkItem(std::shared_ptr<Entry> newEntry, MatcherPtr newIgnores)
+        : entry(std::move(newEntry)), ignores(std::move(newIgnores))
+    {
+        if(!ignores) {
+            throw std::logic_error("WorkItem: ignores must not be null");
+        }
+    }
+
+    WorkItem(const WorkItem&) = default;
+    WorkItem(WorkItem&&) = default;
+    WorkItem& operator=(const WorkItem&) = default;
+    WorkItem& operator=(WorkItem&&) = default;
+    ~WorkItem() = default;
+
+}; // class WorkItem
+
+/// Per-thread state of a Traverser
+struct TraverserThread {
+    /// Work queue.  New items go at the back.  The owning thread takes
+    /// items from the front for breadth-first search or the back for
+    /// depth-first search.  Other threads steal from the other end.
+    std::deque<WorkItem> items;
+
+    /// Protects @c items
+    std::mutex itemsMutex;
+
+    /// Scratch space for checking paths against the needle and the
+    /// ignores.  Reused for every check this thread makes.
+    smallcxx::glob::MatchContext matchContext;
+
+    /// @name Scratch space for batch checks in loadDir()
+    /// @{
+    std::vector<smallcxx::glob::PathView> batchPaths;
+    std::vector<glob::PathCheckResult> ignoreResults;
+    std::vector<glob::PathCheckResult> needleResults;
+    /// @}
+
+    /// @name Scratch space for IProcessEntryBatch::processBatch() calls
+    /// @{
+    std::vector< std::shared_ptr<Entry> > batchEntries;
+    std::vector<PathTable::Id> batchIds;
+    std::vector<IProcessEntry::Status> batchStatuses;
+    /// @}
+}; // struct TraverserThread
+
+} // namespace detail
+
+/// The parts of Traverser that don't call the IFileTree or the
+/// IProcessEntry, so are compiled once in the library
+class TraverserBase
+{
+protected:
+    /// @name Shorthand for the detail types
+    /// @{
+    using MatcherPtr = detail::MatcherPtr;
+    using DescentNode = detail::DescentNode;
+    using PathTable = detail::PathTable;
+    using FileIdSet = detail::FileIdSet;
+    using WorkItem = detail::WorkItem;
+    using TraverserThread = detail::TraverserThread;
+    using StopTraversal = detail::StopTraversal;
+    /// @}
+
+    /// One per thread.  threads_[0] runs on the thread that called run().
+    std::vector< std::unique_ptr<TraverserThread> > threads_;
+
+    /// What we are looking for
+    smallcxx::glob::Matcher needleMatcher_;
+
+    /// How low can you go?
+    ssize_t maxDepth_;
+
+    /// Whether to skip directories the needle can't match under
+    bool pruneDirs_;
+
+    /// Always search depth-first?
+    bool depthFirst_;
+
+    /// Search depth-first when a thread has more items queued than this.
+    /// 0 for no limit.
+    size_t maxFrontier_;
+
+    /// Directories to descend into directly.  Empty if the traversal has
+    /// to read every directory.
+    DescentNode descent_;
+
+    /// Where to keep ignores between traversals.  May be null.
+    std::shared_ptr<IgnoreCache> ignoreCache_;
+
+    /// Whether to flatten each directory's ignores
+    bool flattenIgnores_;
+
+    /// Directories being descended into directly.  Key: Entry::canonPath.
+    std::unordered_map<smallcxx::glob::Path, const DescentNode *> descentAt_;
+
+    /// Serializes calls to the IProcessEntry
+    std::mutex processMutex_;
+
+    PathTable seen_;        ///< which paths we have seen so far
+
+    /// The directories we have read so far that have Entry::ino
+    FileIdSet seenDirs_;
+
+    /// Protects seen_, seenDirs_ and descentAt_
+    std::mutex stateMutex_;
+
+    /// Number of items queued or being processed.  The traversal is over
+    /// when this reaches zero.
+    std::atomic<size_t> pending_;
+
+    /// Set when the traversal should end early
+    std::atomic<bool> stop_;
+
+    /// @name Waiting for work
+    /// @{
+    std::mutex idleMutex_;
+    std::condition_variable idle_;
+    std::atomic<uint64_t> pushes_;  ///< number of batches queued so far
+    std::atomic<size_t> idlers_;    ///< number of threads waiting on idle_
+    std::exception_ptr error_;      ///< first error, if any.  Protected by
+    ///< idleMutex_.
+    /// @}
+
+    /// @name For GlobstariWalk
+    /// @{
+    bool walking_;      ///< return matches rather than processing them
+    std::shared_ptr<Entry> found_;      ///< the match next() just found
+    std::shared_ptr<Entry> resumeDir_;  ///< directory next() should read
+    MatcherPtr resumeIgnores_;          ///< the ignores for resumeDir_
+    PathTable::Id resumeId_;            ///< the Id of resumeDir_
+    /// @}
+
+    bool traversed_;        ///< have we already been run?
+
+    /// Ctor.  Parameters are as globstari().
+    /// @throws AssertionFailure if @p needle is empty.
+    TraverserBase(const std::vector<smallcxx::glob::Path>& needle,
+                  const GlobstariOptions& options);
+
+    ~TraverserBase() = default;
+
+    /// Compile the needle, relative to @p rootPath, and queue @p root.
+    /// @param[in]  rootPath - the canonical base path
+    /// @param[in]  needle - see globstari()
+    /// @param[in]  root - the Entry for @p rootPath
+    void start(const smallcxx::glob::Path& rootPath,
+               const std::vector<smallcxx::glob::Path>& needle,
+               std::shared_ptr<Entry> root);
+
+    /// Fill in descent_ and descentAt_ for @p needle.
+    void planDescent(const smallcxx::glob::Path& rootPath,
+                     const std::vector<smallcxx::glob::Path>& needle);
+
+    /// Whether @p thread's owner should take items from the back of its
+    /// queue.  Call with @p thread.itemsMutex held.
+    bool
+    takeFromBack(const TraverserThread& thread) const
+    {
+        return depthFirst_ ||
+               (maxFrontier_ > 0 && thread.items.size() > maxFrontier_);
+    }
+
+    /// Move an item from another thread's queue to @p self's queue.
+    /// @return false if there was nothing to steal
+    bool steal(TraverserThread& self);
+
+    /// Tell waiting threads to check for work or for the end of traversal
+    void wakeIdlers();
+
+    /// End the traversal early
+    void stop();
+
+    /// Save the exception being handled in error_, unless there already
+    /// is one, and end the traversal.  Call from a `catch` block.
+    void fail();
+
+    /// Note that @p entry has been visited.
+    /// @param[in]  parent - see WorkItem::parent
+    /// @param[in]  entry - the entry
+    /// @param[out] id - @p entry's Id in seen_
+    /// @return false if @p entry has already been visited
+    bool visit(PathTable::Id parent, const Entry& entry, PathTable::Id& id);
+
+    /// Note that directory @p dir is about to be read.
+    /// @return false if a directory with the same Entry::dev and
+    ///     Entry::ino has already been read
+    bool firstRead(const Entry& dir);
+
+    /// The descent_ node for directory @p dirPath, or nullptr if
+    /// @p dirPath should be read normally
+    const DescentNode *descentAt(const smallcxx::glob::Path& dirPath);
+
+    /// Note that directory @p dirPath is to be descended into as @p node
+    void descendAt(const smallcxx::glob::Path& dirPath,
+                   const DescentNode& node);
+
+    /// Check all of @p entries against @p ignores and the needle at once.
+    /// Sets Entry::ignored on each entry and fills @p self.needleResults.
+    void checkBatch(const std::vector< std::shared_ptr<Entry> >& entries,
+                    const glob::Matcher& ignores, TraverserThread& self);
+
+    /// Where to look for the ignore files @p loadFrom of directory
+    /// @p relativeTo_canonical
+    static std::vector<smallcxx::glob::Path> ignorePaths(
+        const smallcxx::glob::Path& relativeTo_canonical,
+        const std::vector<smallcxx::glob::Path>& loadFrom);
+
+    /// Get ignores from ignoreCache_, which must not be null.  Parameters
+    /// are as IgnoreCacheImpl::find().
+    MatcherPtr cachedIgnores(const smallcxx::glob::Path& dirPath,
+                             const std::vector<smallcxx::glob::Path>& paths,
+                             const std::vector<FileStamp>& stamps,
+                             const MatcherPtr& parent);
+
+    /// Save ignores in ignoreCache_, which must not be null.  Parameters
+    /// are as IgnoreCacheImpl::insert().
+    void cacheIgnores(const smallcxx::glob::Path& dirPath,
+                      const std::vector<smallcxx::glob::Path>& paths,
+                      const std::vector<FileStamp>& stamps,
+                      const MatcherPtr& parent, const MatcherPtr& ignores);
+
+    /// Human-readable name of @p result.  All the same width to make the
+    /// logs easier to read.
+    static const char *resultName(glob::PathCheckResult result);
+
+    /// Log domain for traversal messages
+    static const std::string& logDomain();
+
+public:
+    TraverserBase(const TraverserBase&) = delete;
+    TraverserBase& operator=(const TraverserBase&) = delete;
+
+    /// Don't read the directory next() last returned
+    void
+    skip()
+    {
+        resumeDir_.reset();
+        resumeIgnores_.reset();
+    }
+
+    /// Has next() found everything?
+    bool
+    done() const
+    {
+        return stop_ || (pending_ == 0 && !resumeDir_);
+    }
+}; // class TraverserBase
+
+namespace detail
+{
+
+/// The IProcessEntryBatch interface of @p processor, if it has one
+template<class Processor>
+typename std::enable_if<std::is_base_of<IProcessEntry, Processor>::value,
+         IProcessEntryBatch *>::type
+batchInterfaceOf(Processor& processor)
+{
+    return dynamic_cast<IProcessEntryBatch *>(&processor);
+}
+
+/// Processors that aren't IProcessEntry subclasses don't take batches
+template<class Processor>
+typename std::enable_if<!std::is_base_of<IProcessEntry, Processor>::value,
+         IProcessEntryBatch *>::type
+batchInterfaceOf(Processor& processor)
+{
+    return nullptr;
+}
+
+} // namespace detail
+
+/// Log in the traversal's own log domain
+#define SMALLCXX_TRAVERSE_LOG(level, format, ...) \
+    LOG_F_DOMAIN(TraverserBase::logDomain(), level, format, ## __VA_ARGS__)
+
+/// Implementation of globstari().  Calls @p FileTree and @p Processor
+/// directly, so the compiler can inline them if they are not virtual.
+template<class FileTree, class Processor>
+class Traverser: public TraverserBase
+{
+    /// The hierarchy to search
+    FileTree& fileTree_;
+
+    /// What to do with entries
+    Processor& processEntry_;
+
+    /// processEntry_, if it takes whole directories at once.  Otherwise,
+    /// nullptr.
+    IProcessEntryBatch *batch_;
+
+public:
+    /// Ctor.
+    /// @param[in]  fileTree - see globstari()
+    /// @param[in]  processEntry - see globstari()
+    /// @param[in]  basePath - see globstari()
+    /// @param[in]  needle - see globstari().
+    /// @param[in]  options - see globstari()
+    ///
+    /// @throws AssertionFailure if @p needle is empty.
+    Traverser(FileTree& fileTree, Processor& processEntry,
+              const smallcxx::glob::Path& basePath,
+              const std::vector<smallcxx::glob::Path>& needle,
+              const GlobstariOptions& options
+             )
+        : TraverserBase(needle, options), fileTree_(fileTree),
+          processEntry_(processEntry),
+          batch_(detail::batchInterfaceOf(processEntry))
+    {
+        const smallcxx::glob::Path rootPath =
+            fileTree_.canonicalize(basePath);
+        start(rootPath, needle, fileTree_.rootDir(rootPath));
+    }
+
+    /// Run the traversal.
+    /// @note Only one traversal per instantiation of Traverser!
+    void run();
+
+    /// Run the traversal on this thread until it finds a match.
+    /// See GlobstariWalk::next(size_t).  Cannot be used with run().
+    std::shared_ptr<Entry> next(size_t maxVisits);
+
+private:
+    /// Do the work, as thread number @p index.  Records any exception
+    /// in error_ rather than throwing it.
+    void worker(size_t index);
+
+    /// Process the next item in @p self's queue.
+    /// @return false if the queue is empty
+    bool runOne(TraverserThread& self);
+
+    /// Process one item
+    void processItem(const WorkItem& item, TraverserThread& self);
+
+    /// Call processEntry_.  Returns Stop if the traversal is ending.
+    IProcessEntry::Status process(const std::shared_ptr<Entry>& entry);
+
+    /// Get the children of @p dirPath listed in @p node
+    std::vector< std::shared_ptr<Entry> > lookupChildren(
+        const smallcxx::glob::Path& dirPath, const DescentNode& node);
+
+    /// Prepare to descend into a directory
+    /// @param[in]  entry - the directory
+    /// @param[in]  parentIgnores - the ignores that apply to @p entry
+    /// @param[in]  self - the calling thread
+    /// @param[in]  id - @p entry's Id in seen_
+    void loadDir(const std::shared_ptr<Entry>& entry, MatcherPtr parentIgnores,
+                 TraverserThread& self, PathTable::Id id);
+
+    /// Give batch_ the entries in @p newEntries that match the needle,
+    /// and queue the directories among them it wants read.
+    /// @param[in]  dir - the directory @p newEntries are in
+    /// @param[in,out] newEntries - @p dir's contents, checked by
+    ///     checkBatch().  The entries given to batch_, and any already
+    ///     visited, are set to nullptr.
+    /// @param[in]  ignores - the ignores that apply to @p newEntries
+    /// @param[in]  self - the calling thread
+    /// @param[in]  id - @p dir's Id in seen_
+    void processBatch(const std::shared_ptr<Entry>& dir,
+                      std::vector< std::shared_ptr<Entry> >& newEntries,
+                      const MatcherPtr& ignores, TraverserThread& self,
+                      PathTable::Id id);
+
+    /// Load the contents of ignore files
+    MatcherPtr loadIgnoreFiles(const smallcxx::glob::Path& relativeTo_canonical,
+                               std::vector<smallcxx::glob::Path> loadFrom,
+                               MatcherPtr parentIgnores);
+}; // class Traverser
+
+template<class FileTree, class Processor>
+void
+Traverser<FileTree, Processor>::run()
+{
+    if(traversed_) {
+        throw std::logic_error("Cannot call Traverser::run() more than once");
+    }
+
+    traversed_ = true;
+
+    std::vector<std::thread> threads;
+    try {
+        for(size_t i = 1; i < threads_.size(); ++i) {
+            threads.emplace_back(&Traverser::worker, this, i);
+        }
+    } catch(...) {
+        stop();
+        for(auto& thread : threads) {
+            thread.join();
+        }
+        throw;
+    }
+
+    worker(0);
+    for(auto& thread : threads) {
+        thread.join();
+    }
+
+    if(error_) {
+        std::rethrow_exception(error_);
+    }
+} // Traverser::run()
+
+template<class FileTree, class Processor>
+std::shared_ptr<Entry>
+Traverser<FileTree, Processor>::next(size_t maxVisits)
+{
+    if(traversed_ && !walking_) {
+        throw std::logic_error("Cannot call Traverser::next() after run()");
+    }
+
+    traversed_ = true;
+    walking_ = true;
+    found_.reset();
+    if(stop_) {
+        return nullptr;
+    }
+
+    auto& self = *threads_[0];
+    try {
+        if(resumeDir_) {
+            const auto dir = resumeDir_;
+            const auto ignores = resumeIgnores_;
+            const auto id = resumeId_;
+            skip();
+            loadDir(dir, ignores, self, id);
+        }
+
+        for(size_t visits = 0; !found_ && runOne(self); ) {
+            if(maxVisits > 0 && ++visits >= maxVisits) {
+                break;
+            }
+        }
+    } catch(...) {
+        stop_ = true;
+        throw;
+    }
+
+    auto retval = found_;
+    found_.reset();
+    return retval;
+} // Traverser::next()
+
+template<class FileTree, class Processor>
+void
+Traverser<FileTree, Processor>::worker(size_t index)
+{
+    auto& self = *threads_[index];
+
+    try {
+        while(!stop_) {
+            const uint64_t pushes = pushes_;
+            if(runOne(self) || steal(self)) {
+                continue;
+            }
+
+            // Nothing to do.  Wait for another thread to queue something.
+            std::unique_lock<std::mutex> lock(idleMutex_);
+            ++idlers_;
+            idle_.wait(lock, [this, pushes]() {
+                return stop_ || pending_ == 0 || pushes_ != pushes;
+            });
+            --idlers_;
+            if(pending_ == 0) {
+                break;
+            }
+        }
+
+    } catch(StopTraversal&) {
+        stop();
+    } catch(...) {
+        fail();
+    }
+} // Traverser::worker()
+
+template<class FileTree, class Processor>
+bool
+Traverser<FileTree, Processor>::runOne(TraverserThread& self)
+{
+    std::unique_lock<std::mutex> lock(self.itemsMutex);
+    if(self.items.empty()) {
+        return false;
+    }
+
+    // Not auto& --- move the item out so we can pop it right away
+    const bool back = takeFromBack(self);
+    const WorkItem item(std::move(back ? self.items.back() :
+                                  self.items.front()));
+    if(back) {
+        self.items.pop_back();
+    } else {
+        self.items.pop_front();
+    }
+    lock.unlock();
+
+    processItem(item, self);
+
+    if(--pending_ == 0) {
+        wakeIdlers();
+    }
+    return true;
+} // Traverser::runOne()
+
+template<class FileTree, class Processor>
+IProcessEntry::Status
+Traverser<FileTree, Processor>::process(const std::shared_ptr<Entry>& entry)
+{
+    std::lock_guard<std::mutex> lock(processMutex_);
+    if(stop_) {
+        return IProcessEntry::Status::Stop;
+    }
+
+    const auto retval = processEntry_(entry);
+    if(retval == IProcessEntry::Status::Stop) {
+        stop_ = true;   // before any other thread can call processEntry_
+    }
+    return retval;
+} // Traverser::process()
+
+template<class FileTree, class Processor>
+void
+Traverser<FileTree, Processor>::processItem(const WorkItem& item,
+        TraverserThread& self)
+{
+    if(item.processed) {
+        loadDir(item.entry, item.ignores, self, item.id);
+        return;
+    }
+
+    PathTable::Id id;
+    if(!visit(item.parent, *item.entry, id)) {
+        return;
+    }
+
+    if((maxDepth_ > 0) && (item.entry->depth > maxDepth_)) {
+        SMALLCXX_TRAVERSE_LOG(TRACE, "Skipping %s --- maxDepth exceeded",
+                              item.entry->canonPath.c_str());
+        return;
+    }
+
+    // Check against the ignores we already have
+    if(!item.checked) {
+        item.entry->ignored = item.ignores->contains(item.entry->canonPath,
+                              self.matchContext);
+    }
+    if(item.entry->ignored && !item.entry->neverIgnore) {
+        SMALLCXX_TRAVERSE_LOG(TRACE, "ignored %s --- skipping",
+                              item.entry->canonPath.c_str());
+
+        // In case the client is interested
+        std::lock_guard<std::mutex> lock(processMutex_);
+        if(!stop_) {
+            processEntry_.ignored(item.entry);
+        }
+        return;
+    } else if(item.entry->ignored) {    // neverIgnore is true
+        SMALLCXX_TRAVERSE_LOG(TRACE, "proceeding with neverIgnore %s",
+                              item.entry->canonPath.c_str());
+    }
+
+    // Is it a hit?
+    const auto match = item.checked ? item.match :
+                       needleMatcher_.check(item.entry->canonPath,
+                                            self.matchContext);
+
+    SMALLCXX_TRAVERSE_LOG(TRACE, "pathcheck:%s for [%s]", resultName(match),
+                          item.entry->canonPath.c_str());
+
+    // Decide what to do
+    auto clientInstruction = IProcessEntry::Status::Continue;
+
+    if(match == glob::PathCheckResult::Excluded) {
+        // Excluded => nothing more to do.  Simple!
+        return;
+
+    } else if(match == glob::PathCheckResult::Included) {
+        if(walking_) {
+            // next() returns it, and reads it next time unless skip()ped
+            found_ = item.entry;
+            if(item.entry->ty == EntryType::Dir) {
+                resumeDir_ = item.entry;
+                resumeIgnores_ = item.ignores;
+                resumeId_ = id;
+            }
+            return;
+        }
+
+        // Included => give it to the client.  Also simple!
+        clientInstruction = process(item.entry);
+
+    } else if(item.entry->ty == EntryType::Dir) {
+        // But directories not specifically included may contain
+        // files that are themselves included.  Therefore,
+        // descend into directories if match == Unknown.
+        loadDir(item.entry, item.ignores, self, id);
+        return;
+    }
+
+    // Do what the client asked us to
+    switch(clientInstruction) {
+    case IProcessEntry::Status::Continue:
+        if(item.entry->ty == EntryType::Dir) {
+            loadDir(item.entry, item.ignores, self, id);
+        }
+        break;
+
+    case IProcessEntry::Status::Skip:
+        // nothing to do
+        break;
+
+#if 0
+    // TODO implement this?
+    case IProcessEntry::Status::Pop:
+        // TODO pop the deque until `dir` changes
+        break;
+#endif
+
+    case IProcessEntry::Status::Stop:
+        throw StopTraversal();
+        break;
+
+    default:
+        throw std::logic_error("Unimplemented status value " +
+                               std::to_string((int)clientInstruction));
+        break;
+    } //switch(clientInstruction)
+} // Traverser::processItem()
+
+template<class FileTree, class Processor>
+void
+Traverser<FileTree, Processor>::loadDir(const std::shared_ptr<Entry>& entry,
+                                        MatcherPtr parentIgnores,
+                                        TraverserThread& self,
+                                        PathTable::Id id)
+{
+    if(pruneDirs_ &&
+            !needleMatcher_.canMatchUnder(entry->canonPath,
+                                          self.matchContext)) {
+        SMALLCXX_TRAVERSE_LOG(TRACE,
+                              "pruning %s --- nothing under it can match",
+                              entry->canonPath.c_str());
+        return;
+    }
+
+    // Only now, so a directory reached by a path that is ignored or
+    // skipped can still be read by another path
+    if(!firstRead(*entry)) {
+        return;
+    }
+
+    // Load the new ignores
+    auto ignoresToLoad = fileTree_.ignoresForDir(entry->canonPath);
+    auto ignores = loadIgnoreFiles(entry->canonPath,
+                                   ignoresToLoad, parentIgnores);
+
+    // Load the new entries
+    std::vector< std::shared_ptr<Entry> > newEntries;
+    const DescentNode *descent = pruneDirs_ ? descentAt(entry->canonPath) :
+                                 nullptr;
+    if(descent) {
+        newEntries = lookupChildren(entry->canonPath, *descent);
+    } else {
+        newEntries = fileTree_.readDir(entry->canonPath);
+    }
+    const auto depth = entry->depth + 1;
+
+    // Check them all at once, unless worker() will skip them anyway
+    const bool check = !((maxDepth_ > 0) && (depth > maxDepth_));
+    if(check) {
+        checkBatch(newEntries, *ignores, self);
+        fileTree_.prefetch(newEntries);
+        if(batch_) {
+            processBatch(entry, newEntries, ignores, self, id);
+        }
+    }
+
+    const size_t count = batch_ ?
+                         newEntries.size() - std::count(newEntries.begin(),
+                                 newEntries.end(), nullptr) :
+                         newEntries.size();
+    if(count == 0) {
+        return;
+    }
+
+    pending_ += count;
+    {
+        std::lock_guard<std::mutex> lock(self.itemsMutex);
+        for(size_t i = 0; i < newEntries.size(); ++i) {
+            auto& newEntry = newEntries[i];
+            if(!newEntry) {
+                continue;
+            }
+            newEntry->depth = depth;
+            const bool isChild = id != PathTable::NONE &&
+                                 PathTable::isChild(entry->canonPath,
+                                                    newEntry->canonPath);
+            self.items.emplace_back(std::move(newEntry), ignores);
+            if(isChild) {
+                self.items.back().parent = id;
+            }
+            if(check) {
+                self.items.back().checked = true;
+                self.items.back().match = self.needleResults[i];
+            }
+        }
+    }
+
+    ++pushes_;
+    wakeIdlers();
+} // Traverser::loadDir()
+
+template<class FileTree, class Processor>
+void
+Traverser<FileTree, Processor>::processBatch(
+    const std::shared_ptr<Entry>& dir,
+    std::vector< std::shared_ptr<Entry> >& newEntries,
+    const MatcherPtr& ignores, TraverserThread& self, PathTable::Id id)
+{
+    // Visit the matches now, as processItem() would have.  Ignored entries
+    // are never Included, so need no check here.
+    auto& matches = self.batchEntries;
+    auto& ids = self.batchIds;
+    matches.clear();
+    ids.clear();
+    for(size_t i = 0; i < newEntries.size(); ++i) {
+        if(self.needleResults[i] != glob::PathCheckResult::Included) {
+            continue;
+        }
+
+        auto& newEntry = newEntries[i];
+        newEntry->depth = dir->depth + 1;
+        const PathTable::Id parent = (id != PathTable::NONE &&
+                                      PathTable::isChild(dir->canonPath,
+                                              newEntry->canonPath)) ?
+                                     id : PathTable::NONE;
+        PathTable::Id newId;
+        if(visit(parent, *newEntry, newId)) {
+            matches.push_back(std::move(newEntry));
+            ids.push_back(newId);
+        }
+        newEntry.reset();
+    }
+
+    if(matches.empty()) {
+        return;
+    }
+
+    SMALLCXX_TRAVERSE_LOG(TRACE, "processing %zu matches in %s",
+                          matches.size(), dir->canonPath.c_str());
+
+    auto& statuses = self.batchStatuses;
+    statuses.assign(matches.size(), IProcessEntry::Status::Continue);
+    auto status = IProcessEntry::Status::Stop;
+    {
+        std::lock_guard<std::mutex> lock(processMutex_);
+        if(!stop_) {
+            status = batch_->processBatch(matches.data(), matches.size(),
+                                          statuses);
+        }
+
+        if(status == IProcessEntry::Status::Continue &&
+                std::count(statuses.begin(), statuses.end(),
+                           IProcessEntry::Status::Stop)) {
+            status = IProcessEntry::Status::Stop;
+        }
+        if(status == IProcessEntry::Status::Stop) {
+            stop_ = true;   // before any other thread can call batch_
+        }
+    }
+
+    switch(status) {
+    case IProcessEntry::Status::Continue:
+        break;
+
+    case IProcessEntry::Status::Skip:
+        return;
+
+    case IProcessEntry::Status::Stop:
+        throw StopTraversal();
+        break;
+
+    default:
+        throw std::logic_error("Unimplemented status value " +
+                               std::to_string((int)status));
+        break;
+    }
+
+    // Read the directories the client didn't skip
+    size_t count = 0;
+    for(size_t i = 0; i < matches.size(); ++i) {
+        if(statuses[i] != IProcessEntry::Status::Continue &&
+                statuses[i] != IProcessEntry::Status::Skip) {
+            throw std::logic_error("Unimplemented status value " +
+                                   std::to_string((int)statuses[i]));
+        }
+        if(statuses[i] == IProcessEntry::Status::Skip ||
+                matches[i]->ty != EntryType::Dir) {
+            matches[i].reset();
+        } else {
+            ++count;
+        }
+    }
+
+    if(count == 0) {
+        return;
+    }
+
+    pending_ += count;
+    std::lock_guard<std::mutex> lock(self.itemsMutex);
+    for(size_t i = 0; i < matches.size(); ++i) {
+        if(matches[i]) {
+            self.items.emplace_back(std::move(matches[i]), ignores);
+            self.items.back().processed = true;
+            self.items.back().id = ids[i];
+        }
+    }
+} // Traverser::processBatch()
+
+template<class FileTree, class Processor>
+std::vector< std::shared_ptr<Entry> >
+Traverser<FileTree, Processor>::lookupChildren(
+    const smallcxx::glob::Path& dirPath, const DescentNode& node)
+{
+    std::vector< std::shared_ptr<Entry> > retval;
+
+    for(const auto& child : node.children) {
+        auto entry = fileTree_.lookup(dirPath + "/" + child.first);
+        if(!entry) {
+            SMALLCXX_TRAVERSE_LOG(TRACE, "%s/%s does not exist",
+                                  dirPath.c_str(), child.first.c_str());
+            continue;
+        }
+
+        SMALLCXX_TRAVERSE_LOG(TRACE, "Descending directly to %s",
+                              entry->canonPath.c_str());
+        if(!child.second.read && entry->ty == EntryType::Dir) {
+            descendAt(entry->canonPath, child.second);
+        }
+        retval.push_back(entry);
+    }
+
+    return retval;
+} // Traverser::lookupChildren()
+
+/// @todo Document and verify which paths have to end with a /
+template<class FileTree, class Processor>
+detail::MatcherPtr
+Traverser<FileTree, Processor>::loadIgnoreFiles(
+    const smallcxx::glob::Path& relativeTo_canonical,
+    std::vector<smallcxx::glob::Path> loadFrom,
+    MatcherPtr parentIgnores)
+{
+    const auto pathsToTry = ignorePaths(relativeTo_canonical, loadFrom);
+
+    // Check the cache.  Stamp the files before reading them so that a
+    // change while we read them is noticed next time.
+    bool useCache = (bool)ignoreCache_;
+    std::vector<FileStamp> stamps(pathsToTry.size());
+    for(size_t i = 0; useCache && i < pathsToTry.size(); ++i) {
+        if(!fileTree_.stamp(pathsToTry[i], stamps[i])) {
+            useCache = false;
+        }
+    }
+    if(useCache) {
+        auto cached = cachedIgnores(relativeTo_canonical, pathsToTry, stamps,
+                                    parentIgnores);
+        if(cached) {
+            return cached;
+        }
+    }
+
+    MatcherPtr retval(new glob::Matcher(parentIgnores));
+
+    for(size_t i = 0; i < loadFrom.size(); ++i) {
+        const auto& pathToTry = pathsToTry[i];
+        bool ok = false;
+        Bytes contents;
+
+        if(useCache && !stamps[i].exists) {
+            SMALLCXX_TRAVERSE_LOG(TRACE, "skipping non-existent "
+                                  "ignore-file candidate %s",
+                                  pathToTry.c_str());
+            continue;
+        }
+
+        const bool absolute = !loadFrom[i].empty() &&
+                              loadFrom[i].front() == '/';
+        const auto canonPath = absolute ? pathToTry :
+                               fileTree_.canonicalize(pathToTry);
+
+        if(!canonPath.empty()) {
+            try {
+                contents = fileTree_.readFile(canonPath);
+                ok = true;
+            } catch(...) {
+                ok = false;
+            }
+        }
+
+        if(ok) {
+            SMALLCXX_TRAVERSE_LOG(LOG, "Loaded ignore file %s",
+                                  pathToTry.c_str());
+        } else {
+            SMALLCXX_TRAVERSE_LOG(TRACE, "skipping non-existent or "
+                                  "unreadable ignore-file candidate %s",
+                                  pathToTry.c_str());
+
+            // The file may be readable next time without its stamp
+            // changing (e.g., if its permissions change), so don't
+            // remember that we couldn't read it.
+            if(useCache && stamps[i].exists) {
+                useCache = false;
+            }
+            continue;
+        }
+
+        retval->addIgnoreContents(contents, relativeTo_canonical);
+    }
+    retval->finalize();
+
+    if(flattenIgnores_) {
+        retval = std::make_shared<glob::Matcher>(retval->flattened());
+    }
+
+    if(useCache) {
+        cacheIgnores(relativeTo_canonical, pathsToTry, stamps, parentIgnores,
+                     retval);
+    }
+
+    return retval;
+} // Traverser::loadIgnoreFiles()
+
+#undef SMALLCXX_TRAVERSE_LOG
+
+// The instantiation globstari(IFileTree&, ...) uses is in the library
+extern template class Traverser<IFileTree, IProcessEntry>;
+
+// === globstari() =======================================================
+
+/// As globstari(IFileTree&, IProcessEntry&, const smallcxx::glob::Path&,
+/// const std::vector<smallcxx::glob::Path>&, const GlobstariOptions&),
+/// but calls @p fileTree and @p processEntry through their own types
+/// rather than through IFileTree and IProcessEntry.  The compiler can
+/// then inline the calls, e.g., to IFileTree::readDir() and
+/// IProcessEntry::operator()(), if they are not virtual or are `final`.
+/// For example:
+/// @code
+///     class MyTree final: public IFileTree { ... };
+///     struct MyProcessor final: public IProcessEntry { ... };
+///     MyTree tree;
+///     MyProcessor processor;
+///     globstari(tree, processor, "/", {"*.cpp"}, GlobstariOptions());
+/// @endcode
+///
+/// @tparam FileTree - has the public methods of IFileTree.  Deriving from
+///     IFileTree and marking the class or its methods `final` is the
+///     easiest way.
+/// @tparam Processor - has the public methods of IProcessEntry,
+///     including IProcessEntry::ignored().  Likewise.
+template<class FileTree, class Processor>
+void
+globstari(FileTree& fileTree,
+          Processor& processEntry,
+          const smallcxx::glob::Path& basePath,
+          const std::vector<smallcxx::glob::Path>& needle,
+          const GlobstariOptions& options)
+{
+    Traverser<FileTree, Processor> t(fileTree, processEntry, basePath, needle,
+                                     options);
+    t.run();
+}
+
+} // namespace smallcxx
+
+#endif // SMALLCXX_GLOBSTARI_TRAVERSE_HPP_
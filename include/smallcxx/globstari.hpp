@@ -10,6 +10,7 @@
 #define SMALLCXX_GLOBSTARI_HPP_
 
 #include <cstdint>
+#include <cstring>
 #include <initializer_list>
 #include <memory>
 #include <deque>
@@ -28,20 +29,179 @@ namespace smallcxx
 namespace glob
 {
 
-// --- GlobSet -----------------------------------------------------------
-
 /// A path or filename.  A convenience typedef, to permit future changes.
 using Path = std::string;
 
 /// Set of globs or paths
 using PathSet = std::unordered_set<smallcxx::glob::Path>;
 
+/// A non-owning, read-only reference to a path: a pointer and a length.
+/// Similar to C++17's `std::string_view`.  Implicitly constructible from
+/// a Path or a NUL-terminated string, so existing callers need not change.
+/// The referenced characters need not be NUL-terminated.
+/// @warning The referenced characters must outlive the PathView.
+class PathView
+{
+    const char *data_;
+    size_t size_;
+
+public:
+    PathView(): data_(""), size_(0) {}
+    PathView(const char *data, size_t size): data_(data), size_(size) {}
+    PathView(const char *str): data_(str), size_(strlen(str)) {}
+    PathView(const smallcxx::glob::Path& path)
+        : data_(path.data()), size_(path.size()) {}
+
+    const char *
+    data() const
+    {
+        return data_;
+    }
+
+    size_t
+    size() const
+    {
+        return size_;
+    }
+
+    bool
+    empty() const
+    {
+        return size_ == 0;
+    }
+
+    char
+    operator[](size_t idx) const
+    {
+        return data_[idx];
+    }
+
+    const char *
+    begin() const
+    {
+        return data_;
+    }
+
+    const char *
+    end() const
+    {
+        return data_ + size_;
+    }
+
+    /// Make an owning copy
+    smallcxx::glob::Path
+    str() const
+    {
+        return smallcxx::glob::Path(data_, size_);
+    }
+}; // class PathView
+
+inline bool
+operator==(const PathView& lhs, const PathView& rhs)
+{
+    return lhs.size() == rhs.size() &&
+           (lhs.size() == 0 || !memcmp(lhs.data(), rhs.data(), lhs.size()));
+}
+
+inline bool
+operator!=(const PathView& lhs, const PathView& rhs)
+{
+    return !(lhs == rhs);
+}
+
 /// Polarity of globs: include or exclude
 enum class Polarity {
     Include,   ///< includes (don't start with `!` in an ignore file)
     Exclude,   ///< excludes (start with `!` in an ignore file)
 };
 
+// --- MatchContext ------------------------------------------------------
+
+/// pimpl for MatchContext
+class MatchContextImpl;
+
+/// Scratch space used while testing paths against GlobSets and Matchers.
+///
+/// Matching needs working memory (e.g., PCRE2 match data).  A MatchContext
+/// owns that memory so it can be reused from one call to the next.  Once a
+/// MatchContext has been used with a particular GlobSet or Matcher, further
+/// checks against that GlobSet or Matcher using the same context do not
+/// allocate.
+///
+/// A MatchContext must only be used by one thread at a time.  Matching does
+/// not modify finalized GlobSets or Matchers, so any number of threads may
+/// check paths against the same GlobSet or Matcher concurrently, as long as
+/// each thread uses its own MatchContext.
+class MatchContext
+{
+    std::unique_ptr<MatchContextImpl> impl_;
+
+    friend class GlobSetImpl;
+
+public:
+    MatchContext();
+    ~MatchContext();
+
+    MatchContext(const MatchContext&) = delete;
+    MatchContext& operator=(const MatchContext&) = delete;
+
+    /// The context used by this thread for checks that are not given
+    /// an explicit MatchContext.
+    static MatchContext& forThisThread();
+
+}; // class MatchContext
+
+// --- GlobSet -----------------------------------------------------------
+
+/// How a GlobSet tests paths against its globs
+enum class MatchEngine {
+    /// Convert the globs to regexes and match them with PCRE2.
+    Pcre2,
+
+    /// Compile the globs into a deterministic finite automaton over the
+    /// bytes of the path.  Matching takes time linear in the length of the
+    /// path, regardless of the globs.  If the DFA would be too large, the
+    /// underlying NFA is simulated instead, which is still linear in the
+    /// length of the path.
+    ///
+    /// A path matches a glob with numeric ranges (`{n..m}`) if _any_ way
+    /// of splitting the path among the glob's parts puts numbers in range.
+    /// MatchEngine::Pcre2 only range-checks the first split the regex
+    /// engine finds, however many ranges the glob has: `*{-3..3}` does not
+    /// match `bx12-0`, since PCRE2 finds `0` (which is rejected, as are
+    /// all numbers starting with `0`) before `-0`.  Similarly,
+    /// MatchEngine::Pcre2 wraps each glob in an atomic group, so it only
+    /// tries the first way the glob matches a prefix of the path: `{a,ab}`
+    /// does not match `ab`, `*{.c,.cpp}` does not match `x.cpp`, and
+    /// `/d/**/x` does not match `/d/x/x`.  This engine tries every way,
+    /// so all of those match.  Also, a newline at the end of the path is
+    /// significant, whereas PCRE2's `$` ignores it.
+    Automaton,
+};
+
+/// Options controlling how a GlobSet compiles and matches its globs.
+struct GlobSetOptions {
+    /// Which engine to use.  Default MatchEngine::Pcre2.
+    MatchEngine engine = MatchEngine::Pcre2;
+
+    /// Compile regexes with the PCRE2 just-in-time compiler.  If the PCRE2
+    /// library does not support JIT (see jitAvailable()), or JIT compilation
+    /// of a particular regex fails, that regex falls back to the
+    /// interpreter.  Only used with MatchEngine::Pcre2.  Default false.
+    bool jit = false;
+
+    /// Match simple globs by table lookup rather than with the engine.
+    /// This covers literal paths, `**/name`, `**/*.ext`, and `*.ext`,
+    /// optionally preceded by a literal directory.  As with
+    /// MatchEngine::Automaton, a newline at the end of the path is
+    /// significant to those lookups.  Default true.
+    bool literalIndex = true;
+};
+
+/// Whether the PCRE2 library in use supports JIT compilation on this
+/// platform.
+bool jitAvailable();
+
 /// pimpl for GlobSet
 class GlobSetImpl;
 
@@ -55,16 +215,36 @@ class GlobSetImpl;
 ///
 /// All globs follow the [EditorConfig](https://editorconfig.org) format.
 /// @note Path entries are separated by `/` (forward slash) on all platforms!
+///
+/// Copies share their globs and compiled code, so copying is cheap.  A copy
+/// gets its own state the first time addGlob() or finalize() is called on it.
 class GlobSet
 {
-    std::unique_ptr<GlobSetImpl> impl_;
+    std::shared_ptr<GlobSetImpl> impl_;
+
+    /// Make sure impl_ is not shared with any other GlobSet
+    void detach();
 
 public:
 
+    /// Create a GlobSet using the default options.
+    /// See setDefaultOptions().
     GlobSet();
+
+    /// Create a GlobSet using the given options.
+    explicit GlobSet(const GlobSetOptions& options);
+
     GlobSet(const GlobSet& other);
+    GlobSet& operator=(const GlobSet& other);
     ~GlobSet();
 
+    /// Set the options used by GlobSet(), and therefore by every Matcher.
+    /// Only affects GlobSets created after the call.
+    static void setDefaultOptions(const GlobSetOptions& options);
+
+    /// Get the options used by GlobSet().
+    static GlobSetOptions defaultOptions();
+
     /// Add a single glob to the set.
     /// @note contains() cannot be used until you have called finalize().
     /// @throws std::runtime_error if finalized()
@@ -92,12 +272,77 @@ public:
     /// Whether finalize() has been called
     bool finalized() const;
 
+    /// The globs that have been added
+    const PathSet& globs() const;
+
+    /// Save the globs and their compiled form.  deserialize() can load the
+    /// result without recompiling.
+    /// @throws std::logic_error if not finalized()
+    std::string serialize() const;
+
+    /// Load a GlobSet saved by serialize().  The result is finalized and has
+    /// the options it was saved with.  If the data came from a different
+    /// version of smallcxx or PCRE2, the globs are recompiled.
+    /// @param[in]  data - the data, e.g., from a memory-mapped file.  Only
+    ///     used during the call.
+    /// @param[in]  size - the number of bytes of @p data
+    /// @throws std::runtime_error if @p data is not a serialized GlobSet,
+    ///     or is corrupt.  The compiled regexes are only checked
+    ///     superficially, so @p data must be the output of serialize(),
+    ///     stored where others cannot modify it.
+    static GlobSet deserialize(const void *data, size_t size);
+
     /// Returns true if the GlobSet contains @p path.
     /// @throws logic_error if finalize() has not been called.
     /// @param[in]  path - the path to check.  Must be either the empty
     ///     string (in which case it doesn't match) or an absolute path.
     /// @return True if @p path is in this GlobSet; false otherwise.
-    bool contains(const smallcxx::glob::Path& path) const;
+    bool contains(PathView path) const;
+
+    /// Returns true if the GlobSet contains @p path, using scratch space
+    /// from @p context.
+    /// @throws logic_error if finalize() has not been called.
+    /// @param[in]  path - as contains(PathView)
+    /// @param[in]  context - scratch space.  See MatchContext.
+    /// @return True if @p path is in this GlobSet; false otherwise.
+    bool contains(PathView path, MatchContext& context) const;
+
+    /// Check many paths at once.  Equivalent to calling contains() on each
+    /// path, but with less per-path overhead.
+    /// @throws logic_error if finalize() has not been called.
+    /// @param[in]  paths - the paths to check, as for contains()
+    /// @param[in]  count - the number of elements of @p paths
+    /// @return a vector of @p count elements; element `i` is
+    ///     `contains(paths[i])`.
+    std::vector<bool> containsMany(const PathView *paths,
+                                   size_t count) const;
+
+    /// As containsMany(const PathView *, size_t), but using scratch space
+    /// from @p context.
+    std::vector<bool> containsMany(const PathView *paths,
+                                   size_t count, MatchContext& context) const;
+
+    /// Check many paths at once, accumulating into @p results.
+    /// @throws logic_error if finalize() has not been called.
+    /// @param[in]  paths - the paths to check, as for contains()
+    /// @param[in]  count - the number of elements of @p paths
+    /// @param[in,out] results - must have @p count elements.  Paths whose
+    ///     results are already true are not checked.  Each other result
+    ///     is set to whether the GlobSet contains the corresponding path.
+    /// @param[in]  context - scratch space.  See MatchContext.
+    void containsMany(const PathView *paths, size_t count,
+                      std::vector<bool>& results, MatchContext& context) const;
+
+    /// Might this GlobSet contain any path under directory @p dir?
+    /// May return true even if it can't, but returns false only if it
+    /// definitely can't.
+    /// @param[in]  dir - the directory, with or without a trailing `/`.
+    ///     Paths under it are those starting with @p dir and a `/`.
+    /// @throws std::logic_error if not finalized()
+    bool canMatchUnder(PathView dir) const;
+
+    /// As canMatchUnder(PathView), but using scratch space from @p context.
+    bool canMatchUnder(PathView dir, MatchContext& context) const;
 
 }; // class GlobSet
 
@@ -183,8 +428,7 @@ public:
     /// E.g., if @p path is `/foo` and @p glob is `*.txt`, only
     /// `/foo/*.txt` will match.  However, if @p glob is `**/*.txt`,
     /// `/foo/bar/*.txt` will also match.
-    void addGlob(const smallcxx::glob::Path& glob,
-                 const smallcxx::glob::Path& path);
+    void addGlob(PathView glob, PathView path);
 
     /// Add multiple globs to the matcher.
     /// Templated so you can use vectors or initializer_lists.
@@ -208,6 +452,15 @@ public:
         }
     }
 
+    /// Add the globs in the text of an ignore file, relative to a path.
+    /// Each line holds one glob.  Leading and trailing whitespace is
+    /// removed, as is anything from an unescaped `#` onwards.  Empty lines
+    /// are skipped.
+    /// @param[in]  contents - the text
+    /// @param[in]  path - where the globs should be anchored, as
+    ///     addGlob(PathView, PathView)
+    void addIgnoreContents(PathView contents, PathView path);
+
     /// Call this once all the globs have been added
     void
     finalize();
@@ -216,6 +469,36 @@ public:
     bool
     ready() const;
 
+    /// Make a Matcher that gives the same results as this one, but has no
+    /// delegate.  Its globsets are those of the delegate chain, outermost
+    /// first, then this one's, with neighbouring globsets of the same
+    /// polarity merged into one.  A path then needs at most one check per
+    /// change of polarity, however long the chain.
+    ///
+    /// Globsets that are not merged are shared with this Matcher, not
+    /// copied.  Merged ones are compiled afresh.
+    /// @throws std::logic_error if not ready()
+    Matcher flattened() const;
+
+    /// Save the globs and their compiled form.  deserialize() can load the
+    /// result without recompiling.  The delegate is not saved.
+    /// @throws std::logic_error if not ready()
+    std::string serialize() const;
+
+    /// Load a Matcher saved by serialize().  The result is ready().
+    /// See GlobSet::deserialize().
+    /// @param[in]  data - the data, e.g., from a memory-mapped file.  Only
+    ///     used during the call.
+    /// @param[in]  size - the number of bytes of @p data
+    /// @param[in]  delegate - The Matcher to delegate to for unknown results.
+    ///     Optional; default nullptr.
+    /// @throws std::runtime_error if @p data is not a serialized Matcher,
+    ///     or is corrupt.  As with GlobSet::deserialize(), @p data must be
+    ///     the output of serialize(), stored where others cannot modify it.
+    static Matcher deserialize(const void *data, size_t size,
+                               const std::shared_ptr<Matcher>& delegate =
+                                   nullptr);
+
     /// Check whether the Matcher contains @p path.
     /// @param[in]  path - the path to check.  Must be either the empty
     ///     string (in which case it doesn't match) or an absolute path.
@@ -229,7 +512,11 @@ public:
     ///     polarity, or
     ///   - there are no globsets in the Matcher.
     bool
-    contains(const smallcxx::glob::Path& path) const;
+    contains(PathView path) const;
+
+    /// As contains(PathView), but using scratch space from @p context.
+    bool
+    contains(PathView path, MatchContext& context) const;
 
     /// Check whether @p path is included, excluded, or not in this Matcher.
     /// @param[in]  path - the path to check.  Must be either the empty
@@ -242,7 +529,52 @@ public:
     ///   - @p path does not match any globset in the Matcher, regardless of
     ///     polarity, or
     ///   - there are no globsets in the Matcher.
-    PathCheckResult check(const smallcxx::glob::Path& path) const;
+    PathCheckResult check(PathView path) const;
+
+    /// As check(PathView), but using scratch space from @p context.
+    /// The same @p context is used for any delegates.
+    PathCheckResult check(PathView path, MatchContext& context) const;
+
+    /// Check many paths at once.  Equivalent to calling check() on each
+    /// path, but with less per-path overhead.
+    /// @param[in]  paths - the paths to check, as for check()
+    /// @param[in]  count - the number of elements of @p paths
+    /// @throws logic_error if not ready().
+    /// @return a vector of @p count elements; element `i` is
+    ///     `check(paths[i])`.
+    std::vector<PathCheckResult> checkMany(const PathView *paths,
+                                           size_t count) const;
+
+    /// As checkMany(const PathView *, size_t), but using scratch space
+    /// from @p context.
+    std::vector<PathCheckResult> checkMany(const PathView *paths,
+                                           size_t count,
+                                           MatchContext& context) const;
+
+    /// Check many paths at once, accumulating into @p results.
+    /// @param[in]  paths - the paths to check, as for check()
+    /// @param[in]  count - the number of elements of @p paths
+    /// @param[in,out] results - must have @p count elements.  Only paths
+    ///     whose results are PathCheckResult::Unknown are checked.  Their
+    ///     results are set to what check() would return.
+    /// @param[in]  context - scratch space.  See MatchContext.  The same
+    ///     @p context is used for any delegates.
+    /// @throws logic_error if not ready().
+    void checkMany(const PathView *paths, size_t count,
+                   std::vector<PathCheckResult>& results,
+                   MatchContext& context) const;
+
+    /// Might contains() be true for any path under directory @p dir?
+    /// May return true even if not, but returns false only if no path
+    /// under @p dir can be included.  Used to avoid searching directories
+    /// that can't contain any matches.
+    /// @param[in]  dir - an absolute path, with or without a trailing `/`
+    /// @throws logic_error if not ready().
+    bool canMatchUnder(PathView dir) const;
+
+    /// As canMatchUnder(PathView), but using scratch space from @p context.
+    /// The same @p context is used for any delegates.
+    bool canMatchUnder(PathView dir, MatchContext& context) const;
 
 }; // class Matcher
 
@@ -293,6 +625,18 @@ struct Entry {
     /// meaning.
     int depth;
 
+    /// @name File identity
+    /// The device and inode number of the file or directory, if the
+    /// IFileTree fills them in; otherwise 0.  globstari() reads only one
+    /// directory with each nonzero (@c dev, @c ino), so trees that reach
+    /// the same directory by more than one path, e.g., through symlinks,
+    /// can't make it loop.  Each path is still checked against the
+    /// needle and reported, but only the first one read is descended into.
+    /// @{
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+    /// @}
+
     Entry(EntryType newTy, const smallcxx::glob::Path& newCanonPath,
           int newDepth = -1)
         : ty(newTy), canonPath(newCanonPath), depth(newDepth) {}
@@ -305,17 +649,57 @@ struct Entry {
 
 }; // struct Entry
 
+/// Identifies one version of a file, so IgnoreCache can tell whether the
+/// file has changed.
+struct FileStamp {
+    bool exists = false;    ///< if false, the other fields are unused
+    uint64_t dev = 0;       ///< device
+    uint64_t ino = 0;       ///< inode number
+    uint64_t mtimeNs = 0;   ///< modification time, ns since the epoch
+    uint64_t size = 0;      ///< size in bytes
+
+    bool
+    operator==(const FileStamp& other) const
+    {
+        if(exists != other.exists) {
+            return false;
+        }
+        return !exists || (dev == other.dev && ino == other.ino &&
+                           mtimeNs == other.mtimeNs && size == other.size);
+    }
+
+    bool
+    operator!=(const FileStamp& other) const
+    {
+        return !(*this == other);
+    }
+}; // struct FileStamp
+
 /// Access to a hierarchical tree of files (not necessarily on disk).
 /// Implemented by users of GlobstariBase.
 class IFileTree
 {
 public:
 
+    /// Create an entry.  DiskFileTree creates all its entries with this,
+    /// so override it to use an Entry subclass.  Implementations of
+    /// readDir() and lookup() may use it too.
+    ///
+    /// The default implementation returns a smallcxx::Entry instance from
+    /// a pool shared by all IFileTrees.  Pooled entries are recycled
+    /// when freed rather than returned to the heap.
+    ///
+    /// @param[in]  ty - see Entry::ty
+    /// @param[in]  canonPath - see Entry::canonPath
+    /// @return the new Entry
+    virtual std::shared_ptr<Entry> makeEntry(EntryType ty,
+            const smallcxx::glob::Path& canonPath);
+
     /// Create an entry for the root dir itself, as opposed to its contents.
     /// This function exists so you can use Entry subclasses uniformly
     /// throughout a globstari() call.
     ///
-    /// The default implementation returns a smallcxx::Entry instance.
+    /// The default implementation calls makeEntry().
     ///
     /// @param[in]  rootPath - where to start.  Canonicalized.
     /// @return the new Entry
@@ -337,6 +721,30 @@ public:
     virtual std::vector< std::shared_ptr<Entry> > readDir(const
             smallcxx::glob::Path& dirName) = 0;
 
+    /// Returns the entry for a single path, without reading the rest of
+    /// its directory.  Used to descend directly to the directories
+    /// the needle names.
+    ///
+    /// The default implementation calls readDir() on the parent of @p path.
+    ///
+    /// @param[in]  path - the path: a directory readDir() has returned (or
+    ///     the root), then `/`, then a name.
+    /// @return The entry, as readDir() would have returned it, or nullptr
+    ///     if readDir() would not have returned it.
+    /// @throws std::system_error if the parent of @p path is unreadable.
+    virtual std::shared_ptr<Entry> lookup(const smallcxx::glob::Path& path);
+
+    /// Called when globstari() has found @p entries in a directory and is
+    /// about to visit them, so implementations can start the I/O for
+    /// many directories at once.  Entry::ignored is filled in; globstari()
+    /// won't visit ignored entries unless Entry::neverIgnore is set.
+    ///
+    /// The default implementation does nothing.
+    ///
+    /// @param[in]  entries - the entries, as readDir() or lookup()
+    ///     returned them
+    virtual void prefetch(const std::vector< std::shared_ptr<Entry> >& entries);
+
     /// Returns a list of ignore files to load, if they exist, for @p dirName.
     /// @param[in]  dirName - the canonical path to the directory
     /// @return A list of zero or more ignore paths, absolute or relative.-
@@ -358,6 +766,18 @@ public:
     /// @throws Exception (any) if an error occurs
     virtual Bytes readFile(const smallcxx::glob::Path& path) = 0;
 
+    /// Check whether a file exists and, if so, which version of it.
+    /// Used by IgnoreCache.  Should follow symlinks, as readFile() does.
+    ///
+    /// The default implementation returns false, so ignore files from
+    /// this tree are never cached.
+    ///
+    /// @param[in]  path - the path to the file, not necessarily canonical
+    /// @param[out] stamp - the result.  @c stamp.exists is false if
+    ///     @p path does not exist.
+    /// @return false if the stamp could not be determined
+    virtual bool stamp(const smallcxx::glob::Path& path, FileStamp& stamp);
+
     /// Canonicalize a path.
     /// @param[in]  path - the path to canonicalize
     /// @return
@@ -404,13 +824,136 @@ public:
     /// The entry can be a directory or a file.
     ///
     /// @note This function is called for all (and only) ignored entries in the
-    ///     tree.  This is not called for non-ignored entries that do not
-    ///     match any @c needle.
+    ///     tree, except those in directories skipped because of
+    ///     GlobstariOptions::pruneDirs.  This is not called for non-ignored
+    ///     entries that do not match any @c needle.
     ///
     /// @param[in]  entry - the entry
     virtual void ignored(const std::shared_ptr<Entry>& entry);
 };
 
+/// An IProcessEntry that takes all the matches in a directory at once,
+/// e.g., to hash their names together or to save them in one database
+/// transaction.  globstari() calls processBatch() with the entries in each
+/// directory that match the needle, as soon as it has read the directory,
+/// and calls operator()() only for the base path.  Ignored entries are
+/// still passed to ignored() one at a time.
+///
+/// Each directory's matches are therefore processed together, before any
+/// entries under them, whatever the GlobstariOptions::order.  GlobstariWalk
+/// does not call processBatch().
+class IProcessEntryBatch: public IProcessEntry
+{
+public:
+    /// Process entries in the same directory.
+    /// @param[in]  entries - the entries
+    /// @param[in]  count - the number of elements of @p entries
+    /// @param[in,out] statuses - @p count elements, all
+    ///     IProcessEntry::Status::Continue when called.  Set element `i`
+    ///     to what operator()() would return for `entries[i]`.
+    /// @return IProcessEntry::Status::Continue to use @p statuses,
+    ///     IProcessEntry::Status::Skip to skip every directory in
+    ///     @p entries, or IProcessEntry::Status::Stop to stop.
+    virtual IProcessEntry::Status processBatch(
+        const std::shared_ptr<Entry> *entries, size_t count,
+        std::vector<IProcessEntry::Status>& statuses) = 0;
+
+    /// Calls processBatch() with just @p entry
+    IProcessEntry::Status operator()(const std::shared_ptr<Entry>& entry)
+    override;
+};
+
+/// Order in which globstari() visits entries
+enum class TraversalOrder {
+    BreadthFirst,   ///< everything at one depth before anything deeper
+    DepthFirst,     ///< everything in a directory before its siblings
+};
+
+class IgnoreCacheImpl;
+
+/// Ignore files that have been loaded, parsed and compiled, kept so later
+/// globstari() calls on the same tree can reuse them.  Each directory's
+/// ignores are reused as long as IFileTree::stamp() reports the same
+/// stamps for its ignore-file candidates, including the ones that didn't
+/// exist, and its parent directory's ignores were reused.
+///
+/// Thread-safe.  Copies share the same cache.
+class IgnoreCache
+{
+    friend class TraverserBase;
+    std::shared_ptr<IgnoreCacheImpl> impl_;
+
+public:
+    IgnoreCache();
+    ~IgnoreCache() = default;
+
+    /// Number of directories whose ignores are cached
+    size_t size() const;
+
+    /// How many directories' ignores have been reused
+    size_t hits() const;
+
+    /// How many directories' ignores had to be loaded
+    size_t misses() const;
+
+    /// Forget everything
+    void clear();
+}; // class IgnoreCache
+
+/// Options controlling a globstari() traversal
+struct GlobstariOptions {
+    /// Maximum recursion depth.  -1 for unlimited.
+    ssize_t maxDepth = -1;
+
+    /// Don't read directories (or their ignore files) when no path under
+    /// them can match the needle.  E.g., with needle `src/**/*.cpp`,
+    /// don't look inside `build/`.  Also, if every needle starts with a
+    /// literal directory, such as `src/lib/` in `src/lib/**/*.cpp`, go
+    /// straight there using IFileTree::lookup() rather than reading the
+    /// directories above it.  Needles that name a finite set of paths,
+    /// such as `config/app.yaml` or `/{Makefile,CMakeLists.txt}`, are
+    /// looked up directly without reading any directory.  The ignore
+    /// files along the way are still loaded and applied.  Default false,
+    /// since IProcessEntry::ignored() is not called for anything in a
+    /// pruned directory.
+    bool pruneDirs = false;
+
+    /// Order to visit entries in.  Breadth-first holds a whole level of
+    /// the tree in memory at once; depth-first holds at most about
+    /// (depth x entries per directory).
+    TraversalOrder order = TraversalOrder::BreadthFirst;
+
+    /// With TraversalOrder::BreadthFirst, go depth-first whenever more than
+    /// this many entries are waiting to be visited, until no more than this
+    /// many are.  Bounds memory use on wide trees.  Per thread.  0 for no
+    /// limit.
+    size_t maxFrontier = 0;
+
+    /// Number of threads to read directories with.  0 means one per core.
+    /// With more than one thread:
+    /// - The IFileTree's methods are called from several threads at once,
+    ///     so must be thread-safe.  DiskFileTree is.
+    /// - The IProcessEntry is called from one thread at a time, but not
+    ///     always the same thread, and entries are found in no
+    ///     particular order.  Once it returns IProcessEntry::Status::Stop,
+    ///     it is not called again.
+    /// - An exception thrown on any thread stops the traversal and is
+    ///     rethrown from globstari().
+    unsigned threads = 1;
+
+    /// If set, reuse ignore files loaded by previous calls that used the
+    /// same cache, and save the ones this call loads.  The IFileTree must
+    /// implement IFileTree::stamp(); DiskFileTree does.
+    std::shared_ptr<IgnoreCache> ignoreCache;
+
+    /// Merge each directory's ignores with those of the directories above
+    /// it, using Matcher::flattened(), so that checking a path costs about
+    /// the same at any depth.  This costs a compile per directory that
+    /// has ignore files, so is best for deep trees with few ignore files.
+    /// Default false.
+    bool flattenIgnores = false;
+};
+
 /// Find files, inside the hierarchy accessible through @p fileTree,
 /// that are under @p basePath and match @p needle.
 /// @param[in]  fileTree - Access to the hierarchy to search
@@ -419,7 +962,7 @@ public:
 /// @param[in]  needle - EditorConfig-style globs indicating the files
 ///     to find.  These are with respect to @p basePath.
 ///     **Note** @p needle must not be empty.
-/// @param[in]  maxDepth - maximum recursion depth.  -1 for unlimited.
+/// @param[in]  options - see GlobstariOptions
 ///
 /// Bear in mind:
 /// - All globs follow the [EditorConfig](https://editorconfig.org) format.
@@ -437,25 +980,145 @@ public:
 ///
 /// "Globstari" = supports _glob_, glob_star_, and _i_gnores.
 ///
-/// @todo @parblock
-/// - Symlinks?
-/// - If so, symlink-loop checking?
-/// @endparblock
+/// Symlinks are followed if @p fileTree lists them as files or
+/// directories.  To protect against loops, have @p fileTree fill in
+/// Entry::dev and Entry::ino, as DiskFileTree does when following
+/// symlinks.
+///
+/// To call @p fileTree and @p processEntry without virtual dispatch, see
+/// smallcxx/globstari-traverse.hpp.
+void globstari(IFileTree& fileTree,
+               IProcessEntry& processEntry,
+               const smallcxx::glob::Path& basePath,
+               const std::vector<smallcxx::glob::Path>& needle,
+               const GlobstariOptions& options);
+
+/// As globstari(IFileTree&, IProcessEntry&, const smallcxx::glob::Path&,
+/// const std::vector<smallcxx::glob::Path>&, const GlobstariOptions&),
+/// but with default options except for @p maxDepth.
+/// @param[in]  maxDepth - maximum recursion depth.  -1 for unlimited.
 void globstari(IFileTree& fileTree,
                IProcessEntry& processEntry,
                const smallcxx::glob::Path& basePath,
                const std::vector<smallcxx::glob::Path>& needle,
                ssize_t maxDepth = -1);
 
+template<class FileTree, class Processor> class Traverser;
+
+/// Pull-based alternative to globstari().  Each call to next() runs the
+/// traversal just far enough to find the next matching entry, so the
+/// caller can handle results as they are found, stop at any time by
+/// destroying the GlobstariWalk, or spread a walk across the iterations
+/// of an event loop.  For example:
+/// @code
+///     GlobstariWalk walk(fileTree, basePath, {"*.cpp"});
+///     while(auto entry = walk.next()) {
+///         // ...
+///     }
+/// @endcode
+///
+/// Finds the same entries as globstari(), in the same order, on the
+/// calling thread.  GlobstariOptions::threads is ignored, and ignored
+/// entries are not reported.
+class GlobstariWalk
+{
+    std::unique_ptr< Traverser<IFileTree, IProcessEntry> > traverser_;
+
+public:
+    /// Prepare to walk.  Does not read anything but @p basePath's
+    /// canonical path.  Parameters are as globstari().
+    /// @throws AssertionFailure if @p needle is empty.
+    GlobstariWalk(IFileTree& fileTree,
+                  const smallcxx::glob::Path& basePath,
+                  const std::vector<smallcxx::glob::Path>& needle,
+                  const GlobstariOptions& options = GlobstariOptions());
+
+    GlobstariWalk(const GlobstariWalk&) = delete;
+    GlobstariWalk& operator=(const GlobstariWalk&) = delete;
+    ~GlobstariWalk();
+
+    /// Find the next entry that matches the needle.
+    /// If the previous entry was a directory, first read it unless skip()
+    /// was called.
+    /// @return the entry, or nullptr if there are no more.
+    /// @throws anything the IFileTree throws.  The walk is then done().
+    std::shared_ptr<Entry> next();
+
+    /// As next(), but visit at most @p maxVisits entries (matching or not)
+    /// before returning.  For time-slicing a walk.  0 for no limit.
+    /// @return the entry, or nullptr if there are no more or if
+    ///     @p maxVisits entries were visited without finding one.  Use
+    ///     done() to tell which.
+    std::shared_ptr<Entry> next(size_t maxVisits);
+
+    /// Don't look inside the directory the last next() returned.  Like
+    /// returning IProcessEntry::Status::Skip from globstari()'s callback.
+    void skip();
+
+    /// Whether the walk has finished
+    bool done() const;
+}; // class GlobstariWalk
+
+class DirFdCache;
+class AsyncDirIo;
+
 /// Access to files on disk.  For use with globstari().
 /// Assumes the root directory of the filesystem is the
 class DiskFileTree: public IFileTree
 {
+    /// Open directories.  Null unless the ctor's @c maxOpenDirs is nonzero.
+    /// Shared between copies.
+    std::shared_ptr<DirFdCache> dirFds_;
+
+    /// Asynchronous I/O for prefetch().  Null unless the ctor's
+    /// @c asyncIo is true and io_uring is available.  Shared between
+    /// copies.
+    std::shared_ptr<AsyncDirIo> asyncIo_;
+
+    /// Whether to list symlinks as what they point to
+    bool followSymlinks_;
+
 public:
+    /// Ctor.
+    /// @param[in]  maxOpenDirs - if nonzero, keep up to this many
+    ///     directories open, and find the contents of an open directory
+    ///     relative to it (`openat(2)`, `fstatat(2)`) rather than by full
+    ///     path.  Then the kernel only has to look up one path component
+    ///     for each directory globstari() reads, however deep it is.  Each
+    ///     open directory uses a file descriptor.
+    /// @param[in]  asyncIo - if true, and @p maxOpenDirs is nonzero,
+    ///     prefetch() opens the directories globstari() is about to visit,
+    ///     and checks for their ignore files, all at once using Linux's
+    ///     io_uring.  Ignored if io_uring is not available.  rootDir()
+    ///     forgets the checks, so each traversal makes its own.
+    /// @param[in]  followSymlinks - if true, readDir() and lookup() list
+    ///     symlinks to files and directories as files and directories,
+    ///     with Entry::canonPath the path through the symlink, and fill in
+    ///     Entry::dev and Entry::ino so globstari() reads each directory
+    ///     once.  If false, symlinks are skipped.  Directories' inode
+    ///     numbers come from readDir() without a stat(2) call, so a mount
+    ///     point may be read once by its own path and once through a
+    ///     symlink, but not more.
+    explicit DiskFileTree(size_t maxOpenDirs = 0, bool asyncIo = false,
+                          bool followSymlinks = false);
+
+    /// Whether prefetch() uses asynchronous I/O
+    bool
+    hasAsyncIo() const
+    {
+        return !!asyncIo_;
+    }
+
     virtual ~DiskFileTree() = default;
+    std::shared_ptr<Entry> rootDir(const smallcxx::glob::Path& rootPath)
+    override;
     std::vector< std::shared_ptr<Entry> > readDir(const smallcxx::glob::Path&
             dirName) override;
+    std::shared_ptr<Entry> lookup(const smallcxx::glob::Path& path) override;
+    void prefetch(const std::vector< std::shared_ptr<Entry> >& entries)
+    override;
     Bytes readFile(const smallcxx::glob::Path& path) override;
+    bool stamp(const smallcxx::glob::Path& path, FileStamp& stamp) override;
     smallcxx::glob::Path canonicalize(const smallcxx::glob::Path& path) const
     override;
 }; // class GlobstariDisk
@@ -0,0 +1,1082 @@
+/// @file src/globstari-automaton.cpp
+/// @brief globstar + ignore routines --- finite-automaton glob engine.
+/// @details Part of smallcxx.  Implements MatchEngine::Automaton.
+///
+/// Globs are first converted to regex source by globToRegexSrc(), so both
+/// engines interpret globs identically.  That source only uses a small
+/// subset of PCRE2 syntax, which is parsed here into a Thompson NFA.
+/// Numeric ranges (`{n..m}`) become sub-automata accepting exactly the
+/// numerals that MatchEngine::Pcre2 would accept.  The NFA is then
+/// converted to a DFA by subset construction.
+///
+/// @author Christopher White <cxwembedded@gmail.com>
+/// @copyright Copyright (c) 2021--2022 Christopher White
+/// SPDX-License-Identifier: BSD-3-Clause
+
+#define SMALLCXX_LOG_DOMAIN "glob"
+
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <string.h>
+
+#include "smallcxx/globstari.hpp"
+#include "smallcxx/logging.hpp"
+#include "smallcxx/string.hpp"
+
+#include "globstari-impl.hpp"
+
+using namespace std;
+
+namespace smallcxx
+{
+namespace glob
+{
+
+// === NFA ===============================================================
+
+/// A set of bytes
+using ByteSet = std::bitset<256>;
+
+/// Sentinel for "no state"
+static constexpr uint32_t NO_STATE = UINT32_MAX;
+
+/// Beyond this many states, simulate the NFA rather than building a DFA.
+static constexpr size_t DFA_MAX_STATES = 4096;
+
+/// How globToRegexSrc() represents a numeric range
+static const char RANGE_PLACEHOLDER[] = "([\\+\\-]?\\d+)";
+
+/// The lowest byte in @p bytes, which must not be empty
+static int
+firstByte(const ByteSet& bytes)
+{
+    int b = 0;
+    while(!bytes[b]) {
+        ++b;
+    }
+    return b;
+}
+
+/// Nondeterministic finite automaton with epsilon transitions.
+/// Each state has at most one byte transition.
+struct Nfa {
+    struct State {
+        ByteSet on;                 ///< bytes that lead to @c next
+        uint32_t next = NO_STATE;   ///< where a byte in @c on leads
+        std::vector<uint32_t> eps;  ///< epsilon transitions
+    };
+
+    std::vector<State> states;
+    uint32_t start = NO_STATE;
+    uint32_t accept = NO_STATE;
+
+    /// Add a new state and return its index
+    uint32_t
+    add()
+    {
+        states.emplace_back();
+        return (uint32_t)(states.size() - 1);
+    }
+
+    /// Add an epsilon transition
+    void
+    eps(uint32_t from, uint32_t to)
+    {
+        states[from].eps.push_back(to);
+    }
+
+    /// Add a transition from @p from to @p to on any byte in @p bytes.
+    void
+    edge(uint32_t from, const ByteSet& bytes, uint32_t to)
+    {
+        const auto via = add();
+        eps(from, via);
+        states[via].on = bytes;
+        states[via].next = to;
+    }
+
+    /// Add a transition from @p from to @p to on byte @p c.
+    void
+    edge(uint32_t from, unsigned char c, uint32_t to)
+    {
+        ByteSet bytes;
+        bytes.set(c);
+        edge(from, bytes, to);
+    }
+}; // struct Nfa
+
+/// A portion of an NFA having a single entry and a single exit
+struct Frag {
+    uint32_t in;
+    uint32_t out;
+};
+
+// --- Numeric ranges ----------------------------------------------------
+
+/// Add transitions from @p from to @p to accepting exactly @p n digits.
+static void
+anyDigits(Nfa& nfa, size_t n, uint32_t from, uint32_t to)
+{
+    ByteSet digits;
+    for(char c = '0'; c <= '9'; ++c) {
+        digits.set((unsigned char)c);
+    }
+
+    auto curr = from;
+    for(size_t i = 0; i < n; ++i) {
+        const auto next = (i + 1 == n) ? to : nfa.add();
+        nfa.edge(curr, digits, next);
+        curr = next;
+    }
+    if(n == 0) {
+        nfa.eps(from, to);
+    }
+}
+
+/// Add transitions from @p from to @p to accepting digit strings between
+/// @p lo and @p hi, inclusive.  @p lo and @p hi must be the same length.
+static void
+sameLengthRange(Nfa& nfa, const string& lo, const string& hi,
+                uint32_t from, uint32_t to)
+{
+    const size_t n = lo.size();
+    if(n == 0) {
+        nfa.eps(from, to);
+        return;
+    }
+
+    if(lo.find_first_not_of('0') == lo.npos &&
+            hi.find_first_not_of('9') == hi.npos) {
+        anyDigits(nfa, n, from, to);
+        return;
+    }
+
+    if(lo[0] == hi[0]) {
+        const auto mid = nfa.add();
+        nfa.edge(from, lo[0], mid);
+        sameLengthRange(nfa, lo.substr(1), hi.substr(1), mid, to);
+        return;
+    }
+
+    // lo[0] followed by anything from lo[1:] to 99...9
+    const auto lowMid = nfa.add();
+    nfa.edge(from, lo[0], lowMid);
+    sameLengthRange(nfa, lo.substr(1), string(n - 1, '9'), lowMid, to);
+
+    // Any digit strictly between lo[0] and hi[0], then any n-1 digits
+    if(hi[0] - lo[0] > 1) {
+        ByteSet between;
+        for(char c = lo[0] + 1; c < hi[0]; ++c) {
+            between.set((unsigned char)c);
+        }
+        const auto mid = nfa.add();
+        nfa.edge(from, between, mid);
+        anyDigits(nfa, n - 1, mid, to);
+    }
+
+    // hi[0] followed by anything from 00...0 to hi[1:]
+    const auto highMid = nfa.add();
+    nfa.edge(from, hi[0], highMid);
+    sameLengthRange(nfa, string(n - 1, '0'), hi.substr(1), highMid, to);
+} // sameLengthRange()
+
+/// Add transitions from @p from to @p to accepting the decimal numerals,
+/// without leading zeros, of every value in [@p lo, @p hi].
+static void
+decimalRange(Nfa& nfa, uintmax_t lo, uintmax_t hi, uint32_t from, uint32_t to)
+{
+    if(lo > hi) {
+        return;
+    }
+
+    const string loStr = to_string(lo), hiStr = to_string(hi);
+    for(size_t len = loStr.size(); len <= hiStr.size(); ++len) {
+        const string first = (len == loStr.size()) ? loStr :
+                             ('1' + string(len - 1, '0'));
+        const string last = (len == hiStr.size()) ? hiStr : string(len, '9');
+        sameLengthRange(nfa, first, last, from, to);
+    }
+}
+
+/// Magnitude of non-positive @p v, without overflow
+static uintmax_t
+magnitude(Int v)
+{
+    return (uintmax_t)(-(v + 1)) + 1;
+}
+
+/// Add a loop accepting zero or more `0` characters after @p from.
+/// @return the state after the loop
+static uint32_t
+zeros(Nfa& nfa, uint32_t from)
+{
+    const auto loop = nfa.add();
+    nfa.eps(from, loop);
+    nfa.edge(loop, '0', loop);
+    return loop;
+}
+
+/// Build a fragment accepting what a numeric-range glob accepts.
+///
+/// MatchEngine::Pcre2 matches `[+-]?\d+`, then rejects the numeral if it
+/// starts with `0` or if its value is out of range.  Therefore, the
+/// accepted numerals for a value `v` in range are:
+/// - `v` itself, if `v > 0`;
+/// - `+`, any number of `0`s, then `v`, if `v >= 0`; and
+/// - `-`, any number of `0`s, then `-v`, if `v <= 0`.
+static Frag
+rangeFrag(Nfa& nfa, const IntPair& range)
+{
+    const Frag frag{nfa.add(), nfa.add()};
+    const Int lo = range.first, hi = range.second;
+
+    if(lo > hi) {
+        return frag;    // matches nothing
+    }
+
+    if(hi >= 0) {
+        const uintmax_t posLo = (lo > 0) ? (uintmax_t)lo : 0;
+        decimalRange(nfa, max<uintmax_t>(posLo, 1), (uintmax_t)hi,
+                     frag.in, frag.out);
+
+        const auto plus = nfa.add();
+        nfa.edge(frag.in, '+', plus);
+        decimalRange(nfa, posLo, (uintmax_t)hi, zeros(nfa, plus), frag.out);
+    }
+
+    if(lo <= 0) {
+        const auto minus = nfa.add();
+        nfa.edge(frag.in, '-', minus);
+        decimalRange(nfa, (hi < 0) ? magnitude(hi) : 0, magnitude(lo),
+                     zeros(nfa, minus), frag.out);
+    }
+
+    return frag;
+} // rangeFrag()
+
+// --- Regex parser ------------------------------------------------------
+
+/// Converts the regex source produced by globToRegexSrc() into an NFA.
+class RegexToNfa
+{
+    Nfa& nfa_;
+    const string& src_;
+    const RangePairs& ranges_;
+    size_t pos_ = 0;            ///< current position in src_
+    size_t nextRange_ = 0;      ///< next unused element of ranges_
+
+public:
+    RegexToNfa(Nfa& nfa, const string& src, const RangePairs& ranges)
+        : nfa_(nfa), src_(src), ranges_(ranges)
+    {}
+
+    /// Parse the whole of the source.
+    /// @throws std::runtime_error on a syntax error
+    Frag
+    parse()
+    {
+        const auto frag = alternation();
+        if(pos_ != src_.size()) {
+            fail("unmatched `)'");
+        }
+        if(nextRange_ != ranges_.size()) {
+            fail("numeric ranges not all used");
+        }
+        return frag;
+    }
+
+private:
+    [[noreturn]] void
+    fail(const char *why) const
+    {
+        throw runtime_error(STR_OF << "Could not compile regex >>" << src_
+                            << "<<: " << why << " at offset " << pos_);
+    }
+
+    bool
+    at(char c) const
+    {
+        return pos_ < src_.size() && src_[pos_] == c;
+    }
+
+    bool
+    atString(const char *s) const
+    {
+        return src_.compare(pos_, strlen(s), s) == 0;
+    }
+
+    /// Fragment matching one byte from @p bytes
+    Frag
+    bytesFrag(const ByteSet& bytes)
+    {
+        const Frag frag{nfa_.add(), nfa_.add()};
+        nfa_.states[frag.in].on = bytes;
+        nfa_.states[frag.in].next = frag.out;
+        return frag;
+    }
+
+    Frag alternation();
+    Frag concatenation();
+    Frag atom();
+    Frag quantified(Frag frag);
+    ByteSet bracket();
+
+    /// Parse the escape sequence at the current position, which must be
+    /// a `\`.
+    /// @param[out] isClass - set if the escape represents more than one
+    ///     character
+    /// @return the bytes matched by the escape sequence
+    ByteSet escape(bool& isClass);
+}; // class RegexToNfa
+
+Frag
+RegexToNfa::alternation()
+{
+    const auto first = concatenation();
+    if(!at('|')) {
+        return first;
+    }
+
+    const Frag frag{nfa_.add(), nfa_.add()};
+    nfa_.eps(frag.in, first.in);
+    nfa_.eps(first.out, frag.out);
+
+    while(at('|')) {
+        ++pos_;
+        const auto branch = concatenation();
+        nfa_.eps(frag.in, branch.in);
+        nfa_.eps(branch.out, frag.out);
+    }
+
+    return frag;
+}
+
+Frag
+RegexToNfa::concatenation()
+{
+    Frag frag{nfa_.add(), NO_STATE};
+    frag.out = frag.in;
+
+    while(pos_ < src_.size() && !at('|') && !at(')')) {
+        const auto piece = quantified(atom());
+        nfa_.eps(frag.out, piece.in);
+        frag.out = piece.out;
+    }
+
+    return frag;
+}
+
+Frag
+RegexToNfa::quantified(Frag frag)
+{
+    if(!at('*') && !at('+') && !at('?')) {
+        return frag;
+    }
+
+    const char quantifier = src_[pos_++];
+
+    // A lazy quantifier doesn't change whether the whole path can match.
+    // A possessive one can (`a*+a` matches nothing), and
+    // globToRegexSrc() never emits one.
+    if(at('?')) {
+        ++pos_;
+    } else if(at('+')) {
+        fail("unsupported possessive quantifier");
+    }
+
+    const Frag outer{nfa_.add(), nfa_.add()};
+    nfa_.eps(outer.in, frag.in);
+    nfa_.eps(frag.out, outer.out);
+    if(quantifier != '+') {     // may be skipped
+        nfa_.eps(outer.in, outer.out);
+    }
+    if(quantifier != '?') {     // may be repeated
+        nfa_.eps(frag.out, frag.in);
+    }
+    return outer;
+}
+
+Frag
+RegexToNfa::atom()
+{
+    const char c = src_[pos_];
+
+    switch(c) {
+    case '(':
+        if(atString(RANGE_PLACEHOLDER)) {
+            pos_ += strlen(RANGE_PLACEHOLDER);
+            if(nextRange_ >= ranges_.size()) {
+                fail("too few numeric ranges");
+            }
+            return rangeFrag(nfa_, ranges_[nextRange_++]);
+        }
+
+        ++pos_;
+        // Atomic groups (`(?>`) can change whether the whole path can
+        // match, so they are not supported either.
+        if(atString("?:")) {
+            pos_ += 2;
+        } else if(at('?')) {
+            fail("unsupported group");
+        }
+
+        {
+            const auto frag = alternation();
+            if(!at(')')) {
+                fail("missing `)'");
+            }
+            ++pos_;
+            return frag;
+        }
+
+    case '[':
+        ++pos_;
+        return bytesFrag(bracket());
+
+    case '.': {
+        ++pos_;
+        ByteSet bytes;
+        bytes.set();
+        bytes.reset('\n');
+        return bytesFrag(bytes);
+    }
+
+    case '\\': {
+        bool isClass;
+        return bytesFrag(escape(isClass));
+    }
+
+    case '*':
+    case '+':
+    case '?':
+        fail("quantifier does not follow a repeatable item");
+
+    case '^':
+    case '$': {
+        // Anchors.  globToRegexSrc() only emits these when copying a
+        // bracket expression that contains a `/`.  The whole path is
+        // matched, so `^` is only satisfiable at the start of the pattern
+        // and `$` at the end.
+        const bool satisfiable = (c == '^') ? (pos_ == 0) :
+                                 (pos_ + 1 == src_.size());
+        ++pos_;
+        const Frag frag{nfa_.add(), nfa_.add()};
+        if(satisfiable) {
+            nfa_.eps(frag.in, frag.out);
+        }
+        return frag;
+    }
+
+    default: {
+        ++pos_;
+        ByteSet bytes;
+        bytes.set((unsigned char)c);
+        return bytesFrag(bytes);
+    }
+    } // switch(c)
+} // RegexToNfa::atom()
+
+ByteSet
+RegexToNfa::bracket()
+{
+    ByteSet bytes;
+    bool negate = false;
+    if(at('^')) {
+        negate = true;
+        ++pos_;
+    }
+
+    bool first = true;  // `]` first in the class is literal
+    while(true) {
+        if(pos_ >= src_.size()) {
+            fail("missing terminating `]' for character class");
+        }
+
+        if(at(']') && !first) {
+            ++pos_;
+            break;
+        }
+        first = false;
+
+        // One character, or a class escape such as `\d`
+        int lo;
+        if(at('\\')) {
+            bool isClass;
+            const auto escaped = escape(isClass);
+            if(isClass) {
+                bytes |= escaped;
+                continue;
+            }
+            lo = firstByte(escaped);
+        } else {
+            lo = (unsigned char)src_[pos_++];
+        }
+
+        // Range?
+        if(at('-') && pos_ + 1 < src_.size() && src_[pos_ + 1] != ']') {
+            ++pos_;
+            int hi;
+            if(at('\\')) {
+                bool isClass;
+                const auto escaped = escape(isClass);
+                if(isClass) {
+                    fail("invalid range in character class");
+                }
+                hi = firstByte(escaped);
+            } else {
+                hi = (unsigned char)src_[pos_++];
+            }
+
+            if(hi < lo) {
+                fail("range out of order in character class");
+            }
+            for(int b = lo; b <= hi; ++b) {
+                bytes.set(b);
+            }
+        } else {
+            bytes.set(lo);
+        }
+    } // while
+
+    if(negate) {
+        bytes.flip();
+    }
+    return bytes;
+} // RegexToNfa::bracket()
+
+ByteSet
+RegexToNfa::escape(bool& isClass)
+{
+    ++pos_;     // skip the backslash
+    if(pos_ >= src_.size()) {
+        fail("`\\' at end of pattern");
+    }
+    const char c = src_[pos_++];
+
+    ByteSet bytes;
+    isClass = true;
+
+    switch(c) {
+    case 'd':
+    case 'D':
+        for(int b = '0'; b <= '9'; ++b) {
+            bytes.set(b);
+        }
+        break;
+
+    case 'h':
+    case 'H':
+        bytes.set('\t');
+        bytes.set(' ');
+        bytes.set(0xa0);
+        break;
+
+    case 's':
+    case 'S':
+        for(const char *ws = " \t\n\v\f\r"; *ws; ++ws) {
+            bytes.set((unsigned char)*ws);
+        }
+        break;
+
+    case 'v':
+    case 'V':
+        for(int b = '\n'; b <= '\r'; ++b) {
+            bytes.set(b);
+        }
+        bytes.set(0x85);
+        break;
+
+    case 'w':
+    case 'W':
+        for(int b = 0; b < 256; ++b) {
+            if(isalnum(b) || b == '_') {
+                bytes.set(b);
+            }
+        }
+        break;
+
+    default:
+        isClass = false;
+        break;
+    }
+
+    if(isClass) {
+        if(isupper((unsigned char)c)) {
+            bytes.flip();
+        }
+        return bytes;
+    }
+
+    switch(c) {
+    case 'a':
+        bytes.set('\a');
+        break;
+    case 'e':
+        bytes.set(0x1b);
+        break;
+    case 'f':
+        bytes.set('\f');
+        break;
+    case 'n':
+        bytes.set('\n');
+        break;
+    case 'r':
+        bytes.set('\r');
+        break;
+    case 't':
+        bytes.set('\t');
+        break;
+
+    case 'x': {
+        // `\xhh` with up to two hex digits, or `\x{hh...}`
+        const bool braced = at('{');
+        if(braced) {
+            ++pos_;
+        }
+
+        unsigned value = 0;
+        int ndigits = 0;
+        while(pos_ < src_.size() && isxdigit((unsigned char)src_[pos_]) &&
+                (braced || ndigits < 2)) {
+            const char digit = src_[pos_++];
+            value = value * 16 + (isdigit((unsigned char)digit) ? (digit - '0') :
+                                  (tolower((unsigned char)digit) - 'a' + 10));
+            ++ndigits;
+            if(value > 0xff) {
+                fail("character code point value in \\x{} is too large");
+            }
+        }
+
+        if(braced) {
+            if(!at('}')) {
+                fail("missing `}' after \\x{");
+            }
+            ++pos_;
+        }
+
+        bytes.set(value);
+        break;
+    }
+
+    default:
+        // PCRE2 gives other letters and digits special meanings, which
+        // globToRegexSrc() never intends.  Everything else is literal.
+        if(isalnum((unsigned char)c)) {
+            fail("unsupported escape sequence");
+        }
+        bytes.set((unsigned char)c);
+        break;
+    }
+
+    return bytes;
+} // RegexToNfa::escape()
+
+// === Compiled automaton ================================================
+
+/// Globs compiled for MatchEngine::Automaton
+class AutomatonGlobs: public CompiledGlobs
+{
+    /// The NFA.  Only kept if the DFA would have been too large.
+    Nfa nfa_;
+
+    bool useDfa_ = true;        ///< if false, simulate nfa_
+
+    /// @name DFA
+    /// @{
+    uint8_t classOf_[256];      ///< byte -> equivalence class
+    size_t numClasses_ = 1;
+
+    /// Transitions: trans_[state * numClasses_ + class].
+    /// State 0 is the dead state.
+    std::vector<uint32_t> trans_;
+
+    std::vector<uint8_t> accepting_;    ///< per DFA state
+    uint32_t start_ = 0;
+    /// @}
+
+    /// Build the DFA from nfa_.
+    /// @return false if the DFA would have too many states.
+    bool buildDfa();
+
+    /// Add @p state and its epsilon closure to @p set.  Uses
+    /// @p context->nfaMarks to avoid duplicates.
+    void addClosure(uint32_t state, std::vector<uint32_t>& set,
+                    MatchContextImpl& context) const;
+
+    /// Run the DFA over @p path.  @return the final state (0 if dead)
+    uint32_t dfaRun(PathView path) const;
+
+    /// Run the NFA over @p path, leaving the active states in
+    /// @p context.nfaCurrent.  @return false if no states are active.
+    bool nfaRun(PathView path, MatchContextImpl& context) const;
+
+    bool dfaContains(PathView path) const;
+    bool nfaContains(PathView path, MatchContextImpl& context) const;
+
+    AutomatonGlobs() = default;
+
+public:
+    /// Compile @p globs.
+    /// @throws std::runtime_error if any glob cannot be compiled.
+    explicit AutomatonGlobs(const PathSet& globs);
+
+    /// Load an instance saved by serialize().
+    /// @throws std::runtime_error if the data is corrupt
+    static std::unique_ptr<AutomatonGlobs> load(BlobReader& in);
+
+    void serialize(BlobWriter& out) const override;
+
+    bool
+    contains(PathView path, MatchContextImpl& context) const override
+    {
+        return useDfa_ ? dfaContains(path) : nfaContains(path, context);
+    }
+
+    /// @details Any live state is assumed to lead to an accepting state.
+    bool
+    mayMatchPrefix(PathView prefix, MatchContextImpl& context) const override
+    {
+        return useDfa_ ? (dfaRun(prefix) != 0) : nfaRun(prefix, context);
+    }
+
+}; // class AutomatonGlobs
+
+AutomatonGlobs::AutomatonGlobs(const PathSet& globs)
+{
+    nfa_.start = nfa_.add();
+    nfa_.accept = nfa_.add();
+
+    for(const auto& glob : globs) {
+        string reSrc;
+        RangePairs ranges;
+        globToRegexSrc(glob, reSrc, ranges);
+
+        const auto frag = RegexToNfa(nfa_, reSrc, ranges).parse();
+        nfa_.eps(nfa_.start, frag.in);
+        nfa_.eps(frag.out, nfa_.accept);
+    }
+
+    useDfa_ = buildDfa();
+    if(useDfa_) {
+        nfa_ = Nfa();   // no longer needed
+        LOG_F(LOG, "Automaton for %zu globs: DFA with %zu states, "
+              "%zu byte classes", globs.size(), accepting_.size(), numClasses_);
+    } else {
+        LOG_F(LOG, "Automaton for %zu globs: NFA with %zu states",
+              globs.size(), nfa_.states.size());
+    }
+} // AutomatonGlobs::AutomatonGlobs()
+
+void
+AutomatonGlobs::addClosure(uint32_t state, std::vector<uint32_t>& set,
+                           MatchContextImpl& context) const
+{
+    // `set` doubles as the work list
+    auto idx = set.size();
+    if(context.nfaMarks[state] != context.nfaGeneration) {
+        context.nfaMarks[state] = context.nfaGeneration;
+        set.push_back(state);
+    }
+
+    for(; idx < set.size(); ++idx) {
+        for(const auto next : nfa_.states[set[idx]].eps) {
+            if(context.nfaMarks[next] != context.nfaGeneration) {
+                context.nfaMarks[next] = context.nfaGeneration;
+                set.push_back(next);
+            }
+        }
+    }
+}
+
+/// Start a new generation of marks in @p context for an NFA with
+/// @p numStates states.
+static void
+newGeneration(MatchContextImpl& context, size_t numStates)
+{
+    if(context.nfaMarks.size() < numStates) {
+        context.nfaMarks.resize(numStates, 0);
+    }
+    if(++context.nfaGeneration == 0) {  // wrapped around
+        std::fill(context.nfaMarks.begin(), context.nfaMarks.end(), 0);
+        context.nfaGeneration = 1;
+    }
+}
+
+bool
+AutomatonGlobs::buildDfa()
+{
+    // Byte equivalence classes: bytes that every NFA state treats alike.
+    std::fill(classOf_, classOf_ + 256, 0);
+    numClasses_ = 1;
+    for(const auto& state : nfa_.states) {
+        if(state.next == NO_STATE) {
+            continue;
+        }
+
+        // Split each class by membership in state.on
+        std::map<std::pair<uint8_t, bool>, uint8_t> split;
+        size_t count = 0;
+        uint8_t newClassOf[256];
+        for(int b = 0; b < 256; ++b) {
+            const auto key = make_pair(classOf_[b], (bool)state.on[b]);
+            const auto it = split.find(key);
+            if(it == split.end()) {
+                split[key] = newClassOf[b] = (uint8_t)count++;
+            } else {
+                newClassOf[b] = it->second;
+            }
+        }
+        std::copy(newClassOf, newClassOf + 256, classOf_);
+        numClasses_ = count;
+    }
+
+    // One representative byte per class
+    std::vector<int> representative(numClasses_, -1);
+    for(int b = 0; b < 256; ++b) {
+        if(representative[classOf_[b]] < 0) {
+            representative[classOf_[b]] = b;
+        }
+    }
+
+    // Subset construction.  DFA states are identified by the sorted lists
+    // of NFA states they represent.  Only states with byte transitions,
+    // and the accept state, are kept in those lists.
+    MatchContextImpl scratch;
+    std::map<std::vector<uint32_t>, uint32_t> ids;
+    std::vector<std::vector<uint32_t> > pending;
+
+    auto canonicalize = [this](std::vector<uint32_t>& set) {
+        set.erase(std::remove_if(set.begin(), set.end(),
+        [this](uint32_t s) {
+            return nfa_.states[s].next == NO_STATE && s != nfa_.accept;
+        }), set.end());
+        std::sort(set.begin(), set.end());
+    };
+
+    auto idFor = [&](std::vector<uint32_t>& set) -> uint32_t {
+        canonicalize(set);
+        const auto it = ids.find(set);
+        if(it != ids.end())
+        {
+            return it->second;
+        }
+
+        const auto id = (uint32_t)ids.size();
+        ids[set] = id;
+        pending.push_back(set);
+        return id;
+    };
+
+    trans_.clear();
+    accepting_.clear();
+
+    std::vector<uint32_t> set;
+    idFor(set);     // dead state is 0
+
+    newGeneration(scratch, nfa_.states.size());
+    addClosure(nfa_.start, set, scratch);
+    start_ = idFor(set);
+
+    for(size_t curr = 0; curr < pending.size(); ++curr) {
+        if(pending.size() > DFA_MAX_STATES) {
+            return false;
+        }
+
+        const auto from = pending[curr];   // copy --- pending may grow
+        accepting_.push_back(std::binary_search(from.begin(), from.end(),
+                             nfa_.accept));
+
+        for(size_t cls = 0; cls < numClasses_; ++cls) {
+            const int b = representative[cls];
+            set.clear();
+            newGeneration(scratch, nfa_.states.size());
+            for(const auto s : from) {
+                const auto& state = nfa_.states[s];
+                if(state.next != NO_STATE && state.on[b]) {
+                    addClosure(state.next, set, scratch);
+                }
+            }
+            trans_.push_back(idFor(set));
+        }
+    }
+
+    return true;
+} // AutomatonGlobs::buildDfa()
+
+uint32_t
+AutomatonGlobs::dfaRun(PathView path) const
+{
+    uint32_t state = start_;
+    for(const char c : path) {
+        state = trans_[state * numClasses_ + classOf_[(unsigned char)c]];
+        if(state == 0) {
+            break;
+        }
+    }
+    return state;
+}
+
+bool
+AutomatonGlobs::dfaContains(PathView path) const
+{
+    return accepting_[dfaRun(path)];    // the dead state is not accepting
+}
+
+bool
+AutomatonGlobs::nfaRun(PathView path, MatchContextImpl& context) const
+{
+    auto& curr = context.nfaCurrent;
+    auto& next = context.nfaNext;
+
+    curr.clear();
+    newGeneration(context, nfa_.states.size());
+    addClosure(nfa_.start, curr, context);
+
+    for(const char c : path) {
+        next.clear();
+        newGeneration(context, nfa_.states.size());
+        for(const auto s : curr) {
+            const auto& state = nfa_.states[s];
+            if(state.next != NO_STATE && state.on[(unsigned char)c]) {
+                addClosure(state.next, next, context);
+            }
+        }
+
+        if(next.empty()) {
+            return false;
+        }
+        curr.swap(next);
+    }
+
+    return true;
+}
+
+bool
+AutomatonGlobs::nfaContains(PathView path, MatchContextImpl& context) const
+{
+    const auto& curr = context.nfaCurrent;
+    return nfaRun(path, context) &&
+           std::find(curr.begin(), curr.end(), nfa_.accept) != curr.end();
+}
+
+// --- Serialization -----------------------------------------------------
+
+/// Throw if @p ok is false
+static void
+checkData(bool ok)
+{
+    if(!ok) {
+        throw runtime_error("Corrupt automaton data");
+    }
+}
+
+void
+AutomatonGlobs::serialize(BlobWriter& out) const
+{
+    out.u8(useDfa_);
+
+    if(useDfa_) {
+        out.bytes(classOf_, sizeof(classOf_));
+        out.u32((uint32_t)numClasses_);
+        out.u32(start_);
+        out.u64(accepting_.size());
+        out.bytes(accepting_.data(), accepting_.size());
+        for(const auto next : trans_) {
+            out.u32(next);
+        }
+        return;
+    }
+
+    out.u32(nfa_.start);
+    out.u32(nfa_.accept);
+    out.u64(nfa_.states.size());
+    for(const auto& state : nfa_.states) {
+        uint8_t on[32] = {0};
+        for(int b = 0; b < 256; ++b) {
+            if(state.on[b]) {
+                on[b / 8] |= (uint8_t)(1 << (b % 8));
+            }
+        }
+        out.bytes(on, sizeof(on));
+        out.u32(state.next);
+        out.u64(state.eps.size());
+        for(const auto to : state.eps) {
+            out.u32(to);
+        }
+    }
+} // AutomatonGlobs::serialize()
+
+std::unique_ptr<AutomatonGlobs>
+AutomatonGlobs::load(BlobReader& in)
+{
+    std::unique_ptr<AutomatonGlobs> retval(new AutomatonGlobs());
+    auto& self = *retval;
+    self.useDfa_ = in.u8();
+
+    if(self.useDfa_) {
+        const auto classes = in.bytes(sizeof(self.classOf_));
+        memcpy(self.classOf_, classes.data(), sizeof(self.classOf_));
+        self.numClasses_ = in.u32();
+        checkData(self.numClasses_ >= 1 && self.numClasses_ <= 256);
+        for(const auto cls : self.classOf_) {
+            checkData(cls < self.numClasses_);
+        }
+
+        self.start_ = in.u32();
+        const auto numStates = in.count();
+        checkData(numStates >= 1 && self.start_ < numStates);
+        const auto accepting = in.bytes(numStates);
+        self.accepting_.assign(accepting.begin(), accepting.end());
+
+        checkData(numStates * self.numClasses_ <= in.remaining() / 4);
+        self.trans_.resize(numStates * self.numClasses_);
+        for(auto& next : self.trans_) {
+            next = in.u32();
+            checkData(next < numStates);
+        }
+        return retval;
+    }
+
+    auto& nfa = self.nfa_;
+    nfa.start = in.u32();
+    nfa.accept = in.u32();
+    nfa.states.resize(in.count(32 + 4 + 8));
+    const auto numStates = nfa.states.size();
+    checkData(nfa.start < numStates && nfa.accept < numStates);
+
+    for(auto& state : nfa.states) {
+        const auto on = in.bytes(32);
+        for(int b = 0; b < 256; ++b) {
+            state.on[b] = ((unsigned char)on[b / 8] >> (b % 8)) & 1;
+        }
+        state.next = in.u32();
+        checkData(state.next == NO_STATE || state.next < numStates);
+        state.eps.resize(in.count(4));
+        for(auto& to : state.eps) {
+            to = in.u32();
+            checkData(to < numStates);
+        }
+    }
+
+    return retval;
+} // AutomatonGlobs::load()
+
+// === Public interface ==================================================
+
+std::unique_ptr<CompiledGlobs>
+compileAutomaton(const PathSet& globs)
+{
+    return std::unique_ptr<CompiledGlobs>(new AutomatonGlobs(globs));
+}
+
+std::unique_ptr<CompiledGlobs>
+loadAutomaton(BlobReader& in)
+{
+    return AutomatonGlobs::load(in);
+}
+
+} // namespace glob
+} // namespace smallcxx
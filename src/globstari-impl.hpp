@@ -0,0 +1,385 @@
+/// @file src/globstari-impl.hpp
+/// @brief globstar + ignore routines --- internal declarations shared
+///     among the globstari source files.  Not installed.
+/// @details Part of smallcxx
+/// @author Christopher White <cxwembedded@gmail.com>
+/// @copyright Copyright (c) 2021--2022 Christopher White
+/// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef SMALLCXX_GLOBSTARI_IMPL_HPP_
+#define SMALLCXX_GLOBSTARI_IMPL_HPP_
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "smallcxx/globstari.hpp"
+
+namespace smallcxx
+{
+namespace glob
+{
+
+// --- PCRE2-related types -----------------------------------------------
+
+using MatchDataPtr =
+    std::unique_ptr<pcre2_match_data, void(*)(pcre2_match_data *)>;
+
+/// @todo Make this a std::shared_ptr?
+using RePtr = std::unique_ptr<pcre2_code, void(*)(pcre2_code *)>;
+
+using JitStackPtr =
+    std::unique_ptr<pcre2_jit_stack, void(*)(pcre2_jit_stack *)>;
+
+using MatchCtxPtr =
+    std::unique_ptr<pcre2_match_context, void(*)(pcre2_match_context *)>;
+
+/// Initial size of each MatchContext's JIT stack
+static constexpr size_t JIT_STACK_START = 32 * 1024;
+
+/// Maximum size of each MatchContext's JIT stack
+static constexpr size_t JIT_STACK_MAX = 1024 * 1024;
+
+// --- Misc. types -------------------------------------------------------
+
+/// Element of a numerical range
+using Int = intmax_t;
+
+/// Numerical range
+using IntPair = std::pair<Int, Int>;
+
+/// List of numerical ranges
+using RangePairs = std::vector<IntPair>;
+
+/// Hash function for PathView (FNV-1a)
+struct PathViewHash {
+    size_t
+    operator()(PathView view) const
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for(const char c : view) {
+            hash ^= (unsigned char)c;
+            hash *= 1099511628211ULL;
+        }
+        return (size_t)hash;
+    }
+};
+
+// --- MatchContextImpl --------------------------------------------------
+
+/// Per-thread scratch space for matching.  See MatchContext.
+class MatchContextImpl
+{
+    /// Match data shared by all the Criteria this context is used with.
+    /// Grows to fit the regex with the most capture groups.
+    MatchDataPtr matchData_;
+
+    /// JIT stack, created the first time a JIT-compiled regex is matched
+    JitStackPtr jitStack_;
+
+    /// Match context that hands jitStack_ to pcre2_jit_match()
+    MatchCtxPtr jitMatchContext_;
+
+public:
+    MatchContextImpl()
+        : matchData_(nullptr, pcre2_match_data_free)
+        , jitStack_(nullptr, pcre2_jit_stack_free)
+        , jitMatchContext_(nullptr, pcre2_match_context_free)
+    {}
+
+    /// Get match data with room for at least @p ovecCount ovector pairs.
+    /// Only allocates the first time a larger size is requested.
+    /// @throws std::bad_alloc on allocation failure
+    pcre2_match_data *
+    matchData(uint32_t ovecCount)
+    {
+        if(!matchData_ ||
+                pcre2_get_ovector_count(matchData_.get()) < ovecCount) {
+            matchData_.reset(pcre2_match_data_create(ovecCount, nullptr));
+            if(!matchData_) {
+                throw std::bad_alloc();
+            }
+        }
+        return matchData_.get();
+    }
+
+    /// Get a match context to use with pcre2_jit_match().
+    /// @throws std::bad_alloc on allocation failure
+    pcre2_match_context *
+    jitMatchContext()
+    {
+        if(!jitMatchContext_) {
+            jitStack_.reset(pcre2_jit_stack_create(JIT_STACK_START,
+                                                   JIT_STACK_MAX, nullptr));
+            jitMatchContext_.reset(pcre2_match_context_create(nullptr));
+            if(!jitStack_ || !jitMatchContext_) {
+                jitMatchContext_.reset();
+                throw std::bad_alloc();
+            }
+            pcre2_jit_stack_assign(jitMatchContext_.get(), nullptr,
+                                   jitStack_.get());
+        }
+        return jitMatchContext_.get();
+    }
+
+    /// @name Scratch space for NFA simulation (MatchEngine::Automaton)
+    /// @{
+    std::vector<uint32_t> nfaCurrent;   ///< states active before a byte
+    std::vector<uint32_t> nfaNext;      ///< states active after a byte
+    std::vector<uint32_t> nfaMarks;     ///< nfaMarks[s]==nfaGeneration => queued
+    uint32_t nfaGeneration = 0;         ///< current marker value
+    /// @}
+
+    /// Scratch space for GlobSetImpl::containsMany()
+    std::vector<PathView> views;
+
+}; // class MatchContextImpl
+
+// --- Serialization -----------------------------------------------------
+
+/// Appends binary data to a string.  Integers are stored little-endian.
+class BlobWriter
+{
+    std::string& out_;
+
+public:
+    explicit BlobWriter(std::string& out): out_(out) {}
+
+    void
+    u8(uint8_t value)
+    {
+        out_ += (char)value;
+    }
+
+    void
+    u32(uint32_t value)
+    {
+        for(int i = 0; i < 4; ++i) {
+            out_ += (char)(value >> (8 * i));
+        }
+    }
+
+    void
+    u64(uint64_t value)
+    {
+        for(int i = 0; i < 8; ++i) {
+            out_ += (char)(value >> (8 * i));
+        }
+    }
+
+    void
+    bytes(const void *data, size_t size)
+    {
+        out_.append((const char *)data, size);
+    }
+
+    /// Write @p value's length, then @p value
+    void
+    str(PathView value)
+    {
+        u64(value.size());
+        bytes(value.data(), value.size());
+    }
+}; // class BlobWriter
+
+/// Reads data written by a BlobWriter.  Does not copy the data.
+/// All the read functions throw std::runtime_error if there isn't
+/// enough data left.
+class BlobReader
+{
+    const char *pos_;
+    const char *end_;
+
+    /// Consume @p size bytes and return a pointer to them
+    const char *
+    take(uint64_t size)
+    {
+        if(size > (uint64_t)(end_ - pos_)) {
+            throw std::runtime_error("Truncated or corrupt glob data");
+        }
+        const char *const retval = pos_;
+        pos_ += size;
+        return retval;
+    }
+
+public:
+    BlobReader(const void *data, size_t size)
+        : pos_((const char *)data), end_((const char *)data + size)
+    {}
+
+    uint8_t
+    u8()
+    {
+        return (uint8_t)take(1)[0];
+    }
+
+    uint32_t
+    u32()
+    {
+        const auto p = (const unsigned char *)take(4);
+        uint32_t value = 0;
+        for(int i = 3; i >= 0; --i) {
+            value = (value << 8) | p[i];
+        }
+        return value;
+    }
+
+    uint64_t
+    u64()
+    {
+        const auto p = (const unsigned char *)take(8);
+        uint64_t value = 0;
+        for(int i = 7; i >= 0; --i) {
+            value = (value << 8) | p[i];
+        }
+        return value;
+    }
+
+    /// Read @p size bytes
+    PathView
+    bytes(uint64_t size)
+    {
+        const char *const data = take(size);
+        return PathView(data, size);
+    }
+
+    /// Read a string written by BlobWriter::str()
+    PathView
+    str()
+    {
+        return bytes(u64());
+    }
+
+    /// Read a count of items, each of which takes at least @p minSize bytes.
+    /// Guards against huge allocations from corrupt data.
+    uint64_t
+    count(size_t minSize = 1)
+    {
+        const uint64_t n = u64();
+        if(n > (uint64_t)(end_ - pos_) / minSize) {
+            throw std::runtime_error("Truncated or corrupt glob data");
+        }
+        return n;
+    }
+
+    /// Number of bytes not yet read
+    size_t
+    remaining() const
+    {
+        return end_ - pos_;
+    }
+
+    bool
+    atEnd() const
+    {
+        return pos_ == end_;
+    }
+}; // class BlobReader
+
+// --- Compiled globs ----------------------------------------------------
+
+/// The compiled form of the globs in a GlobSet.  One subclass per
+/// MatchEngine.  Immutable once constructed, so instances are shared
+/// between GlobSets rather than copied.
+class CompiledGlobs
+{
+public:
+    CompiledGlobs() = default;
+    CompiledGlobs(const CompiledGlobs&) = delete;
+    CompiledGlobs& operator=(const CompiledGlobs&) = delete;
+    virtual ~CompiledGlobs() = default;
+
+    /// Append this instance to @p out, in a form the corresponding loader
+    /// (e.g., loadAutomaton()) can read.
+    virtual void serialize(BlobWriter& out) const = 0;
+
+    /// Does @p path match any of the globs?
+    /// @param[in]  path - the path.  Never empty.
+    /// @param[in]  context - scratch space
+    virtual bool contains(PathView path, MatchContextImpl& context) const = 0;
+
+    /// Might any path longer than @p prefix that starts with @p prefix
+    /// match?  Used to prune directory traversal, so may return true when
+    /// the answer is no, but must not return false when the answer is yes.
+    /// The default implementation always returns true.
+    /// @param[in]  prefix - the prefix.  Never empty, and ends with `/`.
+    /// @param[in]  context - scratch space
+    virtual bool
+    mayMatchPrefix(PathView prefix, MatchContextImpl& context) const
+    {
+        return true;
+    }
+
+    /// Check @p count @p paths, skipping those whose @p results are
+    /// already true.  See GlobSet::containsMany().  Empty paths don't match.
+    /// The default implementation calls contains() for each path.
+    virtual void
+    containsMany(const PathView *paths, size_t count,
+                 std::vector<bool>& results, MatchContextImpl& context) const
+    {
+        for(size_t i = 0; i < count; ++i) {
+            if(!results[i] && !paths[i].empty()) {
+                results[i] = contains(paths[i], context);
+            }
+        }
+    }
+};
+
+/// Append regex source for glob @p glob to @p src, and append to @p ranges
+/// if @p glob includes numerical range(s).  Numerical ranges are
+/// represented in @p src by the capturing group `([\+\-]?\d+)`.
+/// Defined in globstari.cpp.
+void
+globToRegexSrc(const smallcxx::glob::Path& glob, std::string& src,
+               RangePairs& ranges);
+
+/// Compile @p globs for MatchEngine::Automaton.
+/// Defined in globstari-automaton.cpp.
+/// @throws std::runtime_error if a glob cannot be compiled
+std::unique_ptr<CompiledGlobs>
+compileAutomaton(const PathSet& globs);
+
+/// Load globs saved by serializing the result of compileAutomaton().
+/// Defined in globstari-automaton.cpp.
+/// @throws std::runtime_error if the data is corrupt
+std::unique_ptr<CompiledGlobs>
+loadAutomaton(BlobReader& in);
+
+/// Compiles a set of globs with a particular MatchEngine
+using GlobCompiler =
+    std::function<std::unique_ptr<CompiledGlobs>(const PathSet&)>;
+
+/// Compile @p globs, matching the simple ones by table lookup.
+/// Defined in globstari-literal.cpp.
+/// @param[in]  globs - the globs
+/// @param[in]  compileRest - compiles the globs that can't be looked up.
+///     Not called if there are none.
+std::unique_ptr<CompiledGlobs>
+compileWithLiteralIndex(const PathSet& globs, const GlobCompiler& compileRest);
+
+/// Loads globs saved by CompiledGlobs::serialize().  Returns null if this
+/// build can't use the data, e.g., because it came from a different version
+/// of PCRE2.
+using GlobLoader = std::function<std::unique_ptr<CompiledGlobs>(BlobReader&)>;
+
+/// Load globs saved by serializing the result of compileWithLiteralIndex().
+/// Defined in globstari-literal.cpp.
+/// @param[in]  in - the data
+/// @param[in]  loadRest - loads the globs that can't be looked up
+/// @return the globs, or null if loadRest() returns null
+/// @throws std::runtime_error if the data is corrupt
+std::unique_ptr<CompiledGlobs>
+loadWithLiteralIndex(BlobReader& in, const GlobLoader& loadRest);
+
+} // namespace glob
+} // namespace smallcxx
+
+#endif // SMALLCXX_GLOBSTARI_IMPL_HPP_
@@ -0,0 +1,594 @@
+/// @file src/globstari-literal.cpp
+/// @brief globstar + ignore routines --- table lookup for simple globs.
+/// @details Part of smallcxx.
+///
+/// Most globs in ignore files are of the forms `name`, `*.ext`, or, once
+/// Matcher::addGlob() has prepended the directory, `dir**/name` and
+/// `dir**/*.ext`.  Those are matched here by hash lookup on the whole path,
+/// its basename, or its extension.  The remaining globs are handed to the
+/// selected MatchEngine.  The lookups accept what the regexes produced by
+/// globToRegexSrc() would, except that a newline at the end of the path is
+/// significant (as with MatchEngine::Automaton).
+///
+/// @author Christopher White <cxwembedded@gmail.com>
+/// @copyright Copyright (c) 2021--2022 Christopher White
+/// SPDX-License-Identifier: BSD-3-Clause
+
+#define SMALLCXX_LOG_DOMAIN "glob"
+
+#include <algorithm>
+#include <ctype.h>
+#include <deque>
+#include <string.h>
+#include <unordered_map>
+
+#include "smallcxx/globstari.hpp"
+#include "smallcxx/logging.hpp"
+
+#include "globstari-impl.hpp"
+
+using namespace std;
+
+namespace smallcxx
+{
+namespace glob
+{
+
+// --- Classifying globs -------------------------------------------------
+
+/// Is @p c special in a glob?  `,` only is within braces, but globs with
+/// braces are never simple, so treat it as special everywhere.
+static bool
+isSpecial(char c)
+{
+    return c && strchr("*?[]{},", c);
+}
+
+/// Decode the glob text in [@p begin, @p end) into @p out.
+/// @return false if the text is not entirely literal characters.
+static bool
+decodeLiteral(const char *begin, const char *end, string& out)
+{
+    out.clear();
+    for(const char *c = begin; c < end; ++c) {
+        if(*c == '\\') {
+            if(c + 1 == end) {      // trailing backslash is literal
+                out += '\\';
+                break;
+            }
+            ++c;
+            if(isalnum((unsigned char)*c)) {
+                return false;       // a regex escape such as `\d`
+            }
+            out += *c;
+
+        } else if(isSpecial(*c)) {
+            return false;
+
+        } else {
+            out += *c;
+        }
+    }
+    return true;
+}
+
+/// Where a `prefix**/...` glob can match.
+struct Anchor {
+    /// The literal text before the `**`.  The path must start with this.
+    smallcxx::glob::Path prefix;
+};
+
+/// The ways a particular basename or extension can match
+struct Tail {
+    /// The basename can be the whole path (`*.ext` globs only)
+    bool bare = false;
+
+    /// Directories under which the basename can match
+    std::vector<Anchor> anchors;
+};
+
+/// What kind of simple glob a glob is
+enum class Shape {
+    Exact,      ///< a literal path
+    Basename,   ///< `prefix**/name`
+    Extension,  ///< `prefix**/*.ext` or `*.ext`
+    Other,      ///< needs a full MatchEngine
+};
+
+/// Classify @p glob.
+/// @param[in]  glob - the glob
+/// @param[out] key - for Shape::Exact, the path; for Shape::Basename, the
+///     name; for Shape::Extension, the extension, including the `.`.
+/// @param[out] tail - for Shape::Basename and Shape::Extension, whether the
+///     key can match at the top level (Tail::bare).  Tail::anchors is
+///     not modified.
+/// @param[out] anchor - if @p tail is not bare, where the key can match.
+static Shape
+classify(const smallcxx::glob::Path& glob, string& key, Tail& tail,
+         Anchor& anchor)
+{
+    const char *const start = glob.data();
+    const char *const end = start + glob.size();
+
+    // Find the first unescaped special character
+    const char *special = start;
+    bool lastWasEscaped = false;
+    for(; special < end; ++special) {
+        if(*special == '\\' && special + 1 < end) {
+            ++special;
+            lastWasEscaped = true;
+            continue;
+        }
+        if(isSpecial(*special)) {
+            break;
+        }
+        lastWasEscaped = false;
+    }
+
+    if(special == end) {
+        return decodeLiteral(start, end, key) ? Shape::Exact : Shape::Other;
+    }
+
+    const char *rest;
+    bool bare = false;
+
+    if(end - special >= 3 && !strncmp(special, "**/", 3)) {
+        // globToRegexSrc() converts `/**/` to `(\/|\/.*\/)`.  The atomic
+        // group MatchEngine::Pcre2 wraps around the glob commits to the
+        // first alternative that completes, so e.g., `/d/**/x` does not
+        // match `/d/x/x`.  A table lookup can't easily do the same.
+        if(special > start && special[-1] == '/' && !lastWasEscaped) {
+            return Shape::Other;
+        }
+        if(!decodeLiteral(start, special, anchor.prefix)) {
+            return Shape::Other;
+        }
+        rest = special + 3;
+
+    } else if(special == start && *special == '*' &&
+              (special + 1 == end || special[1] != '*')) {
+        bare = true;
+        rest = special;
+
+    } else {
+        return Shape::Other;
+    }
+
+    const bool star = (rest < end && *rest == '*');
+    if(star) {
+        ++rest;
+    } else if(bare) {
+        return Shape::Other;
+    }
+
+    if(!decodeLiteral(rest, end, key) || key.find('/') != key.npos) {
+        return Shape::Other;
+    }
+
+    tail.bare = bare;
+    if(!star) {
+        return Shape::Basename;
+    }
+
+    if(key.empty() || key[0] != '.' || key.find('.', 1) != key.npos) {
+        return Shape::Other;
+    }
+    return Shape::Extension;
+} // classify()
+
+// --- ViewTable ---------------------------------------------------------
+
+/// Position of the last @p c in @p path, or Path::npos
+static size_t
+findLast(PathView path, char c)
+{
+    for(size_t i = path.size(); i > 0; --i) {
+        if(path[i - 1] == c) {
+            return i - 1;
+        }
+    }
+    return smallcxx::glob::Path::npos;
+}
+
+/// Hash table keyed by path text.  Lookups take a PathView, so they don't
+/// need to build a string.  The table owns copies of its keys.
+template<class Value>
+class ViewTable
+{
+    /// Owned copies of the keys.  A deque so references remain valid.
+    std::deque<smallcxx::glob::Path> keys_;
+
+    /// Keys are views of elements of keys_
+    std::unordered_map<PathView, Value, PathViewHash> map_;
+
+public:
+    ViewTable() = default;
+    ViewTable(const ViewTable&) = delete;
+    ViewTable& operator=(const ViewTable&) = delete;
+
+    /// Get the value for @p key, adding a default-constructed value if
+    /// @p key is not already present.
+    Value&
+    operator[](PathView key)
+    {
+        const auto it = map_.find(key);
+        if(it != map_.end()) {
+            return it->second;
+        }
+
+        keys_.emplace_back(key.data(), key.size());
+        return map_[PathView(keys_.back())];
+    }
+
+    /// Get the value for @p key, or nullptr if @p key is not present
+    const Value *
+    find(PathView key) const
+    {
+        const auto it = map_.find(key);
+        return (it == map_.end()) ? nullptr : &it->second;
+    }
+
+    bool
+    empty() const
+    {
+        return map_.empty();
+    }
+
+    size_t
+    size() const
+    {
+        return map_.size();
+    }
+
+    /// @name Iteration over (key, value) pairs
+    /// @{
+    typename std::unordered_map<PathView, Value, PathViewHash>::const_iterator
+    begin() const
+    {
+        return map_.begin();
+    }
+
+    typename std::unordered_map<PathView, Value, PathViewHash>::const_iterator
+    end() const
+    {
+        return map_.end();
+    }
+    /// @}
+}; // class ViewTable
+
+// --- LiteralGlobs ------------------------------------------------------
+
+/// Globs matched by table lookup, plus the remaining globs compiled by a
+/// MatchEngine.
+class LiteralGlobs: public CompiledGlobs
+{
+    /// Literal paths.  The values are unused.
+    ViewTable<bool> exact_;
+
+    /// Key: basename
+    ViewTable<Tail> basenames_;
+
+    /// Key: extension, including the leading `.`
+    ViewTable<Tail> extensions_;
+
+    /// Everything else.  May be null.
+    std::unique_ptr<CompiledGlobs> rest_;
+
+    /// @name For mayMatchPrefix().  Filled in by indexPrefixes().
+    /// @{
+
+    /// Each prefix of a key of exact_ that ends with a `/`
+    ViewTable<bool> exactDirs_;
+
+    /// Each distinct Anchor::prefix in basenames_ and extensions_
+    std::vector<smallcxx::glob::Path> anchorPrefixes_;
+    /// @}
+
+    /// Fill in the members used by mayMatchPrefix()
+    void indexPrefixes();
+
+    /// Does @p tail accept @p path, whose last `/` is at @p lastSlash?
+    static bool tailAccepts(const Tail& tail, PathView path,
+                            size_t lastSlash);
+
+    /// @name Serialization helpers
+    /// @{
+    static void saveTails(BlobWriter& out, const ViewTable<Tail>& table);
+    static void loadTails(BlobReader& in, ViewTable<Tail>& table);
+    /// @}
+
+    LiteralGlobs() = default;
+
+public:
+    LiteralGlobs(const PathSet& globs, const GlobCompiler& compileRest);
+
+    /// Load an instance saved by serialize().
+    /// @return the instance, or null if @p loadRest returns null
+    /// @throws std::runtime_error if the data is corrupt
+    static std::unique_ptr<CompiledGlobs> load(BlobReader& in,
+            const GlobLoader& loadRest);
+
+    void serialize(BlobWriter& out) const override;
+
+    bool contains(PathView path, MatchContextImpl& context) const override;
+
+    void containsMany(const PathView *paths, size_t count,
+                      std::vector<bool>& results,
+                      MatchContextImpl& context) const override;
+
+    bool mayMatchPrefix(PathView prefix,
+                        MatchContextImpl& context) const override;
+
+private:
+    /// Can @p path be matched by table lookup?
+    bool lookup(PathView path) const;
+
+}; // class LiteralGlobs
+
+LiteralGlobs::LiteralGlobs(const PathSet& globs,
+                           const GlobCompiler& compileRest)
+{
+    PathSet rest;
+    size_t numSimple = 0;
+
+    for(const auto& glob : globs) {
+        string key;
+        Tail tail;
+        Anchor anchor;
+
+        const auto shape = classify(glob, key, tail, anchor);
+        ViewTable<Tail> *table = nullptr;
+
+        switch(shape) {
+        case Shape::Exact:
+            exact_[key] = true;
+            break;
+        case Shape::Basename:
+            table = &basenames_;
+            break;
+        case Shape::Extension:
+            table = &extensions_;
+            break;
+        default:
+            rest.insert(glob);
+            continue;
+        }
+
+        ++numSimple;
+        if(table) {
+            auto& entry = (*table)[key];
+            if(tail.bare) {
+                entry.bare = true;
+            } else {
+                entry.anchors.push_back(anchor);
+            }
+        }
+    } // foreach glob
+
+    if(!rest.empty()) {
+        rest_ = compileRest(rest);
+    }
+
+    indexPrefixes();
+
+    LOG_F(LOG, "%zu globs by table lookup, %zu by engine", numSimple,
+          rest.size());
+} // LiteralGlobs::LiteralGlobs()
+
+void
+LiteralGlobs::indexPrefixes()
+{
+    for(const auto& kv : exact_) {
+        const auto& key = kv.first;
+        for(size_t i = 0; i < key.size(); ++i) {
+            if(key[i] == '/') {
+                exactDirs_[PathView(key.data(), i + 1)] = true;
+            }
+        }
+    }
+
+    PathSet prefixes;
+    const ViewTable<Tail> *const tables[] = { &basenames_, &extensions_ };
+    for(const auto table : tables) {
+        for(const auto& kv : *table) {
+            for(const auto& anchor : kv.second.anchors) {
+                prefixes.insert(anchor.prefix);
+            }
+        }
+    }
+    anchorPrefixes_.assign(prefixes.begin(), prefixes.end());
+} // LiteralGlobs::indexPrefixes()
+
+bool
+LiteralGlobs::tailAccepts(const Tail& tail, PathView path, size_t lastSlash)
+{
+    if(lastSlash == smallcxx::glob::Path::npos) {
+        return tail.bare;
+    }
+
+    for(const auto& anchor : tail.anchors) {
+        const auto& prefix = anchor.prefix;
+        const size_t len = prefix.size();
+
+        if(path.size() < len || memcmp(path.data(), prefix.data(), len) != 0) {
+            continue;
+        }
+
+        // The `**` matches path[len, lastSlash)
+        if(lastSlash < len) {
+            continue;
+        }
+
+        // `**` becomes `.*`, which doesn't match newlines.
+        if(lastSlash <= len ||
+                !memchr(path.data() + len, '\n', lastSlash - len)) {
+            return true;
+        }
+    }
+
+    return false;
+} // LiteralGlobs::tailAccepts()
+
+bool
+LiteralGlobs::lookup(PathView path) const
+{
+    if(!exact_.empty() && exact_.find(path)) {
+        return true;
+    }
+
+    const auto lastSlash = findLast(path, '/');
+    const bool hasSlash = (lastSlash != smallcxx::glob::Path::npos);
+    const size_t baseStart = hasSlash ? (lastSlash + 1) : 0;
+    const PathView basename(path.data() + baseStart, path.size() - baseStart);
+
+    if(!basenames_.empty() && hasSlash) {
+        const auto tail = basenames_.find(basename);
+        if(tail && tailAccepts(*tail, path, lastSlash)) {
+            return true;
+        }
+    }
+
+    if(!extensions_.empty()) {
+        const auto dot = findLast(basename, '.');
+        if(dot != smallcxx::glob::Path::npos) {
+            const auto tail = extensions_.find(
+                                  PathView(basename.data() + dot,
+                                           basename.size() - dot));
+            if(tail && tailAccepts(*tail, path, lastSlash)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+} // LiteralGlobs::lookup()
+
+bool
+LiteralGlobs::contains(PathView path, MatchContextImpl& context) const
+{
+    return lookup(path) || (rest_ && rest_->contains(path, context));
+} // LiteralGlobs::contains()
+
+void
+LiteralGlobs::containsMany(const PathView *paths, size_t count,
+                           std::vector<bool>& results,
+                           MatchContextImpl& context) const
+{
+    for(size_t i = 0; i < count; ++i) {
+        if(!results[i] && !paths[i].empty() && lookup(paths[i])) {
+            results[i] = true;
+        }
+    }
+
+    if(rest_) {
+        rest_->containsMany(paths, count, results, context);
+    }
+} // LiteralGlobs::containsMany()
+
+/// @details An anchored basename or extension can follow any path that
+/// starts with the anchor's prefix.  This ignores the fact that `**`
+/// doesn't match newlines.  @p prefix ends with a `/`, so bare (top-level)
+/// extensions and basenames can't match under it.
+bool
+LiteralGlobs::mayMatchPrefix(PathView prefix, MatchContextImpl& context) const
+{
+    if(exactDirs_.find(prefix)) {
+        return true;
+    }
+
+    for(const auto& anchor : anchorPrefixes_) {
+        const size_t len = std::min(anchor.size(), prefix.size());
+        if(memcmp(anchor.data(), prefix.data(), len) == 0) {
+            return true;
+        }
+    }
+
+    return rest_ && rest_->mayMatchPrefix(prefix, context);
+} // LiteralGlobs::mayMatchPrefix()
+
+// --- Serialization -----------------------------------------------------
+
+void
+LiteralGlobs::saveTails(BlobWriter& out, const ViewTable<Tail>& table)
+{
+    out.u64(table.size());
+    for(const auto& kv : table) {
+        out.str(kv.first);
+        out.u8(kv.second.bare);
+        out.u64(kv.second.anchors.size());
+        for(const auto& anchor : kv.second.anchors) {
+            out.str(anchor.prefix);
+        }
+    }
+}
+
+void
+LiteralGlobs::loadTails(BlobReader& in, ViewTable<Tail>& table)
+{
+    for(auto n = in.count(8 + 1 + 8); n > 0; --n) {
+        auto& tail = table[in.str()];
+        tail.bare = in.u8();
+        tail.anchors.resize(in.count(8));
+        for(auto& anchor : tail.anchors) {
+            const auto prefix = in.str();
+            anchor.prefix.assign(prefix.data(), prefix.size());
+        }
+    }
+}
+
+void
+LiteralGlobs::serialize(BlobWriter& out) const
+{
+    out.u64(exact_.size());
+    for(const auto& kv : exact_) {
+        out.str(kv.first);
+    }
+    saveTails(out, basenames_);
+    saveTails(out, extensions_);
+
+    out.u8(!!rest_);
+    if(rest_) {
+        rest_->serialize(out);
+    }
+} // LiteralGlobs::serialize()
+
+std::unique_ptr<CompiledGlobs>
+LiteralGlobs::load(BlobReader& in, const GlobLoader& loadRest)
+{
+    std::unique_ptr<LiteralGlobs> retval(new LiteralGlobs());
+
+    for(auto n = in.count(8); n > 0; --n) {
+        retval->exact_[in.str()] = true;
+    }
+    loadTails(in, retval->basenames_);
+    loadTails(in, retval->extensions_);
+
+    if(in.u8()) {
+        retval->rest_ = loadRest(in);
+        if(!retval->rest_) {
+            return nullptr;
+        }
+    }
+
+    retval->indexPrefixes();
+
+    return std::move(retval);
+} // LiteralGlobs::load()
+
+// --- Public interface --------------------------------------------------
+
+std::unique_ptr<CompiledGlobs>
+compileWithLiteralIndex(const PathSet& globs, const GlobCompiler& compileRest)
+{
+    return std::unique_ptr<CompiledGlobs>(new LiteralGlobs(globs,
+                                          compileRest));
+}
+
+std::unique_ptr<CompiledGlobs>
+loadWithLiteralIndex(BlobReader& in, const GlobLoader& loadRest)
+{
+    return LiteralGlobs::load(in, loadRest);
+}
+
+} // namespace glob
+} // namespace smallcxx
@@ -21,6 +21,8 @@
 #include "smallcxx/logging.hpp"
 #include "smallcxx/string.hpp"
 
+#include "globstari-impl.hpp"
+
 using namespace std;
 using smallcxx::glob::PathCheckResult;
 
@@ -79,24 +81,21 @@ Matcher::addGlob(const smallcxx::glob::Path& glob)
 /// @details Adapted from
 /// editorconfig-core-c/src/lib/editorconfig.c:ini_handler()
 void
-Matcher::addGlob(const smallcxx::glob::Path& glob,
-                 const smallcxx::glob::Path& path)
+Matcher::addGlob(PathView glob, PathView path)
 {
     if(path.empty()) {
         throw domain_error("Matcher::addGlob: path must be nonempty");
     }
 
     // Strip trailing slash.  TODO handle this in a cleaner way.
-    smallcxx::glob::Path pathNoSlash;
-    if(*path.crbegin() == '/') {
-        pathNoSlash = path.substr(0, path.size() - 1);
-    } else {
-        pathNoSlash = path;
-    }
+    const PathView pathNoSlash(path.data(),
+                               path.size() - (path[path.size() - 1] == '/'));
 
-    Polarity polarity = (glob[0] == '!') ? Polarity::Exclude : Polarity::Include;
+    Polarity polarity = (!glob.empty() && glob[0] == '!') ?
+                        Polarity::Exclude : Polarity::Include;
 
     string fullGlob; // new glob of (essentially) `path`/`glob`
+    fullGlob.reserve(pathNoSlash.size() + glob.size() + 4);
 
     /* fullGlob is:
      * - path[double_star]/[glob] if glob does not contain '/'
@@ -108,20 +107,15 @@ Matcher::addGlob(const smallcxx::glob::Path& glob,
      */
 
     /* Escaping special characters in the directory part. */
-    size_t lastpos = 0;
-    size_t pos;
-    while((pos = pathNoSlash.find_first_of(ec_special_chars,
-                                           lastpos)) != pathNoSlash.npos) {
-        fullGlob += pathNoSlash.substr(lastpos, pos - lastpos);
-        fullGlob += '\\';  /* escaping char */
-        fullGlob += pathNoSlash[pos];
-        lastpos = pos + 1;
+    for(const char c : pathNoSlash) {
+        if(ec_special_chars.find(c) != ec_special_chars.npos) {
+            fullGlob += '\\';  /* escaping char */
+        }
+        fullGlob += c;
     }
 
-    // Copy any of the string that may be left
-    fullGlob += pathNoSlash.substr(lastpos);
-
-    if (glob.find('/') == glob.npos) { // No / is found, append '[star][star]/'
+    if(!memchr(glob.data(), '/', glob.size())) {
+        // No / is found, append '[star][star]/'
         fullGlob += "**/";
 
     } else if (glob[0] != '/') {
@@ -130,19 +124,53 @@ Matcher::addGlob(const smallcxx::glob::Path& glob,
     }
 
     if(polarity == Polarity::Include) {
-        fullGlob += glob;
+        fullGlob.append(glob.data(), glob.size());
     } else {
         // Move the polarity `!` to the beginning of fullGlob
-        fullGlob += &glob[1];
-        fullGlob = '!' + fullGlob;
+        fullGlob.append(glob.data() + 1, glob.size() - 1);
+        fullGlob.insert(fullGlob.begin(), '!');
     }
 
-    LOG_F(TRACE, "Glob '%s', path '%s', pathNoSlash '%s', fullGlob '%s'",
-          glob.c_str(), path.c_str(), pathNoSlash.c_str(), fullGlob.c_str());
+    LOG_F(TRACE, "Glob '%.*s', path '%.*s', fullGlob '%s'",
+          (int)glob.size(), glob.data(), (int)path.size(), path.data(),
+          fullGlob.c_str());
 
     addGlob(fullGlob);
 } // Matcher::addGlob()
 
+void
+Matcher::addIgnoreContents(PathView contents, PathView path)
+{
+    const char *const end = contents.end();
+    for(const char *line = contents.begin(); line < end; ) {
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        if(!eol) {
+            eol = end;
+        }
+
+        // Cut at an unescaped `#`.  A `#` at the start of the line (after
+        // whitespace) makes the whole line a comment.
+        const char *first = line;
+        while(first < eol && isspace((unsigned char)*first)) {
+            ++first;
+        }
+        const char *last = first;
+        while(last < eol && !(*last == '#' &&
+                              (last == first || last[-1] != '\\'))) {
+            ++last;
+        }
+        while(last > first && isspace((unsigned char)last[-1])) {
+            --last;
+        }
+
+        if(last > first) {
+            addGlob(PathView(first, last - first), path);
+        }
+
+        line = eol + 1;
+    }
+} // Matcher::addIgnoreContents()
+
 void
 Matcher::finalize()
 {
@@ -157,16 +185,129 @@ Matcher::ready() const
     return globsets_.empty() || globsets_.back().globSet.finalized();
 }
 
+Matcher
+Matcher::flattened() const
+{
+    if(!ready()) {
+        throw logic_error("Matcher: Call to flattened() when not ready --- call finalize() after adding globsets");
+    }
+
+    // All the globsets, lowest precedence first
+    std::vector<const SetAndPolarity *> chain;
+    std::vector<const Matcher *> matchers;
+    for(const Matcher *m = this; m; m = m->delegate_.get()) {
+        matchers.push_back(m);
+    }
+    for(auto it = matchers.crbegin(); it != matchers.crend(); ++it) {
+        for(const auto& sp : (*it)->globsets_) {
+            chain.push_back(&sp);
+        }
+    }
+
+    Matcher retval;
+    for(size_t first = 0; first < chain.size(); ) {
+        // [first, last) have the same polarity
+        size_t last = first + 1;
+        while(last < chain.size() &&
+                chain[last]->polarity == chain[first]->polarity) {
+            ++last;
+        }
+
+        if(last == first + 1) {
+            retval.globsets_.push_back(*chain[first]);  // shares the code
+        } else {
+            retval.globsets_.emplace_back(chain[first]->polarity);
+            auto& globSet = retval.globsets_.back().globSet;
+            for(size_t i = first; i < last; ++i) {
+                globSet.addGlobs(chain[i]->globSet.globs());
+            }
+            globSet.finalize();
+        }
+
+        first = last;
+    }
+
+    return retval;
+} // Matcher::flattened()
+
+// --- Matcher: Serialization --------------------------------------------
+
+/// Identifies a serialized Matcher
+static const char MATCHER_MAGIC[8] = {'S', 'C', 'X', 'M', 'A', 'T', 'C', 'H'};
+
+/// @details The layout is MATCHER_MAGIC, then the number of globsets, then
+/// each globset's polarity and GlobSet::serialize() output.
+std::string
+Matcher::serialize() const
+{
+    if(!ready()) {
+        throw logic_error("Matcher: Call to serialize() when not ready --- call finalize() after adding globsets");
+    }
+
+    string retval;
+    BlobWriter out(retval);
+    out.bytes(MATCHER_MAGIC, sizeof(MATCHER_MAGIC));
+    out.u64(globsets_.size());
+    for(const auto& sp : globsets_) {
+        out.u8((uint8_t)sp.polarity);
+        out.str(sp.globSet.serialize());
+    }
+    return retval;
+}
+
+Matcher
+Matcher::deserialize(const void *data, size_t size,
+                     const std::shared_ptr<Matcher>& delegate)
+{
+    Matcher retval(delegate);
+    BlobReader in(data, size);
+
+    if(in.bytes(sizeof(MATCHER_MAGIC)) !=
+            PathView(MATCHER_MAGIC, sizeof(MATCHER_MAGIC))) {
+        throw runtime_error("Not a serialized Matcher");
+    }
+
+    for(auto n = in.count(1 + 8); n > 0; --n) {
+        const auto polarity = in.u8();
+        if(polarity > (uint8_t)Polarity::Exclude) {
+            throw runtime_error("Corrupt serialized Matcher");
+        }
+
+        const auto globSet = in.str();
+        retval.globsets_.emplace_back((Polarity)polarity);
+        retval.globsets_.back().globSet =
+            GlobSet::deserialize(globSet.data(), globSet.size());
+    }
+
+    if(!in.atEnd()) {
+        throw runtime_error("Trailing data in serialized Matcher");
+    }
+
+    return retval;
+}
+
 // --- Matcher: Searching ------------------------------------------------
 
 bool
-Matcher::contains(const smallcxx::glob::Path& path) const
+Matcher::contains(PathView path) const
 {
-    return (check(path) == PathCheckResult::Included);
+    return contains(path, MatchContext::forThisThread());
 } // Matcher::contains()
 
+bool
+Matcher::contains(PathView path, MatchContext& context) const
+{
+    return (check(path, context) == PathCheckResult::Included);
+} // Matcher::contains(context)
+
+PathCheckResult
+Matcher::check(PathView path) const
+{
+    return check(path, MatchContext::forThisThread());
+} // Matcher::check()
+
 PathCheckResult
-Matcher::check(const smallcxx::glob::Path& path) const
+Matcher::check(PathView path, MatchContext& context) const
 {
     if(!ready()) {
         throw logic_error("Matcher: Call to check() or contains() when not ready --- call finalize() after adding globsets");
@@ -176,7 +317,7 @@ Matcher::check(const smallcxx::glob::Path& path) const
         return PathCheckResult::Unknown;
     }
 
-    if(*path.cbegin() != '/') {
+    if(path[0] != '/') {
         throw domain_error(
             "Matcher::contains: path must be absolute (start with /)");
     }
@@ -184,14 +325,116 @@ Matcher::check(const smallcxx::glob::Path& path) const
     // Check the globsets from back to front because later entries override
     // earlier entries.
     for(auto it = globsets_.crbegin(); it != globsets_.crend(); ++it) {
-        if(it->globSet.contains(path)) {
+        if(it->globSet.contains(path, context)) {
             return (it->polarity == Polarity::Include) ?
                    PathCheckResult::Included : PathCheckResult::Excluded;
         }
     }
 
-    return delegate_ ? delegate_->check(path) : PathCheckResult::Unknown;
-} // Matcher::check()
+    return delegate_ ? delegate_->check(path, context) :
+           PathCheckResult::Unknown;
+} // Matcher::check(context)
+
+std::vector<PathCheckResult>
+Matcher::checkMany(const PathView *paths, size_t count) const
+{
+    return checkMany(paths, count, MatchContext::forThisThread());
+}
+
+std::vector<PathCheckResult>
+Matcher::checkMany(const PathView *paths, size_t count,
+                   MatchContext& context) const
+{
+    std::vector<PathCheckResult> results(count, PathCheckResult::Unknown);
+    checkMany(paths, count, results, context);
+    return results;
+}
+
+void
+Matcher::checkMany(const PathView *paths, size_t count,
+                   std::vector<PathCheckResult>& results,
+                   MatchContext& context) const
+{
+    if(!ready()) {
+        throw logic_error("Matcher: Call to checkMany() when not ready --- call finalize() after adding globsets");
+    }
+
+    if(results.size() < count) {
+        throw logic_error("Matcher::checkMany: results vector is too small");
+    }
+
+    // Validate up front so we don't throw partway through
+    size_t numPending = 0;
+    for(size_t i = 0; i < count; ++i) {
+        if(results[i] != PathCheckResult::Unknown || paths[i].empty()) {
+            continue;
+        }
+        if(paths[i][0] != '/') {
+            throw domain_error(
+                "Matcher::checkMany: paths must be absolute (start with /)");
+        }
+        ++numPending;
+    }
+
+    // hits[i] is true for paths that don't need checking against the
+    // next globset: those already decided, and empty ones.
+    std::vector<bool> hits(count);
+
+    // Check the globsets from back to front because later entries override
+    // earlier entries.
+    for(auto it = globsets_.crbegin();
+            numPending && it != globsets_.crend(); ++it) {
+        for(size_t i = 0; i < count; ++i) {
+            hits[i] = (results[i] != PathCheckResult::Unknown);
+        }
+
+        it->globSet.containsMany(paths, count, hits, context);
+
+        const auto found = (it->polarity == Polarity::Include) ?
+                           PathCheckResult::Included : PathCheckResult::Excluded;
+        for(size_t i = 0; i < count; ++i) {
+            if(hits[i] && results[i] == PathCheckResult::Unknown) {
+                results[i] = found;
+                --numPending;
+            }
+        }
+    }
+
+    if(numPending && delegate_) {
+        delegate_->checkMany(paths, count, results, context);
+    }
+} // Matcher::checkMany(context)
+
+bool
+Matcher::canMatchUnder(PathView dir) const
+{
+    return canMatchUnder(dir, MatchContext::forThisThread());
+}
+
+/// @details Only Polarity::Include globsets can make a path included.
+/// Polarity::Exclude globsets are not considered, so this may return true
+/// for directories whose contents are all excluded.
+bool
+Matcher::canMatchUnder(PathView dir, MatchContext& context) const
+{
+    if(!ready()) {
+        throw logic_error("Matcher: Call to canMatchUnder() when not ready --- call finalize() after adding globsets");
+    }
+
+    if(dir.empty() || dir[0] != '/') {
+        throw domain_error(
+            "Matcher::canMatchUnder: dir must be absolute (start with /)");
+    }
+
+    for(const auto& sp : globsets_) {
+        if(sp.polarity == Polarity::Include &&
+                sp.globSet.canMatchUnder(dir, context)) {
+            return true;
+        }
+    }
+
+    return delegate_ && delegate_->canMatchUnder(dir, context);
+} // Matcher::canMatchUnder(context)
 
 } // namespace glob
 } // namespace smallcxx
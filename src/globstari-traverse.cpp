@@ -8,22 +8,46 @@
 
 #define SMALLCXX_LOG_DOMAIN "glob"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <dirent.h>
-#include <fstream>
+#include <exception>
+#include <fcntl.h>
+#include <list>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#endif
 
 #include "smallcxx/common.hpp"
 #include "smallcxx/globstari.hpp"
+#include "smallcxx/globstari-traverse.hpp"
 #include "smallcxx/logging.hpp"
 #include "smallcxx/string.hpp"
 
 using namespace std;
 using smallcxx::glob::Matcher;
 using smallcxx::glob::PathCheckResult;
+using smallcxx::detail::DescentNode;
+using smallcxx::detail::MatcherPtr;
 
 namespace smallcxx
 {
@@ -33,6 +57,14 @@ IProcessEntry::ignored(const std::shared_ptr<Entry>& entry)
 {
 }
 
+IProcessEntry::Status
+IProcessEntryBatch::operator()(const std::shared_ptr<Entry>& entry)
+{
+    std::vector<IProcessEntry::Status> statuses(1, Status::Continue);
+    const auto retval = processBatch(&entry, 1, statuses);
+    return (retval == Status::Continue) ? statuses[0] : retval;
+}
+
 // === Internal classes ==================================================
 
 /// Human-readable PathCheckResultNames.  All the same width to make the
@@ -43,9 +75,6 @@ static const char *PathCheckResultNames[3] = {
     "unknown ",
 };
 
-/// Control exception used to stop traversal early
-struct StopTraversal {};
-
 #if 0
 /// Split a path on the last `/`.  If no `/`, assume the whole thing is a name.
 /// If @p path has a `/`, puts everything up to and including that `/` in
@@ -66,317 +95,819 @@ splitPath(const glob::Path& path, glob::Path& dir, glob::Path& name)
 
 // === Breadth-first seach core ==========================================
 
-using MatcherPtr = std::shared_ptr<Matcher>;
+/// The literal directory at the start of needle @p glob, relative to the
+/// base path.  E.g., `a/b` for `a/b/**/*.c`.  Empty if @p glob can match
+/// outside any such directory.
+static glob::Path
+literalDirOf(const glob::Path& glob)
+{
+    // Matcher::addGlob() puts `**/` before globs without a `/`
+    if(glob.empty() || glob.find('/') == glob.npos) {
+        return "";
+    }
 
-/// An entry and corresponding ignores
-/// @invariant WorkItem::ignores is not NULL (but may be empty).
-struct WorkItem {
-    std::shared_ptr<Entry> entry;
-    MatcherPtr ignores;
+    const size_t start = (glob[0] == '/') ? 1 : 0;
+    const auto special = glob.find_first_of("*?[]{},\\");
+    const auto lastSlash = (special == glob.npos) ? glob.rfind('/') :
+                           glob.rfind('/', special);
+    if(lastSlash == glob.npos || lastSlash <= start) {
+        return "";
+    }
 
-    WorkItem(const std::shared_ptr<Entry>& newEntry)
-        : WorkItem(newEntry, make_shared<Matcher>())
-    {}
-    WorkItem(const std::shared_ptr<Entry>& newEntry, MatcherPtr newIgnores)
-        : entry(newEntry), ignores(newIgnores)
-    {
-        if(!ignores) {
-            throw logic_error("WorkItem: ignores must not be null");
+    // Only accept names canonical paths can have
+    const auto retval = glob.substr(start, lastSlash - start);
+    istringstream components(retval);
+    string component;
+    while(getline(components, component, '/')) {
+        if(component.empty() || component == "." || component == "..") {
+            return "";
         }
     }
 
-    WorkItem(const WorkItem&) = default;
-    ~WorkItem() = default;
+    return retval;
+} // literalDirOf()
 
-}; // class WorkItem
+/// Most paths expandLiteral() will produce for one needle
+static constexpr size_t LITERAL_EXPANSION_MAX = 256;
 
-/// Implementation of globstari()
-class Traverser
+static bool expandLiteralAlternatives(const glob::Path& glob, size_t& pos,
+                                      std::vector<glob::Path>& out);
+
+/// Expand the literal text and braces in @p glob from @p pos into @p out.
+/// Stops at the end of @p glob or, if @p inBraces, at a `,` or `}`.
+/// @return false if @p glob can match anything but a finite set of
+///     literal paths
+static bool
+expandLiteralSequence(const glob::Path& glob, size_t& pos, bool inBraces,
+                      std::vector<glob::Path>& out)
 {
-    /// The hierarchy to search
-    IFileTree& fileTree_;
+    out.assign(1, "");
 
-    /// Work queue for breadth-first search
-    std::deque<WorkItem> items_;
+    while(pos < glob.size()) {
+        const char c = glob[pos];
 
-    /// What we are looking for
-    smallcxx::glob::Matcher needleMatcher_;
+        if(c == '\\') {
+            // Backslash-letter is a regex escape, e.g., `\d`
+            if(pos + 1 >= glob.size() || isalnum(glob[pos + 1])) {
+                return false;
+            }
+            for(auto& path : out) {
+                path += glob[pos + 1];
+            }
+            pos += 2;
+
+        } else if(c == '{') {
+            ++pos;
+            std::vector<glob::Path> alternatives;
+            if(!expandLiteralAlternatives(glob, pos, alternatives) ||
+                    out.size() * alternatives.size() > LITERAL_EXPANSION_MAX) {
+                return false;
+            }
 
-    /// How low can you go?
-    ssize_t maxDepth_;
+            std::vector<glob::Path> product;
+            for(const auto& head : out) {
+                for(const auto& tail : alternatives) {
+                    product.push_back(head + tail);
+                }
+            }
+            out.swap(product);
 
-    /// What to do with entries
-    IProcessEntry& processEntry_;
+        } else if(inBraces && (c == ',' || c == '}')) {
+            return true;
 
-    glob::PathSet seen_;    ///< which paths we have seen so far
+        } else if(strchr("*?[]{},", c)) {
+            return false;
 
-    bool traversed_;        ///< have we already been run?
+        } else {
+            for(auto& path : out) {
+                path += c;
+            }
+            ++pos;
+        }
+    }
+
+    return !inBraces;   // an unclosed `{` is literal --- don't handle it
+} // expandLiteralSequence()
+
+/// Expand the `{a,b,...}` starting just after the `{` at @p pos into
+/// @p out.  On success, leaves @p pos just after the `}`.
+/// @return false if the alternatives are not all literal.  Also false for
+///     `{single}` and `{num1..num2}`, which are not alternations.
+static bool
+expandLiteralAlternatives(const glob::Path& glob, size_t& pos,
+                          std::vector<glob::Path>& out)
+{
+    bool sawComma = false;
+    out.clear();
+
+    while(true) {
+        std::vector<glob::Path> sequence;
+        if(!expandLiteralSequence(glob, pos, true, sequence) ||
+                pos >= glob.size()) {
+            return false;
+        }
+        out.insert(out.end(), sequence.begin(), sequence.end());
+        if(out.size() > LITERAL_EXPANSION_MAX) {
+            return false;
+        }
+
+        if(glob[pos++] == '}') {
+            break;
+        }
+        sawComma = true;
+    }
+
+    return sawComma;
+} // expandLiteralAlternatives()
+
+/// The paths, relative to the base path, that needle @p glob matches if
+/// it matches only a finite set of literal paths.  E.g., `a/x` and `a/y`
+/// for `a/{x,y}`.
+/// @return false if @p glob can match any other path
+static bool
+expandLiteral(const glob::Path& glob, std::vector<glob::Path>& out)
+{
+    // Matcher::addGlob() puts `**/` before globs without a `/`
+    if(glob.empty() || glob.find('/') == glob.npos) {
+        return false;
+    }
+
+    size_t pos = 0;
+    if(!expandLiteralSequence(glob, pos, false, out)) {
+        return false;
+    }
+
+    // Only accept names canonical paths can have
+    for(auto& path : out) {
+        if(!path.empty() && path[0] == '/') {
+            path.erase(0, 1);
+        }
+        if(path.empty()) {
+            return false;
+        }
+
+        istringstream components(path);
+        string component;
+        while(getline(components, component, '/')) {
+            if(component.empty() || component == "." || component == "..") {
+                return false;
+            }
+        }
+        if(path.back() == '/') {
+            return false;
+        }
+    }
+
+    return true;
+} // expandLiteral()
+
+// === IgnoreCache =======================================================
+
+/// The contents of an IgnoreCache
+class IgnoreCacheImpl
+{
+    /// The ignores for one directory, and what they were loaded from
+    struct Dir {
+        std::vector<smallcxx::glob::Path> paths;    ///< candidates
+        std::vector<FileStamp> stamps;  ///< of @c paths, when loaded
+        MatcherPtr parent;              ///< the parent directory's ignores
+        MatcherPtr ignores;             ///< the result
+    };
+
+    /// Key: canonical path of the directory
+    std::unordered_map<smallcxx::glob::Path, Dir> dirs_;
 
 public:
-    /// Ctor.
-    /// @param[in]  fileTree - see globstari()
-    /// @param[in]  processEntry - see globstari()
-    /// @param[in]  basePath - see globstari()
-    /// @param[in]  needle - see globstari().
-    /// @param[in]  maxDepth - see globstari()
-    ///
-    /// @throws AssertionFailure if @p needle is empty.
-    Traverser(IFileTree& fileTree, IProcessEntry& processEntry,
-              const smallcxx::glob::Path& basePath,
-              const std::vector<smallcxx::glob::Path>& needle,
-              ssize_t maxDepth
-             )
-        : fileTree_(fileTree), maxDepth_(maxDepth), processEntry_(processEntry),
-          traversed_(false)
+    mutable std::mutex mutex;   ///< protects everything in this class
+    size_t hits = 0;
+    size_t misses = 0;
+
+    /// The ignores above the root of a traversal.  The same every time,
+    /// so the root directory's cached ignores can be reused.
+    const MatcherPtr rootParent = make_shared<Matcher>();
+
+    /// Get cached ignores.  Call with @c mutex held.
+    /// @return the ignores, or nullptr if they are not cached or are out
+    ///     of date
+    MatcherPtr
+    find(const smallcxx::glob::Path& dirPath,
+         const std::vector<smallcxx::glob::Path>& paths,
+         const std::vector<FileStamp>& stamps, const MatcherPtr& parent)
     {
-        throw_unless(!needle.empty());
-        smallcxx::glob::Path rootPath = fileTree_.canonicalize(basePath);
-        needleMatcher_.addGlobs(needle, rootPath);
-        needleMatcher_.finalize();
+        const auto found = dirs_.find(dirPath);
+        if(found == dirs_.end() || found->second.parent != parent ||
+                found->second.paths != paths ||
+                found->second.stamps != stamps) {
+            ++misses;
+            return nullptr;
+        }
 
-        // Prime the pump.  Note: the ignores start out empty, so this
-        // first entry will not be ignored.
-        items_.push_back(fileTree_.rootDir(rootPath));
+        ++hits;
+        return found->second.ignores;
+    }
+
+    /// Save ignores.  Call with @c mutex held.
+    void
+    insert(const smallcxx::glob::Path& dirPath,
+           const std::vector<smallcxx::glob::Path>& paths,
+           const std::vector<FileStamp>& stamps, const MatcherPtr& parent,
+           const MatcherPtr& ignores)
+    {
+        dirs_[dirPath] = Dir{paths, stamps, parent, ignores};
+    }
+
+    size_t
+    size() const
+    {
+        return dirs_.size();
     }
 
-    /// Run the traversal.
-    /// @note Only one traversal per instantiation of Traverser!
-    void run();
+    void
+    clear()
+    {
+        dirs_.clear();
+    }
+}; // class IgnoreCacheImpl
 
-private:
-    /// Do the work
-    void worker();
+IgnoreCache::IgnoreCache()
+    : impl_(std::make_shared<IgnoreCacheImpl>())
+{}
 
-    /// Prepare to descend into a directory
-    void loadDir(const std::shared_ptr<Entry>& entry, MatcherPtr parentIgnores);
+size_t
+IgnoreCache::size() const
+{
+    lock_guard<mutex> lock(impl_->mutex);
+    return impl_->size();
+}
 
-    /// Load the contents of ignore files
-    MatcherPtr loadIgnoreFiles(const smallcxx::glob::Path& relativeTo_canonical,
-                               std::vector<smallcxx::glob::Path> loadFrom,
-                               MatcherPtr parentIgnores);
+size_t
+IgnoreCache::hits() const
+{
+    lock_guard<mutex> lock(impl_->mutex);
+    return impl_->hits;
+}
 
-    /// Read ignore file @p contents, which lives in @p relativeTo_canonical,
-    /// and add its contents to @p retval.
-    void
-    parseContentsInto(const Bytes& contents, Matcher& retval,
-                      const smallcxx::glob::Path& relativeTo_canonical);
-}; // class Traverser
+size_t
+IgnoreCache::misses() const
+{
+    lock_guard<mutex> lock(impl_->mutex);
+    return impl_->misses;
+}
 
 void
-Traverser::run()
+IgnoreCache::clear()
 {
-    if(traversed_) {
-        throw logic_error("Cannot call Traverser::run() more than once");
-    }
+    lock_guard<mutex> lock(impl_->mutex);
+    impl_->clear();
+}
 
-    traversed_ = true;
+// === Traverser =========================================================
 
-    try {
-        worker();
-    } catch(StopTraversal&) {
-        // Nothing to do
-    } // other exceptions propagate out
-} // Traverser::run()
+template class Traverser<IFileTree, IProcessEntry>;
+
+TraverserBase::TraverserBase(const std::vector<smallcxx::glob::Path>& needle,
+                             const GlobstariOptions& options)
+    : maxDepth_(options.maxDepth), pruneDirs_(options.pruneDirs),
+      depthFirst_(options.order == TraversalOrder::DepthFirst),
+      maxFrontier_(options.maxFrontier),
+      ignoreCache_(options.ignoreCache),
+      flattenIgnores_(options.flattenIgnores),
+      pending_(0), stop_(false), pushes_(0), idlers_(0),
+      walking_(false), resumeId_(PathTable::NONE), traversed_(false)
+{
+    throw_unless(!needle.empty());
+
+    auto nthreads = options.threads;
+    if(nthreads == 0) {
+        nthreads = std::max(std::thread::hardware_concurrency(), 1U);
+    }
+    for(unsigned i = 0; i < nthreads; ++i) {
+        threads_.emplace_back(new TraverserThread());
+    }
+}
 
 void
-Traverser::worker()
+TraverserBase::start(const smallcxx::glob::Path& rootPath,
+                     const std::vector<smallcxx::glob::Path>& needle,
+                     std::shared_ptr<Entry> root)
 {
-    while(!items_.empty()) {
+    needleMatcher_.addGlobs(needle, rootPath);
+    needleMatcher_.finalize();
+
+    if(pruneDirs_) {
+        planDescent(rootPath, needle);
+    }
 
-        // Not auto& --- copy the item so we can pop_front() right away
-        const auto item = items_.front();
-        items_.pop_front();
+    // Prime the pump.  Note: the ignores start out empty, so this
+    // first entry will not be ignored.
+    threads_[0]->items.push_back(WorkItem(std::move(root),
+                                          ignoreCache_ ?
+                                          ignoreCache_->impl_->rootParent :
+                                          make_shared<Matcher>()));
+    pending_ = 1;
+} // TraverserBase::start()
+
+void
+TraverserBase::planDescent(const smallcxx::glob::Path& rootPath,
+                           const std::vector<smallcxx::glob::Path>& needle)
+{
+    std::vector<smallcxx::glob::Path> dirs, paths, expanded;
+    for(const auto& glob : needle) {
+        if(glob.empty() || glob[0] == '!') {
+            continue;   // exclusions don't add anything to search
+        }
 
-        if(seen_.count(item.entry->canonPath)) {
-            LOG_F(TRACE, "already-seen %s --- skipping",
-                  item.entry->canonPath.c_str());
+        if(expandLiteral(glob, expanded)) {
+            paths.insert(paths.end(), expanded.begin(), expanded.end());
             continue;
         }
 
-        // TODO make sure this is in the right place
-        seen_.insert(item.entry->canonPath);
+        const auto dir = literalDirOf(glob);
+        if(dir.empty()) {
+            return;     // need to search the whole tree
+        }
+        dirs.push_back(dir);
+    }
 
-        if((maxDepth_ > 0) && (item.entry->depth > maxDepth_)) {
-            LOG_F(TRACE, "Skipping %s --- maxDepth exceeded",
-                  item.entry->canonPath.c_str());
-            continue;
+    for(const auto& dir : dirs) {
+        DescentNode *node = &descent_;
+        istringstream components(dir);
+        string component;
+        while(!node->read && getline(components, component, '/')) {
+            node = &node->children[component];
         }
 
-        // Check against the ignores we already have
-        item.entry->ignored = item.ignores->contains(item.entry->canonPath);
-        if(item.entry->ignored && !item.entry->neverIgnore) {
-            LOG_F(TRACE, "ignored %s --- skipping",
-                  item.entry->canonPath.c_str());
+        // Anything under dir will be found by reading dir
+        node->read = true;
+        node->children.clear();
+    }
 
-            // In case the client is interested
-            processEntry_.ignored(item.entry);
-            continue;
-        } else if(item.entry->ignored) {    // neverIgnore is true
-            LOG_F(TRACE, "proceeding with neverIgnore %s",
-                  item.entry->canonPath.c_str());
+    // Literal paths just need a lookup of each component
+    for(const auto& path : paths) {
+        DescentNode *node = &descent_;
+        istringstream components(path);
+        string component;
+        while(!node->read && getline(components, component, '/')) {
+            node = &node->children[component];
         }
+    }
 
-        // Is it a hit?
-        const auto match = needleMatcher_.check(item.entry->canonPath);
+    if(!descent_.children.empty()) {
+        descentAt_[rootPath] = &descent_;
+    }
+} // TraverserBase::planDescent()
 
-        LOG_F(TRACE, "pathcheck:%s for [%s]", PathCheckResultNames[(int)match],
-              item.entry->canonPath.c_str());
+bool
+TraverserBase::steal(TraverserThread& self)
+{
+    if(threads_.size() == 1) {
+        return false;
+    }
 
-        // Decide what to do
-        auto clientInstruction = IProcessEntry::Status::Continue;
+    for(const auto& victim : threads_) {
+        if(victim.get() == &self) {
+            continue;
+        }
 
-        if(match == PathCheckResult::Excluded) {
-            // Excluded => nothing more to do.  Simple!
+        unique_lock<mutex> lock(victim->itemsMutex);
+        if(victim->items.empty()) {
             continue;
+        }
+        const bool front = takeFromBack(*victim);
+        WorkItem item(std::move(front ? victim->items.front() :
+                                victim->items.back()));
+        if(front) {
+            victim->items.pop_front();
+        } else {
+            victim->items.pop_back();
+        }
+        lock.unlock();
 
-        } else if(match == PathCheckResult::Included) {
-            // Included => give it to the client.  Also simple!
-            clientInstruction = processEntry_(item.entry);
+        lock_guard<mutex> selfLock(self.itemsMutex);
+        self.items.push_back(std::move(item));
+        return true;
+    }
 
-        } else if(item.entry->ty == EntryType::Dir) {
-            // But directories not specifically included may contain
-            // files that are themselves included.  Therefore,
-            // descend into directories if match == Unknown.
-            loadDir(item.entry, item.ignores);
-            continue;
+    return false;
+} // TraverserBase::steal()
+
+void
+TraverserBase::wakeIdlers()
+{
+    if(idlers_ == 0) {
+        return;
+    }
+
+    // Lock so a thread can't miss the notification between checking its
+    // condition and waiting
+    {
+        lock_guard<mutex> lock(idleMutex_);
+    }
+    idle_.notify_all();
+} // TraverserBase::wakeIdlers()
+
+void
+TraverserBase::stop()
+{
+    stop_ = true;
+    {
+        lock_guard<mutex> lock(idleMutex_);
+    }
+    idle_.notify_all();
+} // TraverserBase::stop()
+
+void
+TraverserBase::fail()
+{
+    {
+        lock_guard<mutex> lock(idleMutex_);
+        if(!error_) {
+            error_ = current_exception();
         }
+    }
+    stop();
+} // TraverserBase::fail()
 
-        // Do what the client asked us to
-        switch(clientInstruction) {
-        case IProcessEntry::Status::Continue:
-            if(item.entry->ty == EntryType::Dir) {
-                loadDir(item.entry, item.ignores);
-            }
-            break;
+bool
+TraverserBase::visit(PathTable::Id parent, const Entry& entry,
+                     PathTable::Id& id)
+{
+    lock_guard<mutex> lock(stateMutex_);
+    if(!seen_.insert(parent, entry.canonPath, id)) {
+        LOG_F(TRACE, "already-seen %s --- skipping", entry.canonPath.c_str());
+        return false;
+    }
 
-        case IProcessEntry::Status::Skip:
-            // nothing to do
-            break;
+    return true;
+} // TraverserBase::visit()
 
-#if 0
-        // TODO implement this?
-        case IProcessEntry::Status::Pop:
-            // TODO pop the deque until `dir` changes
-            break;
-#endif
+bool
+TraverserBase::firstRead(const Entry& dir)
+{
+    if(dir.ino == 0) {
+        return true;
+    }
 
-        case IProcessEntry::Status::Stop:
-            throw StopTraversal();
-            break;
+    lock_guard<mutex> lock(stateMutex_);
+    if(!seenDirs_.insert(dir.dev, dir.ino)) {
+        LOG_F(TRACE, "already-read directory %s (%llu:%llu) --- skipping",
+              dir.canonPath.c_str(), (unsigned long long)dir.dev,
+              (unsigned long long)dir.ino);
+        return false;
+    }
 
-        default:
-            throw logic_error(STR_OF << "Unimplemented status value "
-                              << (int)clientInstruction);
-            break;
-        } //switch(clientInstruction)
+    return true;
+} // TraverserBase::firstRead()
+
+const DescentNode *
+TraverserBase::descentAt(const smallcxx::glob::Path& dirPath)
+{
+    lock_guard<mutex> lock(stateMutex_);
+    const auto found = descentAt_.find(dirPath);
+    return (found == descentAt_.end()) ? nullptr : found->second;
+}
 
-    } // while entries remain
-} // Traverser::worker()
+void
+TraverserBase::descendAt(const smallcxx::glob::Path& dirPath,
+                         const DescentNode& node)
+{
+    lock_guard<mutex> lock(stateMutex_);
+    descentAt_[dirPath] = &node;
+}
 
 void
-Traverser::loadDir(const std::shared_ptr<Entry>& entry,
-                   MatcherPtr parentIgnores)
+TraverserBase::checkBatch(const std::vector< std::shared_ptr<Entry> >& entries,
+                          const Matcher& ignores, TraverserThread& self)
 {
-    // Load the new ignores
-    auto ignoresToLoad = fileTree_.ignoresForDir(entry->canonPath);
-    auto ignores = loadIgnoreFiles(entry->canonPath,
-                                   ignoresToLoad, parentIgnores);
+    const auto count = entries.size();
 
-    // Load the new entries
-    auto newEntries = fileTree_.readDir(entry->canonPath);
-    for(auto& newEntry : newEntries) {
-        newEntry->depth = entry->depth + 1;
-        items_.emplace_back(newEntry, ignores);
+    self.batchPaths.clear();
+    for(const auto& entry : entries) {
+        self.batchPaths.emplace_back(entry->canonPath);
     }
-} // Traverser::loadDir()
 
-/// @todo Document and verify which paths have to end with a /
+    self.ignoreResults.assign(count, PathCheckResult::Unknown);
+    ignores.checkMany(self.batchPaths.data(), count, self.ignoreResults,
+                      self.matchContext);
+
+    // Ignored entries are skipped before the needle would be checked,
+    // so don't check them.  Excluded is just a placeholder.
+    self.needleResults.assign(count, PathCheckResult::Unknown);
+    for(size_t i = 0; i < count; ++i) {
+        auto& entry = *entries[i];
+        entry.ignored = (self.ignoreResults[i] == PathCheckResult::Included);
+        if(entry.ignored && !entry.neverIgnore) {
+            self.needleResults[i] = PathCheckResult::Excluded;
+        }
+    }
+
+    needleMatcher_.checkMany(self.batchPaths.data(), count,
+                             self.needleResults, self.matchContext);
+} // TraverserBase::checkBatch()
+
+std::vector<smallcxx::glob::Path>
+TraverserBase::ignorePaths(const smallcxx::glob::Path& relativeTo_canonical,
+                           const std::vector<smallcxx::glob::Path>& loadFrom)
+{
+    std::vector<smallcxx::glob::Path> pathsToTry;
+    for(const auto& toLoad : loadFrom) {
+        if(!toLoad.empty() && toLoad.front() == '/') {  // absolute
+            pathsToTry.push_back(toLoad);
+            continue;
+        }
+
+        // For ignores in the root dir of the tree, relativeTo_canonical
+        // may be "/".  If so, don't add another `/`.
+        pathsToTry.push_back(relativeTo_canonical);
+        if(relativeTo_canonical.back() != '/') {
+            pathsToTry.back() += '/';
+        }
+        pathsToTry.back() += toLoad;
+    }
+    return pathsToTry;
+} // TraverserBase::ignorePaths()
+
 MatcherPtr
-Traverser::loadIgnoreFiles(const smallcxx::glob::Path& relativeTo_canonical,
-                           std::vector<smallcxx::glob::Path> loadFrom,
-                           MatcherPtr parentIgnores)
+TraverserBase::cachedIgnores(const smallcxx::glob::Path& dirPath,
+                             const std::vector<smallcxx::glob::Path>& paths,
+                             const std::vector<FileStamp>& stamps,
+                             const MatcherPtr& parent)
 {
-    MatcherPtr retval(new Matcher(parentIgnores));
+    auto& cache = *ignoreCache_->impl_;
+    lock_guard<mutex> lock(cache.mutex);
+    return cache.find(dirPath, paths, stamps, parent);
+}
 
-    for(const auto& toLoad : loadFrom) {
-        bool ok = false;
-        glob::Path pathToTry, canonPath;
-        Bytes contents;
+void
+TraverserBase::cacheIgnores(const smallcxx::glob::Path& dirPath,
+                            const std::vector<smallcxx::glob::Path>& paths,
+                            const std::vector<FileStamp>& stamps,
+                            const MatcherPtr& parent,
+                            const MatcherPtr& ignores)
+{
+    auto& cache = *ignoreCache_->impl_;
+    lock_guard<mutex> lock(cache.mutex);
+    cache.insert(dirPath, paths, stamps, parent, ignores);
+}
 
-        if(!toLoad.empty() && toLoad.front() == '/') {  // absolute
-            pathToTry = canonPath = toLoad;
-        } else {
-            pathToTry = relativeTo_canonical;
+const char *
+TraverserBase::resultName(PathCheckResult result)
+{
+    return PathCheckResultNames[(int)result];
+}
+
+const std::string&
+TraverserBase::logDomain()
+{
+    return SMALLCXX_LOG_DOMAIN_NAME;
+}
+
+
+// === GlobstariWalk ======================================================
+
+/// The IProcessEntry for a Traverser that is being walked, which doesn't
+/// call it
+class WalkProcessEntry: public IProcessEntry
+{
+public:
+    // LCOV_EXCL_START - unreachable
+    IProcessEntry::Status
+    operator()(const std::shared_ptr<Entry>& entry) override
+    {
+        throw logic_error("WalkProcessEntry should not be called");
+    }
+    // LCOV_EXCL_STOP
+};
+
+static WalkProcessEntry walkProcessEntry;
+
+GlobstariWalk::GlobstariWalk(IFileTree& fileTree,
+                             const smallcxx::glob::Path& basePath,
+                             const std::vector<smallcxx::glob::Path>& needle,
+                             const GlobstariOptions& options)
+{
+    GlobstariOptions walkOptions(options);
+    walkOptions.threads = 1;
+    traverser_.reset(new Traverser<IFileTree, IProcessEntry>(fileTree,
+                     walkProcessEntry, basePath, needle, walkOptions));
+}
+
+GlobstariWalk::~GlobstariWalk() = default;
 
-            // For ignores in the root dir of the tree, relativeTo_canonical
-            // may be "/".  If so, don't add another `/`.
-            if(relativeTo_canonical.back() != '/') {
-                pathToTry += '/';
+std::shared_ptr<Entry>
+GlobstariWalk::next()
+{
+    return traverser_->next(0);
+}
+
+std::shared_ptr<Entry>
+GlobstariWalk::next(size_t maxVisits)
+{
+    return traverser_->next(maxVisits);
+}
+
+void
+GlobstariWalk::skip()
+{
+    traverser_->skip();
+}
+
+bool
+GlobstariWalk::done() const
+{
+    return traverser_->done();
+}
+
+// === IFileTree and globstari() =========================================
+
+// --- Default implementations of IFileTree methods ---
+
+// --- Entry allocation ---
+
+/// Blocks of @p Size bytes, aligned to @p Align, that are recycled when
+/// freed rather than returned to the heap.  Each thread keeps a cache of
+/// free blocks, and trades them with a global list in batches, so most
+/// allocations and frees take no lock.  Memory is never returned to the
+/// heap, so the pool grows to the most blocks in use at once.
+template<size_t Size, size_t Align>
+class BlockPool
+{
+    union Block {
+        Block *next;
+        alignas(Align) unsigned char data[Size];
+    };
+
+    /// Blocks a thread takes from, or gives back to, the global list at once
+    static constexpr size_t BATCH = 64;
+
+    /// Blocks to get from the heap at once
+    static constexpr size_t CHUNK = 256;
+
+    /// Free blocks not in any thread's cache
+    struct Global {
+        std::mutex mutex;
+        Block *free = nullptr;
+    };
+
+    /// Never destroyed, since entries may be freed during static
+    /// destruction
+    static Global&
+    global()
+    {
+        static Global *const retval = new Global();
+        return *retval;
+    }
+
+    /// A thread's free blocks
+    struct Cache {
+        Block *free = nullptr;
+        size_t count = 0;
+
+        /// Give @p n of the blocks to the global list
+        void
+        giveBack(size_t n)
+        {
+            if(n == 0) {
+                return;
             }
+            Block *first = free, *last = free;
+            for(size_t i = 1; i < n; ++i) {
+                last = last->next;
+            }
+            free = last->next;
+            count -= n;
 
-            pathToTry += toLoad;
-            canonPath = fileTree_.canonicalize(pathToTry);
+            auto& g = global();
+            lock_guard<mutex> lock(g.mutex);
+            last->next = g.free;
+            g.free = first;
         }
 
-        if(!canonPath.empty()) {
-            try {
-                contents = fileTree_.readFile(canonPath);
-                ok = true;
-            } catch(...) {
-                ok = false;
+        /// Get up to BATCH blocks from the global list, or a new chunk
+        /// from the heap
+        void
+        refill()
+        {
+            {
+                auto& g = global();
+                lock_guard<mutex> lock(g.mutex);
+                while(g.free && count < BATCH) {
+                    Block *const block = g.free;
+                    g.free = block->next;
+                    block->next = free;
+                    free = block;
+                    ++count;
+                }
+            }
+            if(free) {
+                return;
+            }
+
+            Block *const chunk = new Block[CHUNK];
+            for(size_t i = 0; i < CHUNK; ++i) {
+                chunk[i].next = free;
+                free = &chunk[i];
             }
+            count += CHUNK;
         }
 
-        if(ok) {
-            LOG_F(LOG, "Loaded ignore file %s", pathToTry.c_str());
-        } else {
-            LOG_F(TRACE,
-                  "skipping non-existent or unreadable ignore-file candidate %s",
-                  pathToTry.c_str());
-            continue;
+        ~Cache()
+        {
+            giveBack(count);
         }
+    };
 
-        parseContentsInto(contents, *retval, relativeTo_canonical);
+    static Cache&
+    cache()
+    {
+        static thread_local Cache retval;
+        return retval;
     }
-    retval->finalize();
 
-    return retval;
-}
+public:
+    static void *
+    allocate()
+    {
+        auto& c = cache();
+        if(!c.free) {
+            c.refill();
+        }
+        Block *const block = c.free;
+        c.free = block->next;
+        --c.count;
+        return block;
+    }
 
-/// @todo make this part of the public API
-void
-Traverser::parseContentsInto(const Bytes& contents,
-                             Matcher& retval,
-                             const smallcxx::glob::Path& relativeTo_canonical)
-{
-    istringstream ss(contents);
-    string s;
-    while(getline(ss, s)) {
-        auto pattern = trim(s);   // no leading/trailing ws
-        if(pattern.empty() || pattern[0] == '#') {
-            continue;
+    static void
+    deallocate(void *p)
+    {
+        auto& c = cache();
+        Block *const block = static_cast<Block *>(p);
+        block->next = c.free;
+        c.free = block;
+        if(++c.count > 2 * CHUNK) {
+            c.giveBack(CHUNK);
         }
+    }
+}; // class BlockPool
 
-        // Check for non-escaped #
-        for(size_t idx = 1; idx < pattern.size(); ++idx) {
-            if( (pattern[idx] == '#') && (pattern[idx - 1] != '\\') ) {
-                pattern = trim(pattern.substr(0, idx));
-                break;
-            }
+/// An allocator using BlockPool, for std::allocate_shared()
+template<class T>
+struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() = default;
+
+    template<class U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+
+    T *
+    allocate(size_t n)
+    {
+        if(n != 1) {
+            return static_cast<T *>(::operator new(n * sizeof(T)));
         }
+        return static_cast<T *>(BlockPool<sizeof(T), alignof(T)>::allocate());
+    }
 
-        retval.addGlob(pattern, relativeTo_canonical);
+    void
+    deallocate(T *p, size_t n)
+    {
+        if(n != 1) {
+            ::operator delete(p);
+        } else {
+            BlockPool<sizeof(T), alignof(T)>::deallocate(p);
+        }
     }
+}; // struct PoolAllocator
+
+template<class T, class U>
+bool
+operator==(const PoolAllocator<T>&, const PoolAllocator<U>&)
+{
+    return true;
 }
 
-// === IFileTree and globstari() =========================================
+template<class T, class U>
+bool
+operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&)
+{
+    return false;
+}
 
-// --- Default implementations of IFileTree methods ---
+std::shared_ptr<Entry>
+IFileTree::makeEntry(EntryType ty, const smallcxx::glob::Path& canonPath)
+{
+    return std::allocate_shared<Entry>(PoolAllocator<Entry>(), ty,
+                                       canonPath);
+}
 
 std::shared_ptr<Entry>
 IFileTree::rootDir(const smallcxx::glob::Path& rootPath)
 {
-    return std::make_shared<Entry>(EntryType::Dir, rootPath, 0);
+    auto retval = makeEntry(EntryType::Dir, rootPath);
+    retval->depth = 0;
+    return retval;
 }
 
 std::vector<smallcxx::glob::Path>
@@ -385,8 +916,49 @@ IFileTree::ignoresForDir(const smallcxx::glob::Path& dirName)
     return { ".eignore" };
 }
 
+std::shared_ptr<Entry>
+IFileTree::lookup(const smallcxx::glob::Path& path)
+{
+    const auto lastSlash = path.rfind('/');
+    if(lastSlash == path.npos) {
+        return nullptr;
+    }
+
+    const auto parent = (lastSlash == 0) ? smallcxx::glob::Path("/") :
+                        path.substr(0, lastSlash);
+    for(const auto& entry : readDir(parent)) {
+        if(entry->canonPath == path) {
+            return entry;
+        }
+    }
+
+    return nullptr;
+}
+
+void
+IFileTree::prefetch(const std::vector< std::shared_ptr<Entry> >& entries)
+{
+}
+
+bool
+IFileTree::stamp(const smallcxx::glob::Path& path, FileStamp& stamp)
+{
+    return false;
+}
+
 // --- The main invoker ---
 
+void
+globstari(IFileTree& fileTree,
+          IProcessEntry& processEntry,
+          const smallcxx::glob::Path& basePath,
+          const std::vector<smallcxx::glob::Path>& needle,
+          const GlobstariOptions& options)
+{
+    globstari<IFileTree, IProcessEntry>(fileTree, processEntry, basePath,
+                                        needle, options);
+}
+
 void
 globstari(IFileTree& fileTree,
           IProcessEntry& processEntry,
@@ -394,68 +966,808 @@ globstari(IFileTree& fileTree,
           const std::vector<smallcxx::glob::Path>& needle,
           ssize_t maxDepth)
 {
-    Traverser t(fileTree, processEntry, basePath, needle, maxDepth);
-    t.run();
+    GlobstariOptions options;
+    options.maxDepth = maxDepth;
+    globstari(fileTree, processEntry, basePath, needle, options);
 }
 
 // === DiskFileTree ======================================================
 
-/// @todo PORTABILITY: handle readdir() that doesn't set d_type
-std::vector< std::shared_ptr<Entry> >
-DiskFileTree::readDir(const smallcxx::glob::Path& dirName)
+/// A directory's file descriptor.  Closed when the last user is done.
+struct DirFd {
+    const int fd;
+    explicit DirFd(int newFd): fd(newFd) {}
+    DirFd(const DirFd&) = delete;
+    DirFd& operator=(const DirFd&) = delete;
+    ~DirFd()
+    {
+        close(fd);
+    }
+};
+
+using DirFdPtr = std::shared_ptr<const DirFd>;
+
+/// The most recently used directories of a DiskFileTree, by canonical path
+class DirFdCache
 {
-    std::unique_ptr<DIR, void(*)(DIR *)> dirp(
-        opendir(dirName.c_str()),
-    [](DIR * d) {
-        closedir(d);
+    const size_t capacity_;
+    std::mutex mutex_;
+
+    /// Most recently used first
+    std::list< std::pair<smallcxx::glob::Path, DirFdPtr> > lru_;
+
+    std::unordered_map<smallcxx::glob::Path, decltype(lru_)::iterator> index_;
+
+public:
+    explicit DirFdCache(size_t capacity): capacity_(capacity) {}
+
+    /// Get the fd of @p dirPath, or nullptr if it isn't open
+    DirFdPtr
+    find(const smallcxx::glob::Path& dirPath)
+    {
+        lock_guard<mutex> lock(mutex_);
+        const auto found = index_.find(dirPath);
+        if(found == index_.end()) {
+            return nullptr;
+        }
+        lru_.splice(lru_.begin(), lru_, found->second);
+        return found->second->second;
+    }
+
+    /// Remember that @p dirFd is @p dirPath.  Closes the least recently
+    /// used directory if there are too many.
+    void
+    insert(const smallcxx::glob::Path& dirPath, const DirFdPtr& dirFd)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if(index_.count(dirPath)) {
+            return;     // another thread got there first
+        }
+
+        lru_.emplace_front(dirPath, dirFd);
+        index_[dirPath] = lru_.begin();
+        if(lru_.size() > capacity_) {
+            index_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+    }
+
+    /// Get the fd of directory @p dirPath, opening it relative to its
+    /// parent if the parent is open.  Only opens real directories, not
+    /// symlinks, so the result is canonical if the parent is.
+    /// @param[in]  dirPath - the path
+    /// @param[in]  canonical - if true, @p dirPath is known to be
+    ///     canonical, so open it by full path if its parent isn't open.
+    /// @return the fd, or nullptr if @p dirPath can't be opened this way
+    DirFdPtr
+    open(const smallcxx::glob::Path& dirPath, bool canonical)
+    {
+        auto retval = find(dirPath);
+        if(retval) {
+            return retval;
+        }
+
+        smallcxx::glob::Path name;
+        const auto parent = openParent(dirPath, name);
+        int fd = -1;
+        if(parent) {
+            fd = openat(parent->fd, name.c_str(),
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        } else if(canonical) {
+            fd = ::open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        if(fd < 0) {
+            return nullptr;
+        }
+
+        retval = std::make_shared<DirFd>(fd);
+        insert(dirPath, retval);
+        return retval;
+    }
+
+    /// Get the fd of the directory containing @p path, opening it
+    /// relative to its nearest open ancestor.  See open().
+    /// Also puts the last component of @p path in @p name.
+    /// @return the fd, or nullptr if no ancestor is open or if @p path's
+    ///     last component isn't a plain name.
+    DirFdPtr
+    openParent(const smallcxx::glob::Path& path, smallcxx::glob::Path& name)
+    {
+        const auto lastSlash = path.rfind('/');
+        if(lastSlash == path.npos) {
+            return nullptr;
+        }
+
+        name = path.substr(lastSlash + 1);
+        if(name.empty() || name == "." || name == "..") {
+            return nullptr;
+        }
+
+        return open(lastSlash == 0 ? smallcxx::glob::Path("/") :
+                    path.substr(0, lastSlash), false);
+    }
+}; // class DirFdCache
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/// A minimal io_uring: submit a batch of requests, then wait for all
+/// of them to complete.
+class IoRing
+{
+    int fd_;
+    unsigned entries_;
+
+    /// @name Submission queue
+    /// @{
+    unsigned *sqTail_, *sqMask_, *sqArray_;
+    io_uring_sqe *sqes_;
+    /// @}
+
+    /// @name Completion queue
+    /// @{
+    unsigned *cqHead_, *cqTail_, *cqMask_;
+    io_uring_cqe *cqes_;
+    /// @}
+
+    /// @name Mappings
+    /// @{
+    void *sqRing_, *cqRing_;
+    size_t sqRingSize_, cqRingSize_, sqesSize_;
+    /// @}
+
+public:
+    /// Set up a ring with room for @p entries requests.  Check ok()
+    /// afterwards.
+    explicit IoRing(unsigned entries)
+        : fd_(-1), entries_(0), sqes_(nullptr), cqes_(nullptr),
+          sqRing_(MAP_FAILED), cqRing_(MAP_FAILED), sqRingSize_(0),
+          cqRingSize_(0), sqesSize_(0)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd_ = syscall(__NR_io_uring_setup, entries, &params);
+        if(fd_ < 0) {
+            return;
+        }
+
+        sqRingSize_ = params.sq_off.array +
+                      params.sq_entries * sizeof(unsigned);
+        cqRingSize_ = params.cq_off.cqes +
+                      params.cq_entries * sizeof(io_uring_cqe);
+        const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if(single) {
+            sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+        }
+
+        sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        cqRing_ = single ? sqRing_ :
+                  mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+        void *const sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, fd_,
+                                IORING_OFF_SQES);
+        if(sqRing_ == MAP_FAILED || cqRing_ == MAP_FAILED ||
+                sqes == MAP_FAILED) {
+            if(sqes != MAP_FAILED) {
+                munmap(sqes, sqesSize_);
+            }
+            return;     // ok() is false
+        }
+
+        char *const sq = (char *)sqRing_;
+        sqTail_ = (unsigned *)(sq + params.sq_off.tail);
+        sqMask_ = (unsigned *)(sq + params.sq_off.ring_mask);
+        sqArray_ = (unsigned *)(sq + params.sq_off.array);
+        sqes_ = (io_uring_sqe *)sqes;
+
+        char *const cq = (char *)cqRing_;
+        cqHead_ = (unsigned *)(cq + params.cq_off.head);
+        cqTail_ = (unsigned *)(cq + params.cq_off.tail);
+        cqMask_ = (unsigned *)(cq + params.cq_off.ring_mask);
+        cqes_ = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+        entries_ = params.sq_entries;
+    }
+
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+
+    ~IoRing()
+    {
+        if(sqes_) {
+            munmap(sqes_, sqesSize_);
+        }
+        if(cqRing_ != MAP_FAILED && cqRing_ != sqRing_) {
+            munmap(cqRing_, cqRingSize_);
+        }
+        if(sqRing_ != MAP_FAILED) {
+            munmap(sqRing_, sqRingSize_);
+        }
+        if(fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    bool
+    ok() const
+    {
+        return entries_ > 0;
+    }
+
+    /// Most requests submitAndWait() can handle at once
+    unsigned
+    capacity() const
+    {
+        return entries_;
+    }
+
+    /// Request @p index of the next batch, cleared.
+    /// @p index must be less than capacity().
+    io_uring_sqe *
+    sqe(unsigned index)
+    {
+        io_uring_sqe *const retval = &sqes_[(*sqTail_ + index) & *sqMask_];
+        memset(retval, 0, sizeof(*retval));
+        return retval;
+    }
+
+    /// Submit requests 0..@p count-1 filled in through sqe(), and wait for
+    /// all of them to complete.  Calls @p done with each request's
+    /// @c user_data and result.
+    /// @return false if the requests could not be submitted
+    template<class Done>
+    bool
+    submitAndWait(unsigned count, Done done)
+    {
+        const unsigned tail = *sqTail_;
+        for(unsigned i = 0; i < count; ++i) {
+            const unsigned index = (tail + i) & *sqMask_;
+            sqArray_[index] = index;
+        }
+        __atomic_store_n(sqTail_, tail + count, __ATOMIC_RELEASE);
+
+        unsigned toSubmit = count, completed = 0;
+        while(completed < count) {
+            const long ret = syscall(__NR_io_uring_enter, fd_, toSubmit,
+                                     1U, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if(ret < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                if(completed == 0 && toSubmit == count) {
+                    // Nothing happened.  Take back the requests.
+                    __atomic_store_n(sqTail_, tail, __ATOMIC_RELEASE);
+                    return false;
+                }
+                // LCOV_EXCL_START - shouldn't happen
+                throw system_error(errno, std::generic_category(),
+                                   "io_uring_enter failed");
+                // LCOV_EXCL_STOP
+            }
+            toSubmit -= std::min<unsigned>(toSubmit, ret);
+
+            unsigned head = *cqHead_;
+            const unsigned cqTail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+            for(; head != cqTail; ++head, ++completed) {
+                const io_uring_cqe& cqe = cqes_[head & *cqMask_];
+                done(cqe.user_data, cqe.res);
+            }
+            __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+        }
+
+        return true;
+    }
+}; // class IoRing
+
+/// Requests in flight at once
+static constexpr unsigned IO_RING_ENTRIES = 256;
+
+#endif // HAVE_LINUX_IO_URING_H
+
+/// Asynchronous I/O for DiskFileTree::prefetch()
+class AsyncDirIo
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    IoRing ring_;
+#endif
+
+    /// Serializes use of the ring
+    std::mutex ringMutex_;
+
+    /// Results of checking for ignore files: `st_mode`, or -errno.
+    /// Each is used once, during the traversal that made it, by
+    /// DiskFileTree::canonicalize(), or by DiskFileTree::stamp() if the
+    /// file doesn't exist.
+    std::unordered_map<smallcxx::glob::Path, int> probes_;
+    std::mutex probesMutex_;
+
+public:
+    AsyncDirIo()
+#ifdef HAVE_LINUX_IO_URING_H
+        : ring_(IO_RING_ENTRIES)
+#endif
+    {}
+
+    /// Whether this can do anything
+    bool
+    ok() const
+    {
+#ifdef HAVE_LINUX_IO_URING_H
+        return ring_.ok();
+#else
+        return false;
+#endif
+    }
+
+    /// Get the result of probing @p path, and forget it unless
+    /// @p keepIfFound and @p path exists.
+    /// @return false if @p path has not been probed
+    bool
+    takeProbe(const smallcxx::glob::Path& path, int& result,
+              bool keepIfFound = false)
+    {
+        lock_guard<mutex> lock(probesMutex_);
+        const auto found = probes_.find(path);
+        if(found == probes_.end()) {
+            return false;
+        }
+        result = found->second;
+        if(!keepIfFound || result == -ENOENT) {
+            probes_.erase(found);
+        }
+        return true;
+    }
+
+    /// Forget all the probe results.  Those for directories that weren't
+    /// read are out of date by the next traversal.
+    void
+    clearProbes()
+    {
+        lock_guard<mutex> lock(probesMutex_);
+        probes_.clear();
     }
-    );
 
+    /// See DiskFileTree::prefetch()
+    void prefetch(DiskFileTree& tree, DirFdCache& dirFds,
+                  const std::vector< std::shared_ptr<Entry> >& entries);
+}; // class AsyncDirIo
+
+void
+AsyncDirIo::prefetch(DiskFileTree& tree, DirFdCache& dirFds,
+                     const std::vector< std::shared_ptr<Entry> >& entries)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    /// One request
+    struct Request {
+        bool isOpen;                    ///< else statx
+        smallcxx::glob::Path path;      ///< path of the dir or ignore file
+        smallcxx::glob::Path relative;  ///< path relative to @c parent
+        DirFdPtr parent;                ///< open parent of @c path
+        struct statx stx;               ///< statx result
+    };
+    std::vector<Request> requests;
+
+    for(const auto& entry : entries) {
+        if(entry->ty != EntryType::Dir ||
+                (entry->ignored && !entry->neverIgnore) ||
+                dirFds.find(entry->canonPath)) {
+            continue;
+        }
+
+        smallcxx::glob::Path name;
+        const auto parent = dirFds.openParent(entry->canonPath, name);
+        if(!parent) {
+            continue;
+        }
+
+        requests.push_back({true, entry->canonPath, name, parent, {}});
+
+        const auto& dirPath = entry->canonPath;
+        for(const auto& ignore : tree.ignoresForDir(dirPath)) {
+            if(ignore.empty() || ignore[0] == '/') {
+                continue;   // only relative ones
+            }
+            // As Traverser::loadIgnoreFiles()
+            const auto path = dirPath +
+                              (dirPath.back() == '/' ? "" : "/") + ignore;
+            requests.push_back({false, path, name + "/" + ignore, parent, {}});
+        }
+    }
+
+    if(requests.empty()) {
+        return;
+    }
+
+    lock_guard<mutex> lock(ringMutex_);
+    for(size_t start = 0; start < requests.size(); ) {
+        const unsigned count = std::min<size_t>(ring_.capacity(),
+                                                requests.size() - start);
+        for(unsigned i = 0; i < count; ++i) {
+            auto& request = requests[start + i];
+            auto *const sqe = ring_.sqe(i);
+            sqe->fd = request.parent->fd;
+            sqe->addr = (uint64_t)(uintptr_t)request.relative.c_str();
+            sqe->user_data = start + i;
+            if(request.isOpen) {
+                // Like DirFdCache::open()
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->open_flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                                  O_CLOEXEC;
+            } else {
+                sqe->opcode = IORING_OP_STATX;
+                sqe->len = STATX_TYPE;
+                sqe->off = (uint64_t)(uintptr_t)&request.stx;
+                sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            }
+        }
+
+        const bool submitted = ring_.submitAndWait(count,
+        [&](uint64_t index, int result) {
+            auto& request = requests[index];
+            if(request.isOpen) {
+                if(result >= 0) {
+                    dirFds.insert(request.path,
+                                  std::make_shared<DirFd>(result));
+                }
+                return;
+            }
+
+            // -EINVAL etc.: the kernel can't do it, so don't record it
+            if(result == 0 || result == -ENOENT) {
+                lock_guard<mutex> lock(probesMutex_);
+                probes_[request.path] = result ? result : request.stx.stx_mode;
+            }
+        });
+        if(!submitted) {
+            return;     // fall back to synchronous I/O
+        }
+
+        start += count;
+    }
+#endif // HAVE_LINUX_IO_URING_H
+} // AsyncDirIo::prefetch()
+
+DiskFileTree::DiskFileTree(size_t maxOpenDirs, bool asyncIo,
+                           bool followSymlinks)
+    : followSymlinks_(followSymlinks)
+{
+    if(maxOpenDirs > 0) {
+        dirFds_ = std::make_shared<DirFdCache>(maxOpenDirs);
+        if(asyncIo) {
+            asyncIo_ = std::make_shared<AsyncDirIo>();
+            if(!asyncIo_->ok()) {
+                LOG_F(INFO, "io_uring is not available; using synchronous I/O");
+                asyncIo_.reset();
+            }
+        }
+    }
+}
+
+void
+DiskFileTree::prefetch(const std::vector< std::shared_ptr<Entry> >& entries)
+{
+    if(asyncIo_) {
+        asyncIo_->prefetch(*this, *dirFds_, entries);
+    }
+}
+
+/// How to read a directory
+struct ReadDirParams {
+    IFileTree& tree;                ///< makes the entries
+    smallcxx::glob::Path prefix;    ///< the directory's path, then `/`
+    int fd;                         ///< an fd of the directory
+    bool follow;                    ///< follow symlinks and fill in ids?
+    uint64_t dev;                   ///< the directory's device, if follow
+};
+
+/// Add directory entry @p name to @p entries, if globstari() should see it
+/// @param[in]  entries - where to add it
+/// @param[in]  params - the directory
+/// @param[in]  name - the entry's name.  NUL-terminated.
+/// @param[in]  nameLength - strlen(name)
+/// @param[in]  dType - the entry's `d_type`
+/// @param[in]  dIno - the entry's `d_ino`
+static void
+appendEntry(std::vector< std::shared_ptr<Entry> >& entries,
+            const ReadDirParams& params, const char *name,
+            size_t nameLength, unsigned char dType, uint64_t dIno)
+{
+    if(name[0] == '.' && (nameLength == 1 ||
+                          (nameLength == 2 && name[1] == '.'))) {
+        return;     // `.` or `..`
+    }
+
+    // Some filesystems don't fill in d_type.  Also, find out what symlinks
+    // point to if we're following them.
+    uint64_t dev = params.dev, ino = dIno;
+    struct stat st;
+    if((dType == DT_UNKNOWN || (params.follow && dType == DT_LNK)) &&
+            fstatat(params.fd, name, &st,
+                    params.follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0) {
+        dType = S_ISREG(st.st_mode) ? DT_REG :
+                S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+        dev = st.st_dev;
+        ino = st.st_ino;
+    }
+
+    EntryType ty;
+    if(dType == DT_REG) {
+        ty = EntryType::File;
+    } else if(dType == DT_DIR) {
+        ty = EntryType::Dir;
+    } else {
+        LOG_F(TRACE, "Skipping [%s%s] of type %c", params.prefix.c_str(), name,
+              dType);
+        return;
+    }
+
+    smallcxx::glob::Path canonPath;
+    canonPath.reserve(params.prefix.size() + nameLength);
+    canonPath.append(params.prefix).append(name, nameLength);
+
+    LOG_F(TRACE, "Found %s [%s]",
+          (ty == EntryType::File ? "file" : "dir"),
+          canonPath.c_str());
+    entries.push_back(params.tree.makeEntry(ty, canonPath));
+    if(params.follow) {
+        entries.back()->dev = dev;
+        entries.back()->ino = ino;
+    }
+} // appendEntry()
+
+#ifdef __linux__
+
+/// Size of each thread's buffer for getdents64(2)
+static constexpr size_t DIRENT_BUFFER_SIZE = 256 * 1024;
+
+/// @name Offsets of the fields of a `struct linux_dirent64`
+/// @{
+static constexpr size_t DIRENT64_INO = 0;       ///< uint64_t d_ino
+static constexpr size_t DIRENT64_RECLEN = 16;   ///< unsigned short d_reclen
+static constexpr size_t DIRENT64_TYPE = 18;     ///< unsigned char d_type
+static constexpr size_t DIRENT64_NAME = 19;     ///< char d_name[]
+/// @}
+
+/// Read directory @p params.fd into @p entries in large batches with
+/// getdents64(2), rather than one entry at a time with readdir(3).
+/// @return 0, or an errno value
+static int
+readDirFd(const ReadDirParams& params,
+          std::vector< std::shared_ptr<Entry> >& entries)
+{
+    const int fd = params.fd;
+    static thread_local std::vector<char> buf(DIRENT_BUFFER_SIZE);
+
+    while(true) {
+        const long got = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+        if(got < 0) {
+            return errno;
+        } else if(got == 0) {
+            return 0;
+        }
+
+        for(long pos = 0; pos < got; ) {
+            const char *const record = buf.data() + pos;
+            unsigned short recordLength;
+            memcpy(&recordLength, record + DIRENT64_RECLEN,
+                   sizeof(recordLength));
+
+            uint64_t ino;
+            memcpy(&ino, record + DIRENT64_INO, sizeof(ino));
+
+            const char *const name = record + DIRENT64_NAME;
+            appendEntry(entries, params, name, strlen(name),
+                        (unsigned char)record[DIRENT64_TYPE], ino);
+            pos += recordLength;
+        }
+    }
+} // readDirFd()
+
+#else // !__linux__
+
+/// Read directory @p params.fd into @p entries with readdir(3)
+/// @return 0, or an errno value
+static int
+readDirFd(const ReadDirParams& params,
+          std::vector< std::shared_ptr<Entry> >& entries)
+{
+    // Use a new fd so closing dirp won't close params.fd
+    const int dirFd = dup(params.fd);
+    DIR *const dirp = (dirFd < 0) ? nullptr : fdopendir(dirFd);
     if(!dirp) {
+        const int err = errno;
+        if(dirFd >= 0) {
+            close(dirFd);
+        }
+        return err;
+    }
+
+    struct dirent *ent;
+    errno = 0;
+    while((ent = readdir(dirp)) != NULL) {
+        appendEntry(entries, params, ent->d_name, strlen(ent->d_name),
+                    ent->d_type, ent->d_ino);
+        errno = 0;
+    }
+
+    const int err = errno;
+    closedir(dirp);
+    return err;
+} // readDirFd()
+
+#endif // __linux__
+
+std::shared_ptr<Entry>
+DiskFileTree::rootDir(const smallcxx::glob::Path& rootPath)
+{
+    // A new traversal is starting
+    if(asyncIo_) {
+        asyncIo_->clearProbes();
+    }
+
+    auto retval = IFileTree::rootDir(rootPath);
+    struct stat st;
+    if(followSymlinks_ && stat(rootPath.c_str(), &st) == 0) {
+        retval->dev = st.st_dev;
+        retval->ino = st.st_ino;
+    }
+    return retval;
+}
+
+std::vector< std::shared_ptr<Entry> >
+DiskFileTree::readDir(const smallcxx::glob::Path& dirName)
+{
+    // If the directory is open, reading it needs its own fd so it has its
+    // own position.  Opening `.` is cheap.
+    const auto dirFd = dirFds_ ? dirFds_->open(dirName, true) : nullptr;
+    const int fd = dirFd ?
+                   openat(dirFd->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC) :
+                   open(dirName.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0) {
         throw system_error(errno, std::generic_category(),
                            STR_OF << "Could not open dir" << dirName);
     }
 
+    ReadDirParams params{*this, dirName + "/", fd, followSymlinks_, 0};
+    struct stat st;
+    if(followSymlinks_ && fstat(fd, &st) == 0) {
+        params.dev = st.st_dev;
+    }
+
     std::vector< std::shared_ptr<Entry> > retval;
+    const int err = readDirFd(params, retval);
+    close(fd);
+    if(err) {
+        throw system_error(err, std::generic_category(),
+                           STR_OF << "Could not read dir " << dirName);
+    }
 
-    struct dirent *ent;
-    while((ent = readdir(dirp.get())) != NULL) {
-        const auto canonPath = dirName + "/" + ent->d_name;
-
-        EntryType ty;
-        if(ent->d_type == DT_REG) {
-            ty = EntryType::File;
-
-        } else if(ent->d_type == DT_DIR) {
-            ty = EntryType::Dir;
-            if((strcmp(ent->d_name, ".") == 0) ||
-                    (strcmp(ent->d_name, "..") == 0)) {
-                continue;
-            }
+    return retval;
+}
 
-        } else {
-            LOG_F(TRACE, "Skipping [%s] of type %c",
-                  canonPath.c_str(), ent->d_type);
-            continue;
+std::shared_ptr<Entry>
+DiskFileTree::lookup(const smallcxx::glob::Path& path)
+{
+    smallcxx::glob::Path name;
+    const auto parent = dirFds_ ? dirFds_->openParent(path, name) : nullptr;
+
+    struct stat st;
+    const int flags = followSymlinks_ ? 0 : AT_SYMLINK_NOFOLLOW;
+    const int err = parent ?
+                    fstatat(parent->fd, name.c_str(), &st, flags) :
+                    fstatat(AT_FDCWD, path.c_str(), &st, flags);
+    if(err != 0) {
+        if(errno == ENOENT || errno == ENOTDIR) {
+            return nullptr;
+        }
+        throw system_error(errno, std::generic_category(),
+                           STR_OF << "Could not stat " << path);
+    }
+
+    // Same types as readDir()
+    EntryType ty;
+    if(S_ISREG(st.st_mode)) {
+        ty = EntryType::File;
+    } else if(S_ISDIR(st.st_mode)) {
+        ty = EntryType::Dir;
+    } else {
+        LOG_F(TRACE, "Skipping [%s] of mode %o", path.c_str(),
+              (unsigned)st.st_mode);
+        return nullptr;
+    }
+
+    auto retval = makeEntry(ty, path);
+    if(followSymlinks_) {
+        retval->dev = st.st_dev;
+        retval->ino = st.st_ino;
+    }
+    return retval;
+}
+
+/// Read all of @p fd, which is open on @p path, and close it.  Reads
+/// straight into the result, sized from fstat(2), so a regular file takes
+/// one read(2) and no copies.
+static Bytes
+readAllAndClose(int fd, const smallcxx::glob::Path& path)
+{
+    struct stat st;
+    size_t size = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) ?
+                  st.st_size : 0;
+
+    // One byte extra so we see EOF without growing
+    Bytes retval(size + 1, '\0');
+    size_t used = 0;
+    ssize_t got;
+    while((got = read(fd, &retval[used], retval.size() - used)) > 0) {
+        used += got;
+        if(used == retval.size()) {     // It grew, or isn't a regular file
+            retval.resize(retval.size() * 2 + 4096);
         }
+    }
 
-        LOG_F(TRACE, "Found %s [%s]",
-              (ty == EntryType::File ? "file" : "dir"),
-              canonPath.c_str());
-        retval.push_back(std::make_shared<Entry>(ty, canonPath));
-    } // foreach dir entry
+    const int readErrno = errno;
+    close(fd);
+    if(got < 0) {
+        throw system_error(readErrno, std::generic_category(),
+                           STR_OF << "Could not read " << path);
+    }
 
+    retval.resize(used);
     return retval;
 }
 
-/// @todo make this more efficient (fewer copies)
 Bytes
 DiskFileTree::readFile(const smallcxx::glob::Path& path)
 {
-    ifstream in(path);
-    ostringstream os;
-    os << in.rdbuf();
-    return os.str();
+    smallcxx::glob::Path name;
+    const auto parent = dirFds_ ? dirFds_->openParent(path, name) : nullptr;
+    const int fd = parent ?
+                   openat(parent->fd, name.c_str(), O_RDONLY | O_CLOEXEC) :
+                   open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        throw system_error(errno, std::generic_category(),
+                           STR_OF << "Could not open " << path);
+    }
+
+    return readAllAndClose(fd, path);
+}
+
+bool
+DiskFileTree::stamp(const smallcxx::glob::Path& path, FileStamp& stamp)
+{
+    stamp = FileStamp();
+
+    // prefetch() may already have checked.  If the file exists, leave the
+    // result for canonicalize(), which Traverser calls next.
+    int probe;
+    if(asyncIo_ && asyncIo_->takeProbe(path, probe, true) &&
+            probe == -ENOENT) {
+        return true;
+    }
+
+    smallcxx::glob::Path name;
+    const auto parent = dirFds_ ? dirFds_->openParent(path, name) : nullptr;
+    struct stat st;
+    const int ret = parent ? fstatat(parent->fd, name.c_str(), &st, 0) :
+                    stat(path.c_str(), &st);
+    if(ret != 0) {
+        return (errno == ENOENT || errno == ENOTDIR);
+    }
+
+    stamp.exists = true;
+    stamp.dev = st.st_dev;
+    stamp.ino = st.st_ino;
+#ifdef __APPLE__
+    stamp.mtimeNs = st.st_mtimespec.tv_sec * UINT64_C(1000000000) +
+                    st.st_mtimespec.tv_nsec;
+#else
+    stamp.mtimeNs = st.st_mtim.tv_sec * UINT64_C(1000000000) +
+                    st.st_mtim.tv_nsec;
+#endif
+    stamp.size = st.st_size;
+    return true;
 }
 
 /// @todo document symlink behaviour.  realpath(3) removes them,
@@ -463,6 +1775,31 @@ DiskFileTree::readFile(const smallcxx::glob::Path& path)
 smallcxx::glob::Path
 DiskFileTree::canonicalize(const smallcxx::glob::Path& path) const
 {
+    // prefetch() may already have checked
+    int probe;
+    if(asyncIo_ && asyncIo_->takeProbe(path, probe)) {
+        if(probe == -ENOENT) {
+            return "";
+        } else if(probe >= 0 && !S_ISLNK(probe)) {
+            return path;
+        }
+    }
+
+    // A real file or directory in an open directory, which is canonical,
+    // needs no resolving
+    smallcxx::glob::Path name;
+    const auto dir = dirFds_ ? dirFds_->openParent(path, name) : nullptr;
+    if(dir) {
+        struct stat st;
+        if(fstatat(dir->fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            if(errno == ENOENT) {
+                return "";
+            }
+        } else if(!S_ISLNK(st.st_mode)) {
+            return path;
+        }
+    }
+
     unique_ptr<char, void(*)(char *)> resolved(
         realpath(path.c_str(), nullptr),
     [](char *p) {
@@ -9,21 +9,25 @@
 
 #define SMALLCXX_LOG_DOMAIN "glob"
 
-#define PCRE2_CODE_UNIT_WIDTH 8
-#include <pcre2.h>
-
+#include <algorithm>
 #include <ctype.h>
 #include <istream>
+#include <limits>
 #include <list>
+#include <mutex>
+#include <new>
 #include <sstream>
 #include <stdexcept>
 #include <string.h>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "smallcxx/globstari.hpp"
 #include "smallcxx/logging.hpp"
 #include "smallcxx/string.hpp"
 
+#include "globstari-impl.hpp"
+
 using namespace std;
 
 namespace smallcxx
@@ -38,25 +42,6 @@ namespace glob
 /// @details from editorconfig-core-c/src/lib/ec_glob.c
 extern const string ec_special_chars = "?[]\\*-{},";
 
-// --- PCRE2-related types -----------------------------------------------
-
-using MatchDataPtr =
-    std::unique_ptr<pcre2_match_data, void(*)(pcre2_match_data *)>;
-
-/// @todo Make this a std::shared_ptr?
-using RePtr = std::unique_ptr<pcre2_code, void(*)(pcre2_code *)>;
-
-// --- Misc. types -------------------------------------------------------
-
-/// Element of a numerical range
-using Int = intmax_t;
-
-/// Numerical range
-using IntPair = std::pair<Int, Int>;
-
-/// List of numerical ranges
-using RangePairs = std::vector<IntPair>;
-
 // --- Criteria class (regex + range(s)) ---------------------------------
 
 /// Regex and ranges for >=1 globs.
@@ -65,22 +50,62 @@ class Criteria
     RePtr compiled_;
     RangePairs ranges_;  ///< may be empty
 
-public:
+    /// Number of ovector pairs a match needs (capture groups + 1)
+    uint32_t ovecCount_ = 1;
 
-    Criteria(): compiled_(nullptr, pcre2_code_free) {};
-    Criteria(const Criteria& other)
-        : compiled_(nullptr, pcre2_code_free)
-        , ranges_(other.ranges_)
+    /// Whether compiled_ has been successfully JIT-compiled
+    bool jitted_ = false;
+
+    /// Take ownership of @p re and prepare to match with it
+    void
+    adopt(pcre2_code *re, bool wantJit)
     {
-        if(other.compiled_) {
-            compiled_.reset(pcre2_code_copy_with_tables(other.compiled_.get()));
+        compiled_.reset(re);
+
+        uint32_t captureCount = 0;
+        pcre2_pattern_info(compiled_.get(), PCRE2_INFO_CAPTURECOUNT,
+                           &captureCount);
+        ovecCount_ = captureCount + 1;
+
+        jitCompile(wantJit);
+    }
+
+    /// JIT-compile compiled_ if @p wantJit.  Sets jitted_.
+    void
+    jitCompile(bool wantJit)
+    {
+        jitted_ = false;
+        if(wantJit && jitAvailable()) {
+            const int rc = pcre2_jit_compile(compiled_.get(), PCRE2_JIT_COMPLETE);
+            jitted_ = (rc == 0);
+            if(!jitted_) {
+                LOG_F(DEBUG, "JIT compilation failed (%d); using interpreter",
+                      rc);
+            }
         }
     }
+
+public:
+
+    Criteria(): compiled_(nullptr, pcre2_code_free) {};
+
+    /// Not copyable.  Pcre2Globs instances are shared instead.
+    Criteria(const Criteria&) = delete;
+    Criteria& operator=(const Criteria&) = delete;
     ~Criteria() = default;
 
-    Criteria(const std::string& reSrc): Criteria(reSrc, {}) {}
+    Criteria(const std::string& reSrc, bool wantJit)
+        : Criteria(reSrc, {}, wantJit) {}
 
-    Criteria(const std::string& reSrc, const RangePairs& ranges)
+    /// Take ownership of @p re, which has already been compiled.
+    Criteria(pcre2_code *re, const RangePairs& ranges, bool wantJit)
+        : compiled_(nullptr, pcre2_code_free)
+        , ranges_(ranges)
+    {
+        adopt(re, wantJit);
+    }
+
+    Criteria(const std::string& reSrc, const RangePairs& ranges, bool wantJit)
         : compiled_(nullptr, pcre2_code_free)
         , ranges_(ranges)
     {
@@ -99,28 +124,71 @@ public:
                                 << " at offset " << erroffset);
         }
 
-        compiled_.reset(re);
-        re = nullptr;
-    } // Criteria(string, RangePairs)
+        adopt(re, wantJit);
+    } // Criteria(string, RangePairs, bool)
+
+    /// Append compiled_ and ranges_ to @p out.  See Pcre2Globs::load().
+    void serialize(BlobWriter& out) const;
 
     /// Does @p str match compiled_?
-    bool accepts(const smallcxx::glob::Path& str) const;
+    /// @param[in]  str - the string to test
+    /// @param[in]  context - scratch space for the match
+    bool accepts(PathView str, MatchContextImpl& context) const;
+
+    /// Could some string longer than @p str, starting with @p str,
+    /// match compiled_?  Ignores numeric ranges, so may return true
+    /// when the answer is no.
+    bool mayAcceptPrefix(PathView str, MatchContextImpl& context) const;
 
 }; // class Criteria
 
+/// Parse [@p begin, @p end), an optional sign followed by decimal digits,
+/// without needing a NUL terminator.  Like strtoll(), saturates at the
+/// limits of `long long` rather than overflowing.
+static Int
+parseNumeral(const char *begin, const char *end)
+{
+    bool negative = false;
+    if(begin < end && (*begin == '+' || *begin == '-')) {
+        negative = (*begin == '-');
+        ++begin;
+    }
+
+    // Accumulate as a negative number, since its range is larger
+    const long long lowest = numeric_limits<long long>::min();
+    long long value = 0;
+    for(; begin < end; ++begin) {
+        const int digit = *begin - '0';
+        if(value < (lowest + digit) / 10) {
+            value = lowest;     // saturated
+            break;
+        }
+        value = value * 10 - digit;
+    }
+
+    if(negative) {
+        return value;
+    }
+    return (value == lowest) ? numeric_limits<long long>::max() : -value;
+} // parseNumeral()
+
 /// @details Some code from editorconfig-core-c/src/lib/ec_glob.c:ec_glob()
 bool
-Criteria::accepts(const smallcxx::glob::Path& str) const
+Criteria::accepts(PathView str, MatchContextImpl& context) const
 {
-    MatchDataPtr matches(
-        pcre2_match_data_create_from_pattern(compiled_.get(), nullptr),
-        pcre2_match_data_free);
+    pcre2_match_data *matches = context.matchData(ovecCount_);
 
     int rc;
     size_t *pcre_result;
 
-    rc = pcre2_match(compiled_.get(), (PCRE2_SPTR8)str.c_str(), str.length(),
-                     0, 0, matches.get(), nullptr);
+    if(jitted_) {
+        rc = pcre2_jit_match(compiled_.get(), (PCRE2_SPTR8)str.data(),
+                             str.size(), 0, 0, matches,
+                             context.jitMatchContext());
+    } else {
+        rc = pcre2_match(compiled_.get(), (PCRE2_SPTR8)str.data(),
+                         str.size(), 0, 0, matches, nullptr);
+    }
 
     if (rc < 0) {   /* failed to match */
         if (rc == PCRE2_ERROR_NOMATCH) {
@@ -131,13 +199,13 @@ Criteria::accepts(const smallcxx::glob::Path& str) const
         }
     }
 
-    pcre_result = pcre2_get_ovector_pointer(matches.get());
+    pcre_result = pcre2_get_ovector_pointer(matches);
 
     // Did anything match?
     if((pcre_result[1] == 0 ) ||
             (pcre_result[0] == PCRE2_UNSET && pcre_result[1] == PCRE2_UNSET)) {
-        LOG_F(FIXME, "Zero-length successful match --- probably a bug!  >>%s<<",
-              str.c_str());
+        LOG_F(FIXME, "Zero-length successful match --- probably a bug!  >>%.*s<<",
+              (int)str.size(), str.data());
         return false;
     }
 
@@ -168,8 +236,8 @@ Criteria::accepts(const smallcxx::glob::Path& str) const
                                 << " index " << i);
         }
 
-        string num_string(substring_start, substring_length);
-        Int num = strtoll(num_string.c_str(), nullptr, 10);
+        const Int num = parseNumeral(substring_start,
+                                     substring_start + substring_length);
 
         if (num < rangeit->first || num > rangeit->second) { /* not matched */
             return false;   // it has to match all of them
@@ -179,13 +247,81 @@ Criteria::accepts(const smallcxx::glob::Path& str) const
     return true;
 }
 
+bool
+Criteria::mayAcceptPrefix(PathView str, MatchContextImpl& context) const
+{
+    // pcre2_match() uses the interpreter here unless the JIT code was
+    // compiled for partial matching, which it isn't.
+    const int rc = pcre2_match(compiled_.get(), (PCRE2_SPTR8)str.data(),
+                               str.size(), 0, PCRE2_PARTIAL_HARD,
+                               context.matchData(ovecCount_), nullptr);
+
+    if(rc == PCRE2_ERROR_NOMATCH) {
+        return false;
+    }
+
+    if(rc < 0 && rc != PCRE2_ERROR_PARTIAL) {
+        throw runtime_error(STR_OF
+                            << "Failure while partially matching RE: code "
+                            << rc);
+    }
+
+    // PCRE2_ERROR_PARTIAL: @p str is the start of a possible match.
+    // A complete match doesn't say whether anything longer would
+    // match, so assume it could.
+    return true;
+} // Criteria::mayAcceptPrefix()
+
+void
+Criteria::serialize(BlobWriter& out) const
+{
+    out.u64(ranges_.size());
+    for(const auto& range : ranges_) {
+        out.u64((uint64_t)range.first);
+        out.u64((uint64_t)range.second);
+    }
+
+    const pcre2_code *codes[] = { compiled_.get() };
+    uint8_t *bytes = nullptr;
+    PCRE2_SIZE size = 0;
+    const int32_t rc = pcre2_serialize_encode(codes, 1, &bytes, &size,
+                       nullptr);
+    if(rc < 0) {
+        throw runtime_error(STR_OF << "Could not serialize regex: error "
+                            << rc);
+    }
+
+    out.str(PathView((const char *)bytes, size));
+    pcre2_serialize_free(bytes);
+} // Criteria::serialize()
+
 // --- Glob -> Regex conversion ------------------------------------------ {{{1
 
-/// Append regex source for glob @p glob to @p src, and append to @p ranges
-/// if @p glob includes numerical range(s).
+/// The regex used to search for the {num1..num2} case.  Compiled once.
+/// @throws std::runtime_error if the regex cannot be compiled.
+static const RePtr&
+reNum()
+{
+    static const RePtr compiled = []() {
+        int error_code;
+        size_t erroffset;
+        pcre2_code *re = pcre2_compile((PCRE2_SPTR8)
+                                       "^\\{[\\+\\-]?\\d+\\.\\.[\\+\\-]?\\d+\\}$",
+                                       PCRE2_ZERO_TERMINATED, 0,
+                                       &error_code, &erroffset, nullptr);
+        if (!re) {      /* failed to compile */
+            throw std::runtime_error(STR_OF << "Could not create reNum: "
+                                     << error_code << " at offset "
+                                     << erroffset);
+        }
+        return RePtr(re, pcre2_code_free);
+    }();
+    return compiled;
+}
+
 /// @details Adapted from editorconfig-core-c/src/lib/ec_glob.c:ec_glob(),
 /// the first half of the function.
-static void
+void
 globToRegexSrc(const smallcxx::glob::Path& glob, string& src,
                RangePairs& ranges)
 {
@@ -196,9 +332,6 @@ globToRegexSrc(const smallcxx::glob::Path& glob, string& src,
     const char *c;
     int brace_level = 0;
     bool is_in_bracket = false;
-    int error_code;
-    size_t erroffset;
-    pcre2_code *reNumRaw;
     int rc;
     bool are_braces_paired = true;
 
@@ -230,17 +363,7 @@ globToRegexSrc(const smallcxx::glob::Path& glob, string& src,
     }
 
     /* used to search for {num1..num2} case */
-    // TODO make this a singleton
-    reNumRaw = pcre2_compile((PCRE2_SPTR8)
-                             "^\\{[\\+\\-]?\\d+\\.\\.[\\+\\-]?\\d+\\}$",
-                             PCRE2_ZERO_TERMINATED, 0,
-                             &error_code, &erroffset, nullptr);
-    if (!reNumRaw) {      /* failed to compile */
-        throw std::runtime_error(STR_OF << "Could not create reNum: "
-                                 << error_code << " at offset " << erroffset);
-    }
-    RePtr pReNum(reNumRaw, pcre2_code_free);
-    reNumRaw = nullptr;
+    const RePtr& pReNum = reNum();
 
     for (c = &glob[0]; *c; ++ c) {
 
@@ -460,62 +583,47 @@ globToRegexSrc(const smallcxx::glob::Path& glob, string& src,
 } // globToRegexSrc
 
 // }}}1
-// --- GlobSetImpl -------------------------------------------------------
+// --- Pcre2Globs --------------------------------------------------------
 
-class GlobSetImpl
+/// Globs compiled for MatchEngine::Pcre2
+class Pcre2Globs: public CompiledGlobs
 {
-    PathSet globs_;             ///< individual globs (input)
-
     /// What we match
     std::list<Criteria> criteria_;
 
-    bool finalized_ = false;
+    Pcre2Globs() = default;
 
 public:
-
-    /// Add a single glob to the set.
-    void addGlob(const smallcxx::glob::Path& glob);
-
-    /// Implementation of GlobSet::Finalize().
-    /// @details Fill in criteria_ from globs_.
+    /// Compile @p globs.
     /// @throws std::runtime_error if any regex cannot be constructed.
-    /// @note Calling finalize() without first adding any globs is not
-    ///     an error!  It will give you a GlobSet that matches nothing.
-    void finalize();
+    Pcre2Globs(const PathSet& globs, bool wantJit);
 
-    /// Whether finalize() has been called
-    bool
-    finalized() const
-    {
-        return finalized_;
-    }
+    /// Load an instance saved by serialize().
+    /// @return the instance, or null if this PCRE2 can't read the data
+    /// @throws std::runtime_error if the data is corrupt.  Only the
+    ///     framing and the headers of the regexes are checked.
+    static std::unique_ptr<CompiledGlobs> load(BlobReader& in, bool wantJit);
 
-    /// Implementation of GlobSet::contains().
-    bool contains(const smallcxx::glob::Path& path) const;
+    void serialize(BlobWriter& out) const override;
 
-}; // class GlobSetImpl
+    bool contains(PathView path, MatchContextImpl& context) const override;
 
-void
-GlobSetImpl::addGlob(const smallcxx::glob::Path& glob)
-{
-    if(glob.empty()) {
-        throw runtime_error("Cannot add an empty glob");
-    }
-    if(finalized()) {
-        throw runtime_error("Already finalized --- cannot add more globs");
-    }
+    bool mayMatchPrefix(PathView prefix,
+                        MatchContextImpl& context) const override;
 
-    globs_.insert(glob);
-} // GlobSetImpl::addGlob()
+    void containsMany(const PathView *paths, size_t count,
+                      std::vector<bool>& results,
+                      MatchContextImpl& context) const override;
 
-void
-GlobSetImpl::finalize()
+}; // class Pcre2Globs
+
+Pcre2Globs::Pcre2Globs(const PathSet& globs, bool wantJit)
 {
     // regex for all the globs that don't have numerical ranges
     string nonRangeSrc("^(?:");
     bool hasNonRange = false;
 
-    for(const auto& glob : globs_) {
+    for(const auto& glob : globs) {
         string reSrc;
         RangePairs ranges;
 
@@ -544,7 +652,7 @@ GlobSetImpl::finalize()
             // The match never gets to $2, because digits are caught by $1.
 
             reSrc = "^(?>" + reSrc + ")$";
-            criteria_.emplace_back(reSrc, ranges);
+            criteria_.emplace_back(reSrc, ranges, wantJit);
         }
 
     } // foreach glob
@@ -557,54 +665,719 @@ GlobSetImpl::finalize()
         // in a single check.  Also, my experience is that globs without
         // numeric ranges will be much more common than globs with
         // numeric ranges.
-        criteria_.emplace_front(nonRangeSrc, RangePairs{});
+        criteria_.emplace_front(nonRangeSrc, RangePairs{}, wantJit);
     }
-
-    finalized_ = true;
-} // GlobSetImpl::finalize()
+} // Pcre2Globs::Pcre2Globs()
 
 /// @details Adapted from editorconfig-core-c/src/lib/ec_glob.c:ec_glob(),
 /// the second half of the function.
 bool
-GlobSetImpl::contains(const smallcxx::glob::Path& path) const
+Pcre2Globs::contains(PathView path, MatchContextImpl& context) const
 {
-    if(!finalized()) {
-        throw logic_error("Glob set was not finalized");
+    for(const auto& criteria : criteria_) {
+        if(criteria.accepts(path, context)) {
+            return true;
+        }
+    }
+
+    return false;
+} // Pcre2Globs::contains()
+
+void
+Pcre2Globs::containsMany(const PathView *paths, size_t count,
+                         std::vector<bool>& results,
+                         MatchContextImpl& context) const
+{
+    // Run each regex over all the paths before moving on to the next regex,
+    // so each regex's code and data stay in cache.
+    for(const auto& criteria : criteria_) {
+        for(size_t i = 0; i < count; ++i) {
+            if(!results[i] && !paths[i].empty() &&
+                    criteria.accepts(paths[i], context)) {
+                results[i] = true;
+            }
+        }
     }
+} // Pcre2Globs::containsMany()
 
+bool
+Pcre2Globs::mayMatchPrefix(PathView prefix, MatchContextImpl& context) const
+{
     for(const auto& criteria : criteria_) {
-        if(criteria.accepts(path)) {
+        if(criteria.mayAcceptPrefix(prefix, context)) {
             return true;
         }
     }
 
     return false;
+} // Pcre2Globs::mayMatchPrefix()
+
+void
+Pcre2Globs::serialize(BlobWriter& out) const
+{
+    out.u64(criteria_.size());
+    for(const auto& criteria : criteria_) {
+        criteria.serialize(out);
+    }
+}
+
+std::unique_ptr<CompiledGlobs>
+Pcre2Globs::load(BlobReader& in, bool wantJit)
+{
+    std::unique_ptr<Pcre2Globs> retval(new Pcre2Globs());
+
+    for(auto n = in.count(8 + 8); n > 0; --n) {
+        RangePairs ranges(in.count(16));
+        for(auto& range : ranges) {
+            range.first = (Int)in.u64();
+            range.second = (Int)in.u64();
+        }
+
+        // pcre2_serialize_decode() needs aligned data
+        const auto bytes = in.str();
+        std::vector<uint64_t> aligned((bytes.size() + 7) / 8);
+        memcpy(aligned.data(), bytes.data(), bytes.size());
+
+        // pcre2_serialize_decode() trusts the sizes in the data, and the
+        // only part PCRE2 lets us check without decoding is the header:
+        // magic, version, configuration, and number of regexes.
+        if(bytes.size() < 4 * sizeof(uint32_t)) {
+            throw runtime_error("Truncated regex in serialized GlobSet");
+        }
+        const int32_t count = pcre2_serialize_get_number_of_codes(
+                                  (const uint8_t *)aligned.data());
+        if(count == PCRE2_ERROR_BADMAGIC || count == 0 || count > 1) {
+            throw runtime_error("Corrupt regex in serialized GlobSet");
+        }
+
+        pcre2_code *re = nullptr;
+        const int32_t rc = (count < 0) ? count :
+                           pcre2_serialize_decode(&re, 1,
+                                   (const uint8_t *)aligned.data(), nullptr);
+        if(rc < 0) {
+            LOG_F(DEBUG, "Could not load serialized regex: error %d", rc);
+            return nullptr;
+        }
+
+        retval->criteria_.emplace_back(re, ranges, wantJit);
+    }
+
+    return std::move(retval);
+} // Pcre2Globs::load()
+
+// --- Common prefixes ---------------------------------------------------
+
+/// Length of the glob text for the literal character at @p pos in @p glob,
+/// or 0 if @p pos does not start a literal character.
+static size_t
+literalUnitLength(const smallcxx::glob::Path& glob, size_t pos)
+{
+    if(pos >= glob.size()) {
+        return 0;
+    }
+
+    const char c = glob[pos];
+    if(c == '\\') {
+        // `\d` and friends are regex escapes; a trailing `\` is not worth
+        // the special case.
+        return (pos + 1 < glob.size() &&
+                !isalnum((unsigned char)glob[pos + 1])) ? 2 : 0;
+    }
+
+    return strchr("*?[]{},", c) ? 0 : 1;    // `,` only outside braces, but
+                                            // that's not worth checking
+}
+
+/// Split off the literal text all of @p globs start with.
+/// @param[in]  globs - the globs.  Must not be empty.
+/// @param[out] prefix - the decoded literal text, which every path matching
+///     any of @p globs starts with
+/// @return The length of the glob text corresponding to @p prefix.  The
+///     rest of each glob, after that many characters, matches exactly the
+///     paths that the whole glob matches, minus @p prefix.
+/// @details The rest of each glob must be non-empty and start with a
+///     literal character or with `**/`, so that it means the same on its own
+///     as it did after the prefix.  The exception is that `/**/` must not be
+///     split, since it matches a single `/`.
+static size_t
+splitCommonPrefix(const PathSet& globs, smallcxx::glob::Path& prefix)
+{
+    const auto& first = *globs.begin();
+
+    // Length of the text all the globs share
+    size_t shared = first.size();
+    for(const auto& glob : globs) {
+        size_t i = 0;
+        while(i < shared && i < glob.size() && glob[i] == first[i]) {
+            ++i;
+        }
+        shared = i;
+    }
+
+    // Literal characters of first within the shared text.  ends[k] is the
+    // length of the text holding the first k characters.
+    std::vector<size_t> ends{0};
+    for(size_t len; (len = literalUnitLength(first, ends.back())) != 0 &&
+            ends.back() + len <= shared; ) {
+        ends.push_back(ends.back() + len);
+    }
+
+    // Back off until the rest of each glob stands on its own
+    size_t k = ends.size() - 1;
+    for(; k > 0; --k) {
+        const size_t split = ends[k];
+        const bool endsInSlash = (first[split - 1] == '/' &&
+                                  split - ends[k - 1] == 1);
+        bool ok = true;
+        for(const auto& glob : globs) {
+            if(literalUnitLength(glob, split) == 0 &&
+                    (endsInSlash || glob.compare(split, 3, "**/") != 0)) {
+                ok = false;
+                break;
+            }
+        }
+        if(ok) {
+            break;
+        }
+    }
+
+    prefix.clear();
+    for(size_t i = 0; i < k; ++i) {
+        prefix += first[ends[i + 1] - 1];   // the character, less any `\`
+    }
+
+    return ends[k];
+} // splitCommonPrefix()
+
+// --- Compile cache -----------------------------------------------------
+
+/// Compiled globs, keyed by options and globs.  Lets GlobSets with the same
+/// globs share compiled code.  Entries expire when no GlobSet uses them.
+class CompileCache
+{
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::weak_ptr<const CompiledGlobs>> map_;
+
+    /// Size of map_ after the last purge of expired entries
+    size_t sizeAfterPurge_ = 0;
+
+public:
+    /// The cache for this process
+    static CompileCache&
+    instance()
+    {
+        static CompileCache cache;
+        return cache;
+    }
+
+    /// Get the cached entry for @p key, or null if none
+    std::shared_ptr<const CompiledGlobs>
+    find(const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto it = map_.find(key);
+        return (it == map_.end()) ? nullptr : it->second.lock();
+    }
+
+    /// Cache @p compiled under @p key.  If another thread got there first,
+    /// returns its entry instead.
+    std::shared_ptr<const CompiledGlobs>
+    insert(const std::string& key,
+           const std::shared_ptr<const CompiledGlobs>& compiled)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto& entry = map_[key];
+        auto existing = entry.lock();
+        if(existing) {
+            return existing;
+        }
+        entry = compiled;
+
+        if(map_.size() > 2 * sizeAfterPurge_ + 16) {
+            for(auto it = map_.begin(); it != map_.end(); ) {
+                if(it->second.expired()) {
+                    it = map_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            sizeAfterPurge_ = map_.size();
+        }
+
+        return compiled;
+    }
+}; // class CompileCache
+
+// --- GlobSetImpl -------------------------------------------------------
+
+class GlobSetImpl
+{
+    GlobSetOptions options_;    ///< how to compile and match
+
+    PathSet globs_;             ///< individual globs (input)
+
+    /// Literal text every matching path starts with.  compiled_ matches
+    /// the rest of the path.
+    smallcxx::glob::Path prefix_;
+
+    /// What we match.  Non-null once finalized.  May be shared with other
+    /// GlobSetImpls.
+    std::shared_ptr<const CompiledGlobs> compiled_;
+
+    /// If @p path starts with prefix_, the rest of @p path; otherwise, empty.
+    PathView
+    stripPrefix(PathView path) const
+    {
+        const size_t len = prefix_.size();
+        if(path.size() <= len || memcmp(path.data(), prefix_.data(), len)) {
+            return PathView();
+        }
+        return PathView(path.data() + len, path.size() - len);
+    }
+
+    /// Set prefix_ from globs_, and fill @p rests with the rest of each glob.
+    /// @return the key for @p rests in the CompileCache
+    std::string splitPrefix(PathSet& rests);
+
+    /// Compile @p globs using options_
+    std::unique_ptr<CompiledGlobs> compile(const PathSet& globs) const;
+
+    /// Load globs saved by CompiledGlobs::serialize() using options_.
+    /// @return the globs, or null if the data can't be used
+    std::unique_ptr<CompiledGlobs> loadCompiled(BlobReader& in) const;
+
+public:
+
+    explicit GlobSetImpl(const GlobSetOptions& options): options_(options) {}
+
+    GlobSetImpl(const GlobSetImpl& other) = default;
+
+    /// Add a single glob to the set.
+    void addGlob(const smallcxx::glob::Path& glob);
+
+    /// The globs added so far
+    const PathSet&
+    globs() const
+    {
+        return globs_;
+    }
+
+    /// Implementation of GlobSet::Finalize().
+    /// @details Fill in compiled_ from globs_.
+    /// @throws std::runtime_error if any glob cannot be compiled.
+    /// @note Calling finalize() without first adding any globs is not
+    ///     an error!  It will give you a GlobSet that matches nothing.
+    void finalize();
+
+    /// Implementation of GlobSet::serialize()
+    void serialize(BlobWriter& out) const;
+
+    /// Implementation of GlobSet::deserialize().  Replaces the contents
+    /// of this instance.
+    void load(BlobReader& in);
+
+    /// Whether finalize() has been called
+    bool
+    finalized() const
+    {
+        return !!compiled_;
+    }
+
+    /// Implementation of GlobSet::contains().
+    bool contains(PathView path, MatchContext& context) const;
+
+    /// Implementation of GlobSet::containsMany().
+    void containsMany(const PathView *paths, size_t count,
+                      std::vector<bool>& results, MatchContext& context) const;
+
+    /// Implementation of GlobSet::canMatchUnder().
+    bool canMatchUnder(PathView dir, MatchContext& context) const;
+
+}; // class GlobSetImpl
+
+void
+GlobSetImpl::addGlob(const smallcxx::glob::Path& glob)
+{
+    if(glob.empty()) {
+        throw runtime_error("Cannot add an empty glob");
+    }
+    if(finalized()) {
+        throw runtime_error("Already finalized --- cannot add more globs");
+    }
+
+    globs_.insert(glob);
+} // GlobSetImpl::addGlob()
+
+std::string
+GlobSetImpl::splitPrefix(PathSet& rests)
+{
+    // Compile the globs less their common prefix, so identical ignore files
+    // in different directories share compiled code.
+    rests.clear();
+    prefix_.clear();
+    if(!globs_.empty()) {
+        const size_t split = splitCommonPrefix(globs_, prefix_);
+        for(const auto& glob : globs_) {
+            rests.insert(glob.substr(split));
+        }
+    }
+
+    // PathSet is unordered, so sort to make the key canonical
+    std::vector<smallcxx::glob::Path> sorted(rests.begin(), rests.end());
+    std::sort(sorted.begin(), sorted.end());
+
+    ostringstream key;
+    key << (int)options_.engine << (options_.jit ? 'j' : '-')
+        << (options_.literalIndex ? 'l' : '-');
+    for(const auto& rest : sorted) {
+        key << ' ' << rest.size() << ':' << rest;
+    }
+    return key.str();
+} // GlobSetImpl::splitPrefix()
+
+std::unique_ptr<CompiledGlobs>
+GlobSetImpl::compile(const PathSet& globs) const
+{
+    const auto compileWithEngine = [this](const PathSet& globs)
+    -> std::unique_ptr<CompiledGlobs> {
+        switch(options_.engine)
+        {
+        case MatchEngine::Pcre2:
+            return std::unique_ptr<CompiledGlobs>(
+                new Pcre2Globs(globs, options_.jit));
+
+        case MatchEngine::Automaton:
+            return compileAutomaton(globs);
+
+        default:
+            throw logic_error(STR_OF << "Unknown match engine "
+                              << (int)options_.engine);
+        }
+    };
+
+    if(options_.literalIndex) {
+        return compileWithLiteralIndex(globs, compileWithEngine);
+    } else {
+        return compileWithEngine(globs);
+    }
+} // GlobSetImpl::compile()
+
+std::unique_ptr<CompiledGlobs>
+GlobSetImpl::loadCompiled(BlobReader& in) const
+{
+    const auto loadWithEngine = [this](BlobReader& in)
+    -> std::unique_ptr<CompiledGlobs> {
+        switch(options_.engine)
+        {
+        case MatchEngine::Pcre2:
+            return Pcre2Globs::load(in, options_.jit);
+
+        case MatchEngine::Automaton:
+            return loadAutomaton(in);
+
+        default:
+            throw logic_error(STR_OF << "Unknown match engine "
+                              << (int)options_.engine);
+        }
+    };
+
+    if(options_.literalIndex) {
+        return loadWithLiteralIndex(in, loadWithEngine);
+    } else {
+        return loadWithEngine(in);
+    }
+} // GlobSetImpl::loadCompiled()
+
+void
+GlobSetImpl::finalize()
+{
+    PathSet rests;
+    const auto key = splitPrefix(rests);
+
+    auto& cache = CompileCache::instance();
+    compiled_ = cache.find(key);
+    if(compiled_) {
+        LOG_F(LOG, "Reusing compiled globs for prefix >>%s<<",
+              prefix_.c_str());
+        return;
+    }
+
+    compiled_ = cache.insert(key, compile(rests));
+} // GlobSetImpl::finalize()
+
+// --- GlobSetImpl: serialization ----------------------------------------
+
+/// Identifies a serialized GlobSet
+static const char GLOBSET_MAGIC[8] = {'S', 'C', 'X', 'G', 'L', 'O', 'B', 'S'};
+
+/// Version of the serialized form of compiled globs.  Bump this whenever
+/// any CompiledGlobs::serialize() or splitCommonPrefix() changes.
+static constexpr int GLOBSET_FORMAT = 2;
+
+/// Describes the compiled globs this build produces.  Serialized GlobSets
+/// with a different fingerprint are recompiled when loaded.
+static const string&
+fingerprint()
+{
+    static const string value = []() -> string {
+        char pcreVersion[64] = "";
+        pcre2_config(PCRE2_CONFIG_VERSION, pcreVersion);
+        return STR_OF << "globset " << GLOBSET_FORMAT << "; pcre2 "
+               << pcreVersion;
+    }();
+    return value;
+}
+
+/// @details The layout is:
+/// - GLOBSET_MAGIC
+/// - the options
+/// - the globs
+/// - fingerprint()
+/// - the compiled globs, as written by compiled_->serialize().
+///
+/// Everything before the fingerprint must stay readable by future
+/// versions, since it is what they recompile from.
+void
+GlobSetImpl::serialize(BlobWriter& out) const
+{
+    if(!finalized()) {
+        throw logic_error("Glob set was not finalized");
+    }
+
+    out.bytes(GLOBSET_MAGIC, sizeof(GLOBSET_MAGIC));
+    out.u8((uint8_t)options_.engine);
+    out.u8(options_.jit);
+    out.u8(options_.literalIndex);
+
+    out.u64(globs_.size());
+    for(const auto& glob : globs_) {
+        out.str(glob);
+    }
+
+    out.str(fingerprint());
+
+    string compiled;
+    BlobWriter compiledOut(compiled);
+    compiled_->serialize(compiledOut);
+    out.str(compiled);
+} // GlobSetImpl::serialize()
+
+void
+GlobSetImpl::load(BlobReader& in)
+{
+    if(in.bytes(sizeof(GLOBSET_MAGIC)) !=
+            PathView(GLOBSET_MAGIC, sizeof(GLOBSET_MAGIC))) {
+        throw runtime_error("Not a serialized GlobSet");
+    }
+
+    const auto engine = in.u8();
+    if(engine > (uint8_t)MatchEngine::Automaton) {
+        throw runtime_error(STR_OF << "Unknown match engine " << (int)engine
+                            << " in serialized GlobSet");
+    }
+    options_.engine = (MatchEngine)engine;
+    options_.jit = in.u8();
+    options_.literalIndex = in.u8();
+
+    globs_.clear();
+    for(auto n = in.count(8 + 1); n > 0; --n) {
+        const auto glob = in.str();
+        if(glob.empty()) {
+            throw runtime_error("Empty glob in serialized GlobSet");
+        }
+        globs_.insert(glob.str());
+    }
+
+    const auto savedFingerprint = in.str();
+    const auto saved = in.str();
+
+    PathSet rests;
+    const auto key = splitPrefix(rests);
+
+    auto& cache = CompileCache::instance();
+    compiled_ = cache.find(key);
+    if(compiled_) {
+        return;
+    }
+
+    if(savedFingerprint == PathView(fingerprint())) {
+        BlobReader compiledIn(saved.data(), saved.size());
+        std::shared_ptr<const CompiledGlobs> compiled =
+            loadCompiled(compiledIn);
+        if(compiled && !compiledIn.atEnd()) {
+            throw runtime_error("Trailing data in serialized GlobSet");
+        }
+        if(compiled) {
+            compiled_ = cache.insert(key, compiled);
+            return;
+        }
+    }
+
+    LOG_F(INFO, "Serialized globs are from a different version; "
+          "recompiling");
+    compiled_ = cache.insert(key, compile(rests));
+} // GlobSetImpl::load()
+
+bool
+GlobSetImpl::contains(PathView path, MatchContext& context) const
+{
+    if(!finalized()) {
+        throw logic_error("Glob set was not finalized");
+    }
+
+    // No globset matches an empty string.  Also, no glob is entirely
+    // prefix_, so the rest of a matching path is never empty.
+    const PathView rest = stripPrefix(path);
+    if(rest.empty()) {
+        return false;
+    }
+
+    return compiled_->contains(rest, *context.impl_);
 } // GlobSetImpl::contains()
 
+void
+GlobSetImpl::containsMany(const PathView *paths, size_t count,
+                          std::vector<bool>& results,
+                          MatchContext& context) const
+{
+    if(!finalized()) {
+        throw logic_error("Glob set was not finalized");
+    }
+
+    if(results.size() < count) {
+        throw logic_error("containsMany: results vector is too small");
+    }
+
+    if(prefix_.empty()) {
+        compiled_->containsMany(paths, count, results, *context.impl_);
+        return;
+    }
+
+    // Paths that don't start with prefix_ become empty, so don't match
+    auto& rests = context.impl_->views;
+    rests.resize(count);
+    for(size_t i = 0; i < count; ++i) {
+        rests[i] = stripPrefix(paths[i]);
+    }
+    compiled_->containsMany(rests.data(), count, results, *context.impl_);
+} // GlobSetImpl::containsMany()
+
+bool
+GlobSetImpl::canMatchUnder(PathView dir, MatchContext& context) const
+{
+    if(!finalized()) {
+        throw logic_error("Glob set was not finalized");
+    }
+
+    // Every path under dir starts with this
+    string under(dir.data(), dir.size());
+    if(under.empty() || under.back() != '/') {
+        under += '/';
+    }
+
+    const size_t len = std::min(under.size(), prefix_.size());
+    if(memcmp(under.data(), prefix_.data(), len) != 0) {
+        return false;
+    }
+
+    if(under.size() <= prefix_.size()) {
+        return !globs_.empty();     // dir is above every glob
+    }
+
+    return compiled_->mayMatchPrefix(
+               PathView(under.data() + prefix_.size(),
+                        under.size() - prefix_.size()),
+               *context.impl_);
+} // GlobSetImpl::canMatchUnder()
+
+// --- MatchContext ------------------------------------------------------
+
+MatchContext::MatchContext()
+    : impl_(new MatchContextImpl())
+{}
+
+/// dtor.  Must be expressly declared so impl_'s deleter is called
+/// at a point where the definition of MatchContextImpl is available.
+MatchContext::~MatchContext()
+{}
+
+MatchContext&
+MatchContext::forThisThread()
+{
+    static thread_local MatchContext context;
+    return context;
+}
+
 // --- GlobSet -----------------------------------------------------------
 
+bool
+jitAvailable()
+{
+    static const bool available = []() {
+        uint32_t jit = 0;
+        return (pcre2_config(PCRE2_CONFIG_JIT, &jit) >= 0) && (jit != 0);
+    }();
+    return available;
+}
+
+/// Guards defaultOptions_
+static std::mutex defaultOptionsMutex_;
+
+/// The options used by GlobSet()
+static GlobSetOptions defaultOptions_;
+
+void
+GlobSet::setDefaultOptions(const GlobSetOptions& options)
+{
+    std::lock_guard<std::mutex> lock(defaultOptionsMutex_);
+    defaultOptions_ = options;
+}
+
+GlobSetOptions
+GlobSet::defaultOptions()
+{
+    std::lock_guard<std::mutex> lock(defaultOptionsMutex_);
+    return defaultOptions_;
+}
+
 GlobSet::GlobSet()
-    : impl_(new GlobSetImpl())
+    : GlobSet(defaultOptions())
 {}
 
-GlobSet::GlobSet(const GlobSet& other)
-    : impl_(new GlobSetImpl(*other.impl_.get()))
+GlobSet::GlobSet(const GlobSetOptions& options)
+    : impl_(std::make_shared<GlobSetImpl>(options))
 {}
 
+GlobSet::GlobSet(const GlobSet& other) = default;
+
+GlobSet&
+GlobSet::operator=(const GlobSet& other) = default;
+
 /// dtor.  Must be expressly declared so impl_'s deleter is called
 /// at a point where the definition of GlobSetImpl is available.
 GlobSet::~GlobSet()
 {}
 
+void
+GlobSet::detach()
+{
+    if(impl_.use_count() > 1) {
+        impl_ = std::make_shared<GlobSetImpl>(*impl_);
+    }
+}
+
 void
 GlobSet::addGlob(const smallcxx::glob::Path& glob)
 {
+    detach();
     impl_->addGlob(glob);
 }
 
 void
 GlobSet::finalize()
 {
+    detach();
     impl_->finalize();
 }
 
@@ -613,10 +1386,77 @@ GlobSet::finalized() const
 {
     return impl_->finalized();
 }
+
+const PathSet&
+GlobSet::globs() const
+{
+    return impl_->globs();
+}
+
+std::string
+GlobSet::serialize() const
+{
+    string retval;
+    BlobWriter out(retval);
+    impl_->serialize(out);
+    return retval;
+}
+
+GlobSet
+GlobSet::deserialize(const void *data, size_t size)
+{
+    GlobSet retval;
+    BlobReader in(data, size);
+    retval.impl_->load(in);
+    if(!in.atEnd()) {
+        throw runtime_error("Trailing data in serialized GlobSet");
+    }
+    return retval;
+}
+bool
+GlobSet::contains(PathView path) const
+{
+    return impl_->contains(path, MatchContext::forThisThread());
+}
+
+bool
+GlobSet::contains(PathView path, MatchContext& context) const
+{
+    return impl_->contains(path, context);
+}
+
+std::vector<bool>
+GlobSet::containsMany(const PathView *paths, size_t count) const
+{
+    return containsMany(paths, count, MatchContext::forThisThread());
+}
+
+std::vector<bool>
+GlobSet::containsMany(const PathView *paths, size_t count,
+                      MatchContext& context) const
+{
+    std::vector<bool> results(count, false);
+    impl_->containsMany(paths, count, results, context);
+    return results;
+}
+
+void
+GlobSet::containsMany(const PathView *paths, size_t count,
+                      std::vector<bool>& results, MatchContext& context) const
+{
+    impl_->containsMany(paths, count, results, context);
+}
+
+bool
+GlobSet::canMatchUnder(PathView dir) const
+{
+    return impl_->canMatchUnder(dir, MatchContext::forThisThread());
+}
+
 bool
-GlobSet::contains(const smallcxx::glob::Path& path) const
+GlobSet::canMatchUnder(PathView dir, MatchContext& context) const
 {
-    return impl_->contains(path);
+    return impl_->canMatchUnder(dir, context);
 }
 
 } // namespace glob
@@ -4,9 +4,18 @@
 /// @copyright Copyright (c) 2021--2022 Christopher White
 /// SPDX-License-Identifier: BSD-3-Clause
 
+#include <algorithm>
+#include <atomic>
 #include <set>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 #include "smallcxx/globstari.hpp"
+#include "smallcxx/globstari-traverse.hpp"
 #include "smallcxx/test.hpp"
 
 #include "testhelpers.hpp"
@@ -76,6 +85,88 @@ test_sanity()
     );
 }
 
+/// A virtual tree that lists some entries more than once, and some in
+/// more than one directory, as symlinks might.  Also has a path that isn't
+/// in the usual canonical form.
+class TestFileTreeRepeats: public IFileTree
+{
+public:
+    std::vector< std::shared_ptr<Entry> >
+    readDir(const Path& dirPath) override
+    {
+        std::vector< std::shared_ptr<Entry> > retval;
+        const auto add = [&retval](EntryType ty, const char *path) {
+            retval.push_back(std::make_shared<Entry>(ty, path));
+        };
+
+        if(dirPath == "/") {
+            add(EntryType::Dir, "/a");
+            add(EntryType::Dir, "/b");
+            add(EntryType::Dir, "/a");
+        } else if(dirPath == "/a") {
+            add(EntryType::File, "/a/x");
+            add(EntryType::Dir, "/b");      // a link to /b
+        } else if(dirPath == "/b") {
+            add(EntryType::File, "/b/y");
+            add(EntryType::File, "/a/x");   // a link to /a/x
+            add(EntryType::File, "/b//z");
+            add(EntryType::File, "/b//z");
+            add(EntryType::File, "/b/y");
+        }
+        return retval;
+    }
+
+    // LCOV_EXCL_START - canonicalize() says no ignore file exists
+    Bytes
+    readFile(const Path& path) override
+    {
+        return "";
+    }
+    // LCOV_EXCL_STOP
+
+    Path
+    canonicalize(const Path& path) const override
+    {
+        return (path.find(".eignore") == path.npos) ? path : "";
+    }
+}; // class TestFileTreeRepeats
+
+/// Records every path processed, including repeats
+class ListPaths: public IProcessEntry
+{
+public:
+    std::vector<Path> paths;
+
+    IProcessEntry::Status
+    operator()(const std::shared_ptr<Entry>& entry) override
+    {
+        paths.push_back(entry->canonPath);
+        return IProcessEntry::Status::Continue;
+    }
+}; // class ListPaths
+
+/// Each path is processed once, however many times it is found
+static void
+test_repeats()
+{
+    TestFileTreeRepeats fileTree;
+    for(const unsigned threads : {
+                1U, 4U
+            }) {
+        GlobstariOptions options;
+        options.threads = threads;
+        ListPaths listPaths;
+        globstari(fileTree, listPaths, "/", {"*"}, options);
+
+        std::sort(listPaths.paths.begin(), listPaths.paths.end());
+        const std::vector<Path> expected{
+            "/", "/a", "/a/x", "/b", "/b//z", "/b/y"
+        };
+        cmp_ok(listPaths.paths.size(), ==, expected.size());
+        ok(listPaths.paths == expected);
+    }
+}
+
 /// @name Tests of disk globbing
 /// @{
 
@@ -214,14 +305,937 @@ test_disk_ignores()
                          __func__, __LINE__);
         cmp_ok(saveEntries.ignoredPaths.size(), ==, 5);
     }
+
+    // Flattened ignores give the same results
+    for(const auto& needle : std::vector<std::vector<Path>> {
+                {"*"}, {"*ignored*"}, {"#"}, {"file*"}, {"*.txt", "!text.txt"}
+            }) {
+        GlobstariOptions options;
+        options.flattenIgnores = true;
+        SaveEntries flat, chained;
+        globstari(fileTree, flat, basepath, needle, options);
+        globstari(fileTree, chained, basepath, needle);
+        ok(flat.found == chained.found);
+        ok(flat.ignoredPaths == chained.ignoredPaths);
+    }
 } // test_disk_ignores()
 
+/// A DiskFileTree that records which directories it reads
+class CountingDiskFileTree: public DiskFileTree
+{
+public:
+    std::set<Path> dirsRead;
+
+    std::vector< std::shared_ptr<Entry> >
+    readDir(const Path& dirPath) override
+    {
+        dirsRead.insert(dirPath);
+        return DiskFileTree::readDir(dirPath);
+    }
+}; // class CountingDiskFileTree
+
+/// A DiskFileTree that uses the default IFileTree::lookup()
+class DefaultLookupDiskFileTree: public CountingDiskFileTree
+{
+public:
+    std::shared_ptr<Entry>
+    lookup(const Path& path) override
+    {
+        return IFileTree::lookup(path);
+    }
+}; // class DefaultLookupDiskFileTree
+
+/// Tests of GlobstariOptions::pruneDirs
+static void
+test_disk_prune()
+{
+    const glob::Path basepath{SRCDIR "/globstari-basic-disk-ignores"};
+    GlobstariOptions options;
+    options.pruneDirs = true;
+
+    {
+        // Anchored at the top level --- no need to read any subdirectory
+        CountingDiskFileTree fileTree;
+        SaveEntries saveEntries;
+        globstari(fileTree, saveEntries, basepath, {"/file*"}, options);
+        compare_sequence(saveEntries.found, {"/file#1", "/file#2", "/file#3"},
+                         __func__, __LINE__);
+        cmp_ok(fileTree.dirsRead.size(), ==, 1);
+    }
+
+    {
+        // Only dir/subdir and below can match, so go straight there
+        CountingDiskFileTree fileTree;
+        SaveEntries saveEntries;
+        globstari(fileTree, saveEntries, basepath, {"dir/subdir/**/not*"},
+                  options);
+        compare_sequence(saveEntries.found,
+        {"/dir/subdir/s2dir/s3dir/notignored"}, __func__, __LINE__);
+        cmp_ok(fileTree.dirsRead.size(), ==, 3);    // subdir, s2dir, s3dir
+    }
+
+    {
+        // Ignore files above the starting point still apply
+        CountingDiskFileTree fileTree;
+        SaveEntries saveEntries;
+        globstari(fileTree, saveEntries, basepath, {"dir/subdir/s2dir/**"},
+                  options);
+        compare_sequence(saveEntries.found,
+        {"/s2dir/.eignore", "/s3dir", "/s3dir/notignored"}, __func__, __LINE__);
+        ok(saveEntries.ignoredPaths.count(
+               basepath + "/dir/subdir/s2dir/s3dir/ignored.in-s3dir"));
+        ok(saveEntries.ignoredPaths.count(
+               basepath + "/dir/subdir/s2dir/s3dir/subignored"));
+        cmp_ok(fileTree.dirsRead.size(), ==, 2);    // s2dir, s3dir
+    }
+
+    {
+        // Several starting points, one under another
+        CountingDiskFileTree fileTree;
+        SaveEntries saveEntries;
+        globstari(fileTree, saveEntries, basepath,
+        {"dir/subdir/s2dir/s3dir/not*", "dir/file*", "nonexistent/x"},
+        options);
+        compare_sequence(saveEntries.found,
+        {"/dir/file#3", "/dir/subdir/s2dir/s3dir/notignored"},
+        __func__, __LINE__);
+    }
+
+    {
+        // Literal needles are looked up without reading any directory,
+        // but the ignores still apply
+        CountingDiskFileTree fileTree;
+        SaveEntries saveEntries;
+        globstari(fileTree, saveEntries, basepath, {
+            "dir/subdir/s2dir/s3dir/{notignored,subignored}",
+            "/{noext,text.txt,ignored.1,nonexistent}", "dir/file\\#3"
+        }, options);
+        compare_sequence(saveEntries.found,
+        {
+            "/dir/file#3", "/dir/subdir/s2dir/s3dir/notignored", "/noext",
+            "/text.txt"
+        }, __func__, __LINE__);
+        ok(saveEntries.ignoredPaths.count(basepath + "/ignored.1"));
+        ok(saveEntries.ignoredPaths.count(
+               basepath + "/dir/subdir/s2dir/s3dir/subignored"));
+        cmp_ok(fileTree.dirsRead.size(), ==, 0);
+    }
+
+    {
+        // The default IFileTree::lookup() reads the parent directory
+        DefaultLookupDiskFileTree fileTree;
+        SaveEntries saveEntries;
+        globstari(fileTree, saveEntries, basepath, {"dir/subdir/**/not*"},
+                  options);
+        compare_sequence(saveEntries.found,
+        {"/dir/subdir/s2dir/s3dir/notignored"}, __func__, __LINE__);
+        cmp_ok(fileTree.dirsRead.size(), ==, 5);
+    }
+
+    {
+        // Same results as without pruning
+        for(const auto& needle : std::vector<std::vector<Path>> {
+                    {"*ignored*"}, {"file*"}, {"*.txt", "!text.txt"},
+                    {"dir/**"}, {"/dir/file*", "/dir/sub*/**/s*"},
+                    {"dir/subdir/s2dir/**"}, {"dir/subdir/**", "!dir/*"},
+                    {"/{noext,ignored.1,dir/file\\#3}"},
+                    {"dir/subdir/{s2dir/s3dir/notignored,missing}", "/text*"},
+                    {"/{a,b}{c,d}", "dir/{x}"}, {"dir/{1..3}", "/a\\d"}
+                }) {
+            CountingDiskFileTree pruned, unpruned;
+            SaveEntries prunedEntries, unprunedEntries;
+            globstari(pruned, prunedEntries, basepath, needle, options);
+            globstari(unpruned, unprunedEntries, basepath, needle);
+            ok(prunedEntries.found == unprunedEntries.found);
+            cmp_ok(pruned.dirsRead.size(), <=, unpruned.dirsRead.size());
+        }
+    }
+} // test_disk_prune()
+
+/// Records whether globstari() ever calls it from two threads at once
+class SerialSaveEntries: public SaveEntries
+{
+    std::atomic<bool> busy_;
+
+public:
+    std::atomic<bool> overlapped;
+    size_t calls = 0;
+
+    /// After this many calls, return Stop.  0 for never.
+    size_t stopAfter = 0;
+
+    SerialSaveEntries(): busy_(false), overlapped(false) {}
+
+    IProcessEntry::Status
+    operator()(const std::shared_ptr<Entry>& entry) override
+    {
+        if(busy_.exchange(true)) {
+            overlapped = true;
+        }
+        auto retval = SaveEntries::operator()(entry);
+        if(stopAfter && ++calls >= stopAfter) {
+            retval = IProcessEntry::Status::Stop;
+        }
+        std::this_thread::yield();
+        busy_ = false;
+        return retval;
+    }
+
+    void
+    ignored(const std::shared_ptr<Entry>& entry) override
+    {
+        if(busy_.exchange(true)) {
+            overlapped = true;
+        }
+        SaveEntries::ignored(entry);
+        std::this_thread::yield();
+        busy_ = false;
+    }
+}; // class SerialSaveEntries
+
+/// A DiskFileTree that can't read directories named `subdir`
+class FailingDiskFileTree: public DiskFileTree
+{
+public:
+    std::vector< std::shared_ptr<Entry> >
+    readDir(const Path& dirPath) override
+    {
+        if(dirPath.size() >= 7 &&
+                dirPath.compare(dirPath.size() - 7, 7, "/subdir") == 0) {
+            throw std::runtime_error("can't read subdir");
+        }
+        return DiskFileTree::readDir(dirPath);
+    }
+}; // class FailingDiskFileTree
+
+/// Check that @p actual found and ignored the same paths as @p expected
+template<class Processor>
+static void
+sameResults(const Processor& actual, const SaveEntries& expected)
+{
+    ok(actual.found == expected.found);
+    ok(actual.ignoredPaths == expected.ignoredPaths);
+}
+
+/// One thread, and four threads with GlobstariOptions::pruneDirs
+static std::vector<GlobstariOptions>
+threadVariants()
+{
+    std::vector<GlobstariOptions> retval(2);
+    retval[1].threads = 4;
+    retval[1].pruneDirs = true;
+    return retval;
+}
+
+/// For each of several needles and each of @p variants, call
+/// `check(basepath, needle, options, expected)`.  @c expected is what a
+/// DiskFileTree and a SaveEntries find under @c basepath, the canonical
+/// path of `t/globstari-basic-disk-ignores`, with @c options but one
+/// thread.
+template<class Check>
+static void
+forEachNeedle(const std::vector<GlobstariOptions>& variants, Check check)
+{
+    DiskFileTree plain;
+    const glob::Path basepath{
+        plain.canonicalize(SRCDIR "/globstari-basic-disk-ignores")};
+
+    for(const auto& needle : std::vector<std::vector<Path>> {
+                {"*"}, {"*ignored*"}, {"*.txt", "!text.txt"}, {"dir/**"},
+                {"dir/**/*"}, {"dir/subdir/s2dir/**"},
+                {"dir/subdir/s2dir/s3dir/notignored"}
+            }) {
+        for(const auto& options : variants) {
+            auto singleOptions = options;
+            singleOptions.threads = 1;
+            SaveEntries expected;
+            globstari(plain, expected, basepath, needle, singleOptions);
+
+            check(basepath, needle, options, expected);
+        }
+    }
+}
+
+/// Checks nothing
+struct NoMoreChecks {
+    template<class Processor>
+    void
+    operator()(const Processor& processor) const
+    {
+    }
+};
+
+/// Check that globstari() over @p fileTree, with a new @p Processor each
+/// time, gives the same results as SaveEntries.  See forEachNeedle().
+/// Each @p Processor is also passed to @p moreChecks.
+template<class Processor, class FileTree, class MoreChecks = NoMoreChecks>
+static void
+sameAsSaveEntries(FileTree& fileTree,
+                  const std::vector<GlobstariOptions>& variants,
+                  MoreChecks moreChecks = MoreChecks())
+{
+    forEachNeedle(variants, [&](const Path& basepath,
+                                const std::vector<Path>& needle,
+                                const GlobstariOptions& options,
+                                const SaveEntries& expected) {
+        Processor actual;
+        globstari(fileTree, actual, basepath, needle, options);
+        sameResults(actual, expected);
+        moreChecks(actual);
+    });
+}
+
+/// Tests of GlobstariOptions::threads
+static void
+test_disk_threads()
+{
+    const glob::Path basepath{SRCDIR "/globstari-basic-disk-ignores"};
+
+    // Same results as with one thread
+    std::vector<GlobstariOptions> variants;
+    for(const bool prune : {
+                false, true
+            }) {
+        for(const unsigned threads : {
+                    0U, 2U, 4U
+                }) {
+            GlobstariOptions options;
+            options.pruneDirs = prune;
+            options.threads = threads;
+            variants.push_back(options);
+        }
+    }
+    DiskFileTree fileTree;
+    sameAsSaveEntries<SerialSaveEntries>(fileTree, variants,
+    [](const SerialSaveEntries& threaded) {
+        ok(!threaded.overlapped);
+    });
+
+    GlobstariOptions options;
+    options.threads = 4;
+
+    {
+        // No calls after Stop
+        DiskFileTree fileTree;
+        SerialSaveEntries saveEntries;
+        saveEntries.stopAfter = 3;
+        globstari(fileTree, saveEntries, basepath, {"*"}, options);
+        cmp_ok(saveEntries.found.size(), ==, 3);
+    }
+
+    {
+        // Errors on worker threads reach the caller
+        FailingDiskFileTree fileTree;
+        SaveEntries saveEntries;
+        throws_with_msg(
+            globstari(fileTree, saveEntries, basepath, {"*"}, options),
+            "can't read subdir");
+    }
+} // test_disk_threads()
+
+/// Tests of DiskFileTree with open directories
+static void
+test_disk_fds()
+{
+    DiskFileTree plain;
+    const glob::Path basepath{
+        plain.canonicalize(SRCDIR "/globstari-basic-disk-ignores")};
+
+    // Same results as without
+    for(const size_t maxOpenDirs : {
+                1, 2, 64
+            }) {
+        DiskFileTree fds(maxOpenDirs), async(maxOpenDirs, true);
+        sameAsSaveEntries<SaveEntries>(fds, threadVariants());
+        sameAsSaveEntries<SaveEntries>(async, threadVariants());
+    }
+
+    // Asynchronous I/O needs somewhere to keep the directories it opens
+    ok(!DiskFileTree(0, true).hasAsyncIo());
+    LOG_F(INFO, "io_uring: %s",
+          DiskFileTree(8, true).hasAsyncIo() ? "yes" : "no");
+
+    // Paths in open directories
+    DiskFileTree fds(8);
+    fds.readDir(basepath);
+    isstr(fds.canonicalize(basepath + "/dir"), basepath + "/dir");
+    isstr(fds.canonicalize(basepath + "/dir/subdir/s2dir"),
+          basepath + "/dir/subdir/s2dir");
+    isstr(fds.canonicalize(basepath + "/dir/../text.txt"),
+          basepath + "/text.txt");
+    isstr(fds.canonicalize(basepath + "/nonexistent"), "");
+
+    auto entry = fds.lookup(basepath + "/dir/subdir/s2dir/s3dir/notignored");
+    ok(entry && entry->ty == EntryType::File);
+    entry = fds.lookup(basepath + "/dir/subdir");
+    ok(entry && entry->ty == EntryType::Dir);
+    ok(!fds.lookup(basepath + "/dir/nonexistent"));
+
+    ok(fds.readFile(basepath + "/.eignore").find("ignored.*") != Path::npos);
+    isstr(fds.readFile(basepath + "/dir/subdir/s2dir/.eignore"),
+          "subignored\n");
+    throws_with_msg(fds.readFile(basepath + "/nonexistent"),
+                    "Could not open");
+
+    // Without open directories
+    isstr(plain.readFile(basepath + "/dir/subdir/s2dir/.eignore"),
+          "subignored\n");
+    throws_with_msg(plain.readFile(basepath + "/nonexistent"),
+                    "Could not open");
+} // test_disk_fds()
+
+/// Skips directories named `subdir`
+class SkipSubdir: public SaveEntries
+{
+public:
+    IProcessEntry::Status
+    operator()(const std::shared_ptr<Entry>& entry) override
+    {
+        SaveEntries::operator()(entry);
+        const auto& path = entry->canonPath;
+        if(path.size() >= 7 &&
+                path.compare(path.size() - 7, 7, "/subdir") == 0) {
+            return IProcessEntry::Status::Skip;
+        }
+        return IProcessEntry::Status::Continue;
+    }
+}; // class SkipSubdir
+
+/// Tests of GlobstariWalk
+static void
+test_disk_walk()
+{
+    const glob::Path basepath{SRCDIR "/globstari-basic-disk-ignores"};
+    DiskFileTree fileTree;
+
+    // Same results as globstari()
+    forEachNeedle({GlobstariOptions()},
+                  [&fileTree](const Path& root,
+                              const std::vector<Path>& needle,
+                              const GlobstariOptions& options,
+                              const SaveEntries& expected) {
+        std::set<Path> found;
+        GlobstariWalk walk(fileTree, root, needle, options);
+        while(auto entry = walk.next()) {
+            found.insert(entry->canonPath);
+        }
+        ok(walk.done());
+        ok(found == expected.found);
+        ok(!walk.next());
+    });
+
+    {
+        // skip() is like IProcessEntry::Status::Skip
+        SkipSubdir skipSubdir;
+        globstari(fileTree, skipSubdir, basepath, {"*"});
+
+        std::set<Path> found;
+        GlobstariWalk walk(fileTree, basepath, {"*"});
+        while(auto entry = walk.next()) {
+            found.insert(entry->canonPath);
+            if(entry->canonPath == basepath + "/dir/subdir") {
+                walk.skip();
+            }
+        }
+        ok(found == skipSubdir.found);
+        ok(!found.count(basepath + "/dir/subdir/s2dir"));
+    }
+
+    {
+        // Time-slicing: one entry per step
+        SaveEntries saveEntries;
+        globstari(fileTree, saveEntries, basepath, {"*.txt"});
+
+        std::set<Path> found;
+        size_t steps = 0;
+        GlobstariWalk walk(fileTree, basepath, {"*.txt"});
+        while(!walk.done()) {
+            ++steps;
+            auto entry = walk.next(1);
+            if(entry) {
+                found.insert(entry->canonPath);
+            }
+        }
+        ok(found == saveEntries.found);
+        cmp_ok(steps, >, found.size());
+    }
+
+    {
+        // Stop partway through
+        GlobstariWalk walk(fileTree, basepath, {"*"});
+        ok(!!walk.next());
+        ok(!!walk.next());
+        ok(!walk.done());
+    }
+
+    {
+        // Errors end the walk
+        FailingDiskFileTree failingFileTree;
+        GlobstariWalk walk(failingFileTree, basepath, {"*"});
+        throws_with_msg(
+            while(walk.next()) {}, "can't read subdir");
+        ok(walk.done());
+        ok(!walk.next());
+    }
+} // test_disk_walk()
+
+/// Write @p contents to a new or existing file at @p path
+static void
+writeFile(const Path& path, const char *contents)
+{
+    FILE *fp = fopen(path.c_str(), "w");
+    if(!fp) {
+        throw std::runtime_error("Could not write " + path);
+    }
+    fputs(contents, fp);
+    fclose(fp);
+}
+
+/// Tests of GlobstariOptions::ignoreCache
+static void
+test_disk_ignore_cache()
+{
+    // Same results as without, and no misses the second time
+    DiskFileTree plain;
+    const glob::Path basepath{
+        plain.canonicalize(SRCDIR "/globstari-basic-disk-ignores")};
+    for(const unsigned threads : {
+                1U, 4U
+            }) {
+        GlobstariOptions options;
+        options.threads = threads;
+        options.ignoreCache = std::make_shared<IgnoreCache>();
+
+        for(const auto& needle : std::vector<std::vector<Path>> {
+                    {"*"}, {"*ignored*"}, {"dir/subdir/**"}
+                }) {
+            SaveEntries cached, without;
+            globstari(plain, without, basepath, needle);
+            globstari(plain, cached, basepath, needle, options);
+            ok(cached.found == without.found);
+            ok(cached.ignoredPaths == without.ignoredPaths);
+
+            const auto misses = options.ignoreCache->misses();
+            SaveEntries again;
+            globstari(plain, again, basepath, needle, options);
+            ok(again.found == without.found);
+            ok(again.ignoredPaths == without.ignoredPaths);
+            cmp_ok(options.ignoreCache->misses(), ==, misses);
+        }
+        cmp_ok(options.ignoreCache->hits(), >, 0);
+        cmp_ok(options.ignoreCache->size(), >, 0);
+    }
+
+    // Changes to ignore files are noticed
+    std::string dirTemplate(MY_PATH + "/ignore-cache-XXXXXX");
+    if(!mkdtemp(&dirTemplate[0])) {
+        throw std::runtime_error("Could not create " + dirTemplate);
+    }
+    const Path dir(plain.canonicalize(dirTemplate));
+    ok(mkdir((dir + "/sub").c_str(), 0755) == 0);
+    writeFile(dir + "/.eignore", "a\n");
+    writeFile(dir + "/a", "");
+    writeFile(dir + "/b", "");
+    writeFile(dir + "/sub/c", "");
+
+    GlobstariOptions options;
+    options.ignoreCache = std::make_shared<IgnoreCache>();
+    for(const int kind : {
+                0, 1, 2
+            }) {
+        // Without open directories, with them, and with asynchronous I/O
+        DiskFileTree fileTree(kind ? 8 : 0, kind == 2);
+        SaveEntries first;
+        globstari(fileTree, first, dir, {"*"}, options);
+        ok(first.found.count(dir + "/b"));
+        ok(!first.found.count(dir + "/a"));
+        ok(first.found.count(dir + "/sub/c"));
+
+        // Changed ignore file
+        writeFile(dir + "/.eignore", "bb\nb\n");
+        SaveEntries changed;
+        globstari(fileTree, changed, dir, {"*"}, options);
+        ok(changed.found.count(dir + "/a"));
+        ok(!changed.found.count(dir + "/b"));
+
+        // New ignore file
+        writeFile(dir + "/sub/.eignore", "c\n");
+        SaveEntries added;
+        globstari(fileTree, added, dir, {"*"}, options);
+        ok(!added.found.count(dir + "/sub/c"));
+
+        // Back to the start
+        unlink((dir + "/sub/.eignore").c_str());
+        writeFile(dir + "/.eignore", "a\n");
+        SaveEntries removed;
+        globstari(fileTree, removed, dir, {"*"}, options);
+        ok(removed.found == first.found);
+    }
+
+    // An ignore file that can't be read this time isn't cached as absent
+    struct FailingReads: public DiskFileTree {
+        bool fail = true;
+
+        Bytes
+        readFile(const Path& path) override
+        {
+            if(fail) {
+                throw std::runtime_error("Could not read " + path);
+            }
+            return DiskFileTree::readFile(path);
+        }
+    } failing;
+    options.ignoreCache->clear();
+    SaveEntries unreadable;
+    globstari(failing, unreadable, dir, {"*"}, options);
+    ok(unreadable.found.count(dir + "/a"));
+    failing.fail = false;
+    SaveEntries readable;
+    globstari(failing, readable, dir, {"*"}, options);
+    ok(!readable.found.count(dir + "/a"));
+
+    options.ignoreCache->clear();
+    cmp_ok(options.ignoreCache->size(), ==, 0);
+
+    for(const char *name : {
+                "/sub/c", "/.eignore", "/a", "/b"
+            }) {
+        unlink((dir + name).c_str());
+    }
+    rmdir((dir + "/sub").c_str());
+    rmdir(dir.c_str());
+} // test_disk_ignore_cache()
+
+/// Reusing a DiskFileTree for several traversals
+static void
+test_disk_reuse()
+{
+    std::string dirTemplate(MY_PATH + "/reuse-XXXXXX");
+    if(!mkdtemp(&dirTemplate[0])) {
+        throw std::runtime_error("Could not create " + dirTemplate);
+    }
+    DiskFileTree plain;
+    const Path dir(plain.canonicalize(dirTemplate));
+    ok(mkdir((dir + "/subdir").c_str(), 0755) == 0);
+    writeFile(dir + "/subdir/secret", "");
+
+    // The first traversal checks for subdir's ignore file but doesn't
+    // read subdir
+    DiskFileTree async(64, true);
+    SkipSubdir skipSubdir;
+    globstari(async, skipSubdir, dir, {"*"});
+    ok(skipSubdir.found.count(dir + "/subdir"));
+    ok(!skipSubdir.found.count(dir + "/subdir/secret"));
+
+    // The second sees the ignore file added since
+    writeFile(dir + "/subdir/.eignore", "secret\n");
+    SaveEntries again, fresh;
+    globstari(async, again, dir, {"*"});
+    globstari(plain, fresh, dir, {"*"});
+    ok(!fresh.found.count(dir + "/subdir/secret"));
+    ok(again.found == fresh.found);
+    ok(again.ignoredPaths == fresh.ignoredPaths);
+
+    for(const char *name : {
+                "/subdir/.eignore", "/subdir/secret"
+            }) {
+        unlink((dir + name).c_str());
+    }
+    rmdir((dir + "/subdir").c_str());
+    rmdir(dir.c_str());
+} // test_disk_reuse()
+
+/// Tests of DiskFileTree's followSymlinks
+static void
+test_disk_symlinks()
+{
+    std::string dirTemplate(MY_PATH + "/symlinks-XXXXXX");
+    if(!mkdtemp(&dirTemplate[0])) {
+        throw std::runtime_error("Could not create " + dirTemplate);
+    }
+    DiskFileTree plain;
+    const Path dir(plain.canonicalize(dirTemplate));
+    ok(mkdir((dir + "/sub").c_str(), 0755) == 0);
+    writeFile(dir + "/sub/file", "");
+    ok(symlink("..", (dir + "/sub/loop").c_str()) == 0);
+    ok(symlink("sub", (dir + "/link").c_str()) == 0);
+    ok(symlink("sub/file", (dir + "/filelink").c_str()) == 0);
+    ok(symlink("nonexistent", (dir + "/dangling").c_str()) == 0);
+
+    // Not following
+    SaveEntries notFollowed;
+    globstari(plain, notFollowed, dir, {"*"});
+    ok(notFollowed.found == std::set<Path>({
+        dir + "/sub", dir + "/sub/file"
+    }));
+
+    for(const size_t maxOpenDirs : {
+                0, 8
+            }) {
+        for(const unsigned threads : {
+                    1U, 4U
+                }) {
+            DiskFileTree following(maxOpenDirs, false, true);
+            GlobstariOptions options;
+            options.threads = threads;
+            SaveEntries followed;
+            globstari(following, followed, dir, {"*"}, options);
+
+            // Each path is reported, but each directory is read once, by
+            // one path or the other
+            ok(followed.found.count(dir + "/sub"));
+            ok(followed.found.count(dir + "/link"));
+            const Path subPath = followed.found.count(dir + "/sub/file") ?
+                                 dir + "/sub" : dir + "/link";
+            ok(followed.found.count(subPath + "/file"));
+            ok(followed.found.count(subPath + "/loop"));
+            ok(!followed.found.count(subPath + "/loop/sub"));
+            ok(followed.found.count(dir + "/filelink"));
+            ok(!followed.found.count(dir + "/dangling"));
+            cmp_ok(followed.found.size(), ==, 5);
+
+            auto entry = following.lookup(dir + "/link");
+            ok(entry && entry->ty == EntryType::Dir && entry->ino != 0);
+            entry = following.lookup(dir + "/filelink");
+            ok(entry && entry->ty == EntryType::File);
+            ok(!following.lookup(dir + "/dangling"));
+        }
+    }
+
+    // A skipped symlink doesn't hide the directory it points to
+    ok(symlink("sub", (dir + "/subdir").c_str()) == 0);
+    for(const unsigned threads : {
+                1U, 4U
+            }) {
+        DiskFileTree following(0, false, true);
+        GlobstariOptions options;
+        options.threads = threads;
+        SkipSubdir skipSubdir;
+        globstari(following, skipSubdir, dir, {"*"}, options);
+        ok(skipSubdir.found.count(dir + "/subdir"));
+        ok(!skipSubdir.found.count(dir + "/subdir/file"));
+        cmp_ok(skipSubdir.found.count(dir + "/sub/file") +
+               skipSubdir.found.count(dir + "/link/file"), ==, 1);
+    }
+
+    // Nor does an ignored one
+    const Path ign = dir + "/ign";
+    ok(mkdir(ign.c_str(), 0755) == 0);
+    ok(mkdir((ign + "/src").c_str(), 0755) == 0);
+    writeFile(ign + "/src/file.c", "");
+    writeFile(ign + "/.eignore", "l*\n");
+    for(const char *name : {
+                "/l10", "/l20", "/l30"
+            }) {
+        ok(symlink("src", (ign + name).c_str()) == 0);
+    }
+    for(const bool follow : {
+                false, true
+            }) {
+        DiskFileTree fileTree(0, false, follow);
+        SaveEntries saveEntries;
+        globstari(fileTree, saveEntries, ign, {"*.c"});
+        ok(saveEntries.found == std::set<Path>({ign + "/src/file.c"}));
+        cmp_ok(saveEntries.ignoredPaths.size(), ==, follow ? 3U : 0U);
+    }
+
+    for(const char *name : {
+                "/dangling", "/filelink", "/link", "/subdir", "/sub/loop",
+                "/sub/file", "/ign/l10", "/ign/l20", "/ign/l30",
+                "/ign/.eignore", "/ign/src/file.c"
+            }) {
+        unlink((dir + name).c_str());
+    }
+    rmdir((dir + "/ign/src").c_str());
+    rmdir((dir + "/ign").c_str());
+    rmdir((dir + "/sub").c_str());
+    rmdir(dir.c_str());
+} // test_disk_symlinks()
+
+/// A DiskFileTree the compiler knows has no subclasses
+class FinalDiskFileTree final: public DiskFileTree
+{
+public:
+    using DiskFileTree::DiskFileTree;
+}; // class FinalDiskFileTree
+
+/// An in-memory tree the compiler knows has no subclasses
+class FinalFileTreeRepeats final: public TestFileTreeRepeats
+{
+}; // class FinalFileTreeRepeats
+
+/// Likewise, a SaveEntries
+class FinalSaveEntries final: public SaveEntries
+{
+}; // class FinalSaveEntries
+
+/// An entry processor that is not an IProcessEntry
+struct CountEntries {
+    size_t found = 0;
+    size_t ignored_ = 0;
+
+    IProcessEntry::Status
+    operator()(const std::shared_ptr<Entry>& entry)
+    {
+        ++found;
+        return IProcessEntry::Status::Continue;
+    }
+
+    void
+    ignored(const std::shared_ptr<Entry>& entry)
+    {
+        ++ignored_;
+    }
+}; // struct CountEntries
+
+/// CountEntries only knows how many paths there were
+static void
+sameResults(const CountEntries& actual, const SaveEntries& expected)
+{
+    cmp_ok(actual.found, ==, expected.found.size());
+    cmp_ok(actual.ignored_, ==, expected.ignoredPaths.size());
+}
+
+static void
+test_disk_static()
+{
+    const glob::Path basepath{SRCDIR "/globstari-basic-disk-ignores"};
+
+    {
+        FinalDiskFileTree finalTree(8);
+        sameAsSaveEntries<FinalSaveEntries>(finalTree, threadVariants());
+        sameAsSaveEntries<CountEntries>(finalTree, threadVariants());
+    }
+
+    // An in-memory tree
+    for(const unsigned threads : {
+                1U, 4U
+            }) {
+        GlobstariOptions options;
+        options.threads = threads;
+
+        TestFileTreeRepeats virtualTree;
+        SaveEntries viaVirtual;
+        globstari(virtualTree, viaVirtual, "/", {"*"}, options);
+
+        FinalFileTreeRepeats finalTree;
+        FinalSaveEntries viaTemplate;
+        globstari(finalTree, viaTemplate, "/", {"*"}, options);
+        ok(viaTemplate.found == viaVirtual.found);
+        cmp_ok(viaTemplate.found.size(), ==, 6U);
+    }
+
+    // Same checks as the virtual version
+    FinalDiskFileTree finalTree;
+    CountEntries counts;
+    throws_with_msg(
+        globstari(finalTree, counts, basepath, {}, GlobstariOptions()),
+        "needle.empty"
+    );
+} // test_disk_static()
+
+/// Records the entries it is given a directory at a time
+class SaveBatches: public IProcessEntryBatch
+{
+public:
+    std::set<Path> found;
+    std::set<Path> ignoredPaths;
+    size_t batches = 0;
+    bool sameDir = true;        ///< each batch was from one directory
+    bool skipSubdir = false;    ///< if true, skip directories `subdir`
+    bool stop = false;          ///< if true, stop after one batch
+
+    IProcessEntry::Status
+    processBatch(const std::shared_ptr<Entry> *entries, size_t count,
+                 std::vector<IProcessEntry::Status>& statuses) override
+    {
+        ++batches;
+        const auto& first = entries[0]->canonPath;
+        const Path dir = first.substr(0, first.rfind('/'));
+        for(size_t i = 0; i < count; ++i) {
+            const auto& path = entries[i]->canonPath;
+            found.insert(path);
+            sameDir = sameDir && path.substr(0, path.rfind('/')) == dir;
+            if(skipSubdir && path.size() >= 7 &&
+                    path.compare(path.size() - 7, 7, "/subdir") == 0) {
+                statuses[i] = IProcessEntry::Status::Skip;
+            }
+        }
+        return stop ? IProcessEntry::Status::Stop :
+               IProcessEntry::Status::Continue;
+    }
+
+    void
+    ignored(const std::shared_ptr<Entry>& entry) override
+    {
+        ignoredPaths.insert(entry->canonPath);
+    }
+}; // class SaveBatches
+
+/// As SaveBatches, but final
+class FinalSaveBatches final: public SaveBatches
+{
+}; // class FinalSaveBatches
+
+static void
+test_disk_batch()
+{
+    const glob::Path basepath{SRCDIR "/globstari-basic-disk-ignores"};
+    DiskFileTree fileTree;
+
+    // Same results as one at a time, in fewer calls
+    sameAsSaveEntries<SaveBatches>(fileTree, threadVariants(),
+    [](const SaveBatches& saveBatches) {
+        ok(saveBatches.sameDir);
+    });
+    FinalDiskFileTree finalTree;
+    sameAsSaveEntries<FinalSaveBatches>(finalTree, threadVariants());
+
+    {
+        SaveEntries saveEntries;
+        globstari(fileTree, saveEntries, basepath, {"*"});
+        SaveBatches saveBatches;
+        globstari(fileTree, saveBatches, basepath, {"*"});
+        cmp_ok(saveBatches.batches, <, saveEntries.found.size());
+    }
+
+    {
+        // Per-entry Skip
+        SkipSubdir skipSubdir;
+        globstari(fileTree, skipSubdir, basepath, {"*"});
+        SaveBatches saveBatches;
+        saveBatches.skipSubdir = true;
+        globstari(fileTree, saveBatches, basepath, {"*"});
+        ok(saveBatches.found == skipSubdir.found);
+        ok(saveBatches.found.count(basepath + "/dir/subdir"));
+        ok(!saveBatches.found.count(basepath + "/dir/subdir/s2dir"));
+    }
+
+    {
+        // Stop
+        SaveBatches saveBatches;
+        saveBatches.stop = true;
+        globstari(fileTree, saveBatches, basepath, {"*"});
+        cmp_ok(saveBatches.batches, ==, 1);
+    }
+} // test_disk_batch()
+
 /// @}
 
 TEST_MAIN {
     LOG_F(INFO, "SRCDIR [%s], MY_PATH [%s], argv[0] [%s]",
           SRCDIR, MY_PATH.c_str(), argv[0]);
     TEST_CASE(test_sanity);
+    TEST_CASE(test_repeats);
     TEST_CASE(test_disk);
     TEST_CASE(test_disk_ignores);
+    TEST_CASE(test_disk_prune);
+    TEST_CASE(test_disk_threads);
+    TEST_CASE(test_disk_walk);
+    TEST_CASE(test_disk_fds);
+    TEST_CASE(test_disk_ignore_cache);
+    TEST_CASE(test_disk_reuse);
+    TEST_CASE(test_disk_symlinks);
+    TEST_CASE(test_disk_static);
+    TEST_CASE(test_disk_batch);
 }
@@ -3,6 +3,11 @@
 /// @author Christopher White <cxwembedded@gmail.com>
 /// @copyright Copyright (c) 2021 Christopher White
 
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include "smallcxx/globstari.hpp"
 #include "smallcxx/test.hpp"
 
@@ -239,10 +244,542 @@ test_utf8()
     ok(gs.contains("コンニチハ to you as well!"));
 }
 
+void
+test_context()
+{
+    // One context shared among GlobSets whose regexes have differing
+    // numbers of capture groups.
+    GlobSet plain, ranges;
+    plain.addGlob("*.txt");
+    plain.finalize();
+    ranges.addGlob("{1..10}-{20..30}");
+    ranges.finalize();
+
+    MatchContext context;
+    ok(plain.contains("foo.txt", context));
+    ok(!plain.contains("foo.bak", context));
+    ok(ranges.contains("5-25", context));
+    ok(!ranges.contains("5-35", context));
+    ok(plain.contains("bar.txt", context));
+    ok(ranges.contains("10-20", context));
+    throws_with_msg(GlobSet().contains("foo", context), "not finalized");
+}
+
+void
+test_contains_many()
+{
+    GlobSet gs;
+    gs.addGlobs(vector<Path> {"*.txt", "**/*.c", "{1..10}", "{20..30}",
+                              "exact"});
+    throws_with_msg(gs.containsMany(nullptr, 0), "not finalized");
+    gs.finalize();
+
+    const vector<Path> paths = {
+        "foo.txt", "dir/foo.txt", "/a/b.c", "5", "25", "15", "", "exact",
+        "exact/x", "foo.bak"
+    };
+    const vector<PathView> views(paths.begin(), paths.end());
+    const auto results = gs.containsMany(views.data(), paths.size());
+    cmp_ok(results.size(), ==, paths.size());
+    for(size_t i = 0; i < paths.size(); ++i) {
+        cmp_ok(results[i], ==, gs.contains(paths[i]));
+    }
+
+    // Accumulating: paths whose results are already true are skipped
+    vector<bool> acc(paths.size(), false);
+    acc[9] = true;
+    MatchContext context;
+    gs.containsMany(views.data(), paths.size(), acc, context);
+    ok(acc[9]);
+    for(size_t i = 0; i < 9; ++i) {
+        cmp_ok(acc[i], ==, results[i]);
+    }
+
+    ok(gs.containsMany(views.data(), 0).empty());
+}
+
+void
+test_view()
+{
+    GlobSet gs;
+    gs.addGlobs(vector<Path> {"*.txt", "file{1..5}", "exact"});
+    gs.finalize();
+
+    // Slices of a larger buffer, not NUL-terminated
+    const char buf[] = "foo.txtfile3exactly";
+    ok(gs.contains(PathView(buf, 7)));          // foo.txt
+    ok(!gs.contains(PathView(buf, 6)));         // foo.tx
+    ok(gs.contains(PathView(buf + 7, 5)));      // file3
+    ok(!gs.contains(PathView(buf + 7, 6)));     // file3e
+    ok(gs.contains(PathView(buf + 12, 5)));     // exact
+    ok(!gs.contains(PathView(buf + 12, 7)));    // exactly
+    ok(!gs.contains(PathView(buf, 0)));
+    ok(!gs.contains(PathView()));
+
+    Matcher m({"*.txt"}, "/");
+    const char paths[] = "/a.txt/b.bak";
+    cmp_ok(m.check(PathView(paths, 6)), ==, PathCheckResult::Included);
+    cmp_ok(m.check(PathView(paths + 6, 6)), ==, PathCheckResult::Unknown);
+}
+
+void
+test_range_overflow()
+{
+    // Numerals too big for `long long` saturate, as with strtoll().
+    GlobSetOptions options;
+    options.engine = MatchEngine::Pcre2;
+    GlobSet gs(options);
+    gs.addGlob("a{1..5}");
+    gs.addGlob("b{-5..9223372036854775807}");
+    gs.addGlob("c{-9223372036854775808..0}");
+    gs.finalize();
+
+    ok(!gs.contains("a99999999999999999999999"));
+    ok(gs.contains("b9223372036854775807"));
+    ok(gs.contains("b99999999999999999999999"));
+    ok(!gs.contains("b-99999999999999999999999"));
+    ok(gs.contains("c-99999999999999999999999"));
+    ok(!gs.contains("c99999999999999999999999"));
+}
+
+void
+test_threads()
+{
+    GlobSet gs;
+    gs.addGlob("**/*.txt");
+    gs.addGlob("{1..100}");
+    gs.finalize();
+
+    const size_t NTHREADS = 4;
+    const int NITERS = 1000;
+    std::vector<int> failures(NTHREADS, 0);
+    std::vector<std::thread> threads;
+
+    for(size_t i = 0; i < NTHREADS; ++i) {
+        threads.emplace_back([&gs, &failures, i]() {
+            MatchContext context;
+            for(int iter = 0; iter < NITERS; ++iter) {
+                failures[i] += !gs.contains("/foo/bar.txt", context);
+                failures[i] += !gs.contains(to_string(iter % 100 + 1), context);
+                failures[i] += gs.contains("/foo/bar.bak", context);
+                failures[i] += gs.contains("0", context);
+
+                // The per-thread default context
+                failures[i] += !gs.contains("/foo/bat.txt");
+            }
+        });
+    }
+
+    for(auto& thread : threads) {
+        thread.join();
+    }
+
+    for(const auto f : failures) {
+        cmp_ok(f, ==, 0);
+    }
+}
+
+void
+test_jit()
+{
+    GlobSetOptions options;
+    options.jit = true;
+
+    // Many globs combined into one alternation, plus a range glob,
+    // which gets its own regex.
+    GlobSet gs(options);
+    for(int i = 0; i < 200; ++i) {
+        gs.addGlob("**/*.ext" + to_string(i));
+    }
+    gs.addGlob("file{1..5}");
+    gs.finalize();
+
+    ok(gs.contains("/foo/bar.ext0"));
+    ok(gs.contains("/foo/bar.ext199"));
+    ok(!gs.contains("/foo/bar.ext200"));
+    ok(gs.contains("file3"));
+    ok(!gs.contains("file6"));
+
+    // Copies work, whether or not JIT is available
+    GlobSet copy(gs);
+    ok(copy.contains("/foo/bar.ext42"));
+    ok(!copy.contains("/foo/bar.ext"));
+    ok(copy.contains("file5"));
+
+    LOG_F(INFO, "JIT is %savailable", jitAvailable() ? "" : "not ");
+}
+
+void
+test_engines_agree()
+{
+    const vector<Path> globs = {
+        "*.txt", "**/*.txt", "**.c", "/foo/**/bar", "a?c", "[abc]x",
+        "[!abc]x", "[a-c]y", "[]]z", "[\\]]w", "*.{txt,pl}", "{a,b{c,d}}e",
+        "{single}", "{,x}y", "file{1..5}", "n{-3..3}", "v{10..1}",
+        "big{95..1005}", "neg{-120..-7}", "\\*star", "sl[/]ash",
+        "a/*/b", "q{1..3}/*.r{10..12}",
+
+        // Shapes the literal index handles
+        "foo.txt", "dir/foo.txt", "/foo**/bar", "/foo**/*.txt",
+        "/foo/**/*.txt", "/foo\\/**/bar", "**/bar", "/f\\.o**/*.c",
+        "\\.txt", "x\\", "\\d**/bar", "*.tar.gz", "**/*.t\\xt",
+
+        // Alternatives where one is a prefix of another
+        "{a,ab}", "*{.c,.cpp}", "{foo,foobar}", "{ab,a}", "{foobar,foo}",
+
+        // A single numeric range after `*`
+        "*{-3..3}"
+    };
+    const vector<Path> paths = {
+        "", "foo.txt", "dir/foo.txt", "/dir/foo.txt", "x.c", "a/b.c",
+        "/foo/bar", "/foo/x/y/bar", "/foo/bar/x", "abc", "a/c", "ax", "dx",
+        "by", "dy", "]z", "]w", "\\w", "foo.pl", "ce", "de", "e", "y", "xy",
+        "file0", "file1", "file5", "file6", "file+3", "file+03", "file-0",
+        "file01", "n-3", "n-4", "n0", "n-0", "n+0", "n-003", "n3", "v5",
+        "v10", "v11", "v+010", "big94", "big95", "big100", "big999",
+        "big1005", "big1006", "big0100", "big+0100", "neg-7", "neg-6",
+        "neg-120", "neg-121", "neg-0050", "neg50", "*star", "xstar",
+        "sl/ash", "a/x/b", "a/x/y/b", "q2/foo.r11", "q4/foo.r11",
+        "q1/foo.r13", "q3/.r10", "q3/x/.r10",
+
+        "/foo.txt", "/foobar/bar", "/foo/bar.txt", "/foo//bar", "/foobar",
+        "/foo/x\ny/bar", "/foo\n/bar", "/foo/x\n/bar.txt", "/bar", "bar",
+        "/x/bar", "/f.o/x.c", "/fxo/x.c", "/f.o/a/b.c", ".txt", "x\\",
+        "/d/bar", "a.tar.gz", "/a/b.txt.gz", "/a/.t\\xt", "/a/.txt",
+        "a", "ab", "x.cpp", "foo", "foobar", "/foo/bar/bar",
+        "/foo/x.txt/y.txt", "/foo/bar/x/bar", "bx12-0", "bx-3", "x4"
+    };
+
+    // Where MatchEngine::Pcre2 stops at the first way a glob matches a
+    // prefix of the path, or range-checks only the first split it finds
+    // (see MatchEngine::Automaton).  PCRE2 rejects `0` alone.
+    const set< pair<Path, Path> > atomic = {
+        { "{a,ab}", "ab" }, { "*{.c,.cpp}", "x.cpp" },
+        { "{foo,foobar}", "foobar" }, { "/foo/**/bar", "/foo/bar/bar" },
+        { "/foo/**/bar", "/foo/bar/x/bar" },
+        { "/foo/**/*.txt", "/foo/x.txt/y.txt" }, { "*{-3..3}", "bx12-0" },
+        { "*{-3..3}", "file-0" }, { "*{-3..3}", "n-0" }, { "*{-3..3}", "n+0" }
+    };
+
+    // Reference: PCRE2 matching every glob
+    GlobSetOptions reference;
+    reference.engine = MatchEngine::Pcre2;
+    reference.literalIndex = false;
+
+    vector<GlobSetOptions> others(3);
+    others[0].engine = MatchEngine::Pcre2;
+    others[0].literalIndex = true;
+    others[1].engine = MatchEngine::Automaton;
+    others[1].literalIndex = false;
+    others[2].engine = MatchEngine::Automaton;
+    others[2].literalIndex = true;
+
+    for(const auto& glob : globs) {
+        GlobSet expectedSet(reference);
+        expectedSet.addGlob(glob);
+        expectedSet.finalize();
+
+        for(size_t i = 0; i < others.size(); ++i) {
+            GlobSet actualSet(others[i]);
+            actualSet.addGlob(glob);
+            actualSet.finalize();
+
+            for(const auto& path : paths) {
+                bool expected = expectedSet.contains(path);
+                const bool actual = actualSet.contains(path);
+                if(atomic.count(make_pair(glob, path))) {
+                    ok(!expected);
+                    expected = (others[i].engine == MatchEngine::Automaton);
+                }
+                if(actual != expected) {
+                    LOG_F(WARNING, "options %zu, glob >>%s<< path >>%s<<: "
+                          "engines disagree", i, glob.c_str(), path.c_str());
+                }
+                cmp_ok(actual, ==, expected);
+            }
+        }
+    }
+}
+
+void
+test_literal_index()
+{
+    GlobSetOptions options;
+    options.literalIndex = true;
+
+    // A typical ignore file, as Matcher::addGlob() would present it
+    GlobSet gs(options);
+    gs.addGlob("/proj**/*.o");
+    gs.addGlob("/proj**/*.pyc");
+    gs.addGlob("/proj**/node_modules");
+    gs.addGlob("/proj/build/out.log");
+    gs.addGlob("/proj**/*.{swp,swo}");  // not simple --- uses the engine
+    gs.finalize();
+
+    ok(gs.contains("/proj/foo.o"));
+    ok(gs.contains("/proj/a/b/c/foo.pyc"));
+    ok(gs.contains("/proj/node_modules"));
+    ok(gs.contains("/proj/x/node_modules"));
+    ok(gs.contains("/projx/node_modules"));    // as with the regex
+    ok(gs.contains("/proj/build/out.log"));
+    ok(gs.contains("/proj/.foo.swp"));
+    ok(!gs.contains("/proj/foo.c"));
+    ok(!gs.contains("/proj/foo.o/bar"));
+    ok(!gs.contains("/other/foo.o"));
+    ok(!gs.contains("/proj/node_modules/x"));
+    ok(!gs.contains("/proj/build/out.log.1"));
+    ok(!gs.contains("foo.o"));
+
+    // Copies work
+    GlobSet copy(gs);
+    ok(copy.contains("/proj/a/foo.o"));
+    ok(copy.contains("/proj/a/.foo.swo"));
+    ok(!copy.contains("/proj/a/foo.swx"));
+}
+
+void
+test_automaton_pathological()
+{
+    // Backtracking matchers take exponential time on this glob.
+    GlobSetOptions options;
+    options.engine = MatchEngine::Automaton;
+    GlobSet gs(options);
+    gs.addGlob("*a*a*a*a*a*a*a*a*a*a*a*a*b");
+    gs.finalize();
+
+    const string as(5000, 'a');
+    ok(!gs.contains(as));
+    ok(gs.contains(as + "b"));
+    ok(!gs.contains(as + "bc"));
+}
+
+void
+test_automaton_nfa()
+{
+    // A DFA for this glob would need more than 2^13 states, since it has to
+    // remember which of the last 13 characters were `a`s.  Therefore, the
+    // NFA is used.
+    GlobSetOptions options;
+    options.engine = MatchEngine::Automaton;
+    GlobSet gs(options);
+    gs.addGlob("*a" + string(13, '?'));
+    gs.addGlob("*.txt");
+    gs.finalize();
+
+    const string bs(13, 'b');
+    ok(gs.contains("a" + bs));
+    ok(gs.contains("bbba" + bs));
+    ok(gs.contains("aaaaaaaaaaaaaaaaaaaa"));
+    ok(!gs.contains(bs));
+    ok(!gs.contains("ab" + bs));
+    ok(!gs.contains("a" + bs.substr(1) + "/"));
+    ok(gs.contains("foo.txt"));
+
+    MatchContext context;
+    ok(gs.contains("xa" + bs, context));
+    ok(!gs.contains("foo.bak", context));
+    ok(gs.contains("foo.txt", context));
+
+    // Load the NFA rather than finding it in the compile cache
+    const auto blob = gs.serialize();
+    gs = GlobSet();
+    const auto loaded = GlobSet::deserialize(blob.data(), blob.size());
+    ok(loaded.contains("bbba" + bs));
+    ok(!loaded.contains("ab" + bs));
+}
+
+static void
+test_shared()
+{
+    GlobSet gs;
+    gs.addGlob("*.txt");
+
+    // Unfinalized copies can diverge
+    GlobSet copy(gs);
+    copy.addGlob("*.md");
+    gs.finalize();
+    copy.finalize();
+    ok(gs.contains("foo.txt"));
+    ok(!gs.contains("foo.md"));
+    ok(copy.contains("foo.txt"));
+    ok(copy.contains("foo.md"));
+
+    // Finalized copies share
+    GlobSet copy2(gs);
+    ok(copy2.finalized());
+    ok(copy2.contains("foo.txt"));
+    ok(!copy2.contains("foo.md"));
+    throws_with_msg(copy2.addGlob("*.c"), "Already finalized");
+
+    // Assignment
+    copy2 = copy;
+    ok(copy2.contains("foo.md"));
+    ok(!gs.contains("foo.md"));
+}
+
+static void
+test_common_prefix()
+{
+    // Identical globs under different directories.  These share compiled
+    // code, but must still match only their own directories.
+    GlobSet a, b;
+    a.addGlobs(std::vector<Path> {"/a/b**/*.o", "/a/b**/core"});
+    b.addGlobs(std::vector<Path> {"/x/y**/*.o", "/x/y**/core"});
+    a.finalize();
+    b.finalize();
+    ok(a.contains("/a/b/foo.o"));
+    ok(a.contains("/a/bc/d/core"));
+    ok(!a.contains("/x/y/foo.o"));
+    ok(!a.contains("/a/b"));
+    ok(!a.contains("/a/"));
+    ok(b.contains("/x/y/foo.o"));
+    ok(b.contains("/x/y/z/core"));
+    ok(!b.contains("/a/b/foo.o"));
+
+    const std::vector<PathView> paths{"/a/b/foo.o", "/x/y/foo.o", "/a", ""};
+    const auto results = a.containsMany(paths.data(), paths.size());
+    ok(results == (std::vector<bool> {true, false, false, false}));
+
+    // `/**/` matches a single `/`, so is not split
+    GlobSet slash;
+    slash.addGlobs(std::vector<Path> {"/d/**/x", "/d/**/y"});
+    slash.finalize();
+    ok(slash.contains("/d/x"));
+    ok(slash.contains("/d/e/f/y"));
+    ok(!slash.contains("/dx"));
+    ok(!slash.contains("/d/"));
+
+    // Escaped characters in the prefix
+    GlobSet escaped;
+    escaped.addGlobs(std::vector<Path> {"/my\\-dir/\\*/a", "/my\\-dir/\\*/b"});
+    escaped.finalize();
+    ok(escaped.contains("/my-dir/*/a"));
+    ok(escaped.contains("/my-dir/*/b"));
+    ok(!escaped.contains("/my-dir/x/a"));
+
+    // A glob that is entirely the shared text
+    GlobSet whole;
+    whole.addGlobs(std::vector<Path> {"/foo", "/foo/bar", "/foobar"});
+    whole.finalize();
+    ok(whole.contains("/foo"));
+    ok(whole.contains("/foo/bar"));
+    ok(whole.contains("/foobar"));
+    ok(!whole.contains("/fo"));
+    ok(!whole.contains("/foo/"));
+
+    // Numeric ranges
+    GlobSet range;
+    range.addGlobs(std::vector<Path> {"/r/{1..5}", "/r/x{10..20}"});
+    range.finalize();
+    ok(range.contains("/r/3"));
+    ok(range.contains("/r/x15"));
+    ok(!range.contains("/r/6"));
+    ok(!range.contains("/r/x9"));
+}
+
+static void
+test_serialize()
+{
+    string blob;
+    {
+        GlobSet gs;
+        throws_with_msg(gs.serialize(), "not finalized");
+
+        gs.addGlobs(std::vector<Path> {"/p**/*.o", "/p**/build", "/p/x{1..9}",
+                                       "/p/*.{c,h}", "/p/lit"
+                                      });
+        gs.finalize();
+        blob = gs.serialize();
+    }   // so the globs aren't in the compile cache
+
+    const auto check = [](const GlobSet& loaded) {
+        ok(loaded.finalized());
+        ok(loaded.contains("/p/a/foo.o"));
+        ok(loaded.contains("/p/build"));
+        ok(loaded.contains("/p/x5"));
+        ok(loaded.contains("/p/foo.h"));
+        ok(loaded.contains("/p/lit"));
+        ok(!loaded.contains("/p/x10"));
+        ok(!loaded.contains("/p/a/foo.c"));
+        ok(!loaded.contains("/q/foo.o"));
+    };
+
+    check(GlobSet::deserialize(blob.data(), blob.size()));
+
+    // A stale blob is recompiled.  Change the fingerprint, which follows
+    // the globs.
+    auto stale = blob;
+    const auto pos = stale.find("globset ");
+    ok(pos != stale.npos);
+    stale[pos] = 'G';
+    check(GlobSet::deserialize(stale.data(), stale.size()));
+
+    // Bad data
+    throws_with_msg(GlobSet::deserialize("nope", 4), "Truncated");
+    throws_with_msg(GlobSet::deserialize("01234567", 8), "Not a serialized");
+    throws_with_msg(GlobSet::deserialize(blob.data(), blob.size() - 1),
+                    "Truncated");
+    const auto extra = blob + "x";
+    throws_with_msg(GlobSet::deserialize(extra.data(), extra.size()),
+                    "Trailing data");
+
+    // A compiled regex whose PCRE2 header is wrong.  "S2RP" is PCRE2's
+    // magic number as stored on a little-endian machine.
+    auto badRegex = blob;
+    const auto magic = badRegex.find("S2RP");
+    if(magic != badRegex.npos) {
+        badRegex[magic] = 'X';
+        throws_with_msg(GlobSet::deserialize(badRegex.data(), badRegex.size()),
+                        "Corrupt regex");
+    }
+}
+
+static void
+test_can_match_under()
+{
+    for(const bool literalIndex : {
+                true, false
+            }) {
+        auto options = GlobSet::defaultOptions();
+        options.literalIndex = literalIndex;
+
+        GlobSet empty(options);
+        empty.finalize();
+        ok(!empty.canMatchUnder("/"));
+
+        GlobSet gs(options);
+        gs.addGlobs(std::vector<Path> {"/src/**/*.cpp", "/lit/file",
+                                       "/num/{1..3}/x", "/any**/foo"
+                                      });
+        throws_with_msg(gs.canMatchUnder("/src"), "not finalized");
+        gs.finalize();
+
+        ok(gs.canMatchUnder("/"));
+        ok(gs.canMatchUnder("/src"));
+        ok(gs.canMatchUnder("/src/"));
+        ok(gs.canMatchUnder("/src/a/b"));
+        ok(gs.canMatchUnder("/lit"));
+        ok(gs.canMatchUnder("/num/2"));
+        ok(gs.canMatchUnder("/anything/at/all"));
+        ok(!gs.canMatchUnder("/build"));
+        ok(!gs.canMatchUnder("/sr"));
+        ok(!gs.canMatchUnder("/lot"));
+        ok(!gs.canMatchUnder("/lit/file"));
+        ok(!gs.canMatchUnder("/num/b"));
+
+        GlobSet top(options);
+        top.addGlob("*.txt");
+        top.finalize();
+        ok(!top.canMatchUnder("/"));
+        ok(!top.canMatchUnder("x"));
+    }
+}
+
 // === main ==============================================================
 
-int
-main()
+/// Run all the tests using the current GlobSet::defaultOptions()
+static void
+run_all()
 {
     TEST_CASE(test_empty);
     TEST_CASE(test_invalid);
@@ -256,6 +793,40 @@ main()
     TEST_CASE(test_globstar);
     TEST_CASE(test_utf8);
 
+    TEST_CASE(test_context);
+    TEST_CASE(test_contains_many);
+    TEST_CASE(test_view);
+    TEST_CASE(test_range_overflow);
+    TEST_CASE(test_threads);
+    TEST_CASE(test_jit);
+    TEST_CASE(test_engines_agree);
+    TEST_CASE(test_literal_index);
+    TEST_CASE(test_automaton_pathological);
+    TEST_CASE(test_automaton_nfa);
+    TEST_CASE(test_shared);
+    TEST_CASE(test_common_prefix);
+    TEST_CASE(test_serialize);
+    TEST_CASE(test_can_match_under);
+}
+
+int
+main()
+{
+    LOG_F(INFO, "Testing with the PCRE2 interpreter");
+    run_all();
+
+    GlobSetOptions options;
+    options.jit = true;
+    GlobSet::setDefaultOptions(options);
+    LOG_F(INFO, "Testing with the PCRE2 JIT, if available");
+    run_all();
+
+    options = GlobSetOptions();
+    options.engine = MatchEngine::Automaton;
+    GlobSet::setDefaultOptions(options);
+    LOG_F(INFO, "Testing with the automaton engine");
+    run_all();
+
     TEST_RETURN;
 }
 // vi: set fdm=marker fenc=utf-8: //
@@ -62,6 +62,147 @@ test_not_finalized()
     ok(!m.contains(""));
 }
 
+void
+test_context()
+{
+    auto parent = make_shared<Matcher>(initializer_list<Path> {"*.bak"}, "/");
+    Matcher m({"*.txt", "!foo.txt"}, "/", parent);
+    MatchContext context;
+    cmp_ok(m.check("/bar.txt", context), ==, PathCheckResult::Included);
+    cmp_ok(m.check("/foo.txt", context), ==, PathCheckResult::Excluded);
+    cmp_ok(m.check("/foo.bak", context), ==, PathCheckResult::Included);
+    cmp_ok(m.check("/foo", context), ==, PathCheckResult::Unknown);
+    ok(m.contains("/bar.txt", context));
+    ok(!m.contains("/foo.txt", context));
+}
+
+/// Tests of Matcher::flattened()
+void
+test_flattened()
+{
+    auto root = make_shared<Matcher>(initializer_list<Path> {
+        "*.bak", "*.txt", "!keep*"
+    }, "/");
+    auto mid = make_shared<Matcher>(initializer_list<Path> {"keep2*"}, "/a/",
+                                    root);
+    auto leaf = make_shared<Matcher>(initializer_list<Path> {"*.o"}, "/a/b/",
+                                     mid);
+    Matcher top({"!*.txt"}, "/a/b/c", leaf);
+
+    const Matcher flat = top.flattened();
+    for(const char *path : {
+                "/x.bak", "/x.txt", "/keep.txt", "/keep2.txt", "/x.o",
+                "/a/x.txt", "/a/keep.txt", "/a/keep2.txt", "/a/keep2",
+                "/a/x.o", "/a/b/x.o", "/a/b/keep2.o", "/a/b/c/x.txt",
+                "/a/b/c/x.bak", "/a/b/c/keep2.txt", "/a/b/c/x.o", "/other"
+            }) {
+        cmp_ok(flat.check(path), ==, top.check(path));
+    }
+    cmp_ok(flat.check("/a/b/c/x.o"), ==, PathCheckResult::Included);
+    cmp_ok(flat.check("/a/b/c/x.txt"), ==, PathCheckResult::Excluded);
+    cmp_ok(flat.check("/other"), ==, PathCheckResult::Unknown);
+
+    // Flattening again changes nothing
+    const Matcher again = flat.flattened();
+    cmp_ok(again.check("/a/keep2.txt"), ==, PathCheckResult::Included);
+    cmp_ok(again.check("/a/keep.txt"), ==, PathCheckResult::Excluded);
+
+    ok(Matcher().flattened().check("/x") == PathCheckResult::Unknown);
+
+    Matcher notReady;
+    notReady.addGlob("*.c");
+    throws_with_msg(notReady.flattened(), "not ready");
+}
+
+void
+test_check_many()
+{
+    auto parent = make_shared<Matcher>(initializer_list<Path> {"*.bak"}, "/");
+    Matcher m({"*.txt", "!foo.txt", "{1..5}"}, "/", parent);
+
+    const vector<Path> paths = {
+        "/bar.txt", "/foo.txt", "/foo.bak", "/foo", "", "/3", "/6", "/x/3"
+    };
+    const vector<PathView> views(paths.begin(), paths.end());
+    const auto results = m.checkMany(views.data(), paths.size());
+    cmp_ok(results.size(), ==, paths.size());
+    for(size_t i = 0; i < paths.size(); ++i) {
+        cmp_ok(results[i], ==, m.check(paths[i]));
+    }
+
+    // Accumulating: results already known are not changed
+    vector<PathCheckResult> acc(paths.size(), PathCheckResult::Unknown);
+    acc[0] = PathCheckResult::Excluded;
+    MatchContext context;
+    m.checkMany(views.data(), paths.size(), acc, context);
+    cmp_ok(acc[0], ==, PathCheckResult::Excluded);
+    for(size_t i = 1; i < paths.size(); ++i) {
+        cmp_ok(acc[i], ==, results[i]);
+    }
+
+    // Empty batch
+    does_not_throw(m.checkMany(views.data(), 0));
+
+    const vector<PathView> relativeViews = {"/foo.txt", "foo.txt"};
+    throws_with_msg(m.checkMany(relativeViews.data(), relativeViews.size()),
+                    "must be absolute");
+
+    Matcher notReady;
+    notReady.addGlob("*.txt");
+    throws_with_msg(notReady.checkMany(views.data(), paths.size()),
+                    "not ready");
+}
+
+void
+test_serialize()
+{
+    auto parent = make_shared<Matcher>(initializer_list<Path> {"*.bak"}, "/");
+    Matcher m({"*.txt", "!foo.txt", "{1..5}", "!3"}, "/d");
+
+    const auto blob = m.serialize();
+    const auto loaded = Matcher::deserialize(blob.data(), blob.size(), parent);
+    ok(loaded.ready());
+
+    for(const Path path : {
+                "/d/bar.txt", "/d/foo.txt", "/d/2", "/d/3", "/d/6", "/e/2"
+            }) {
+        cmp_ok(loaded.check(path), ==, m.check(path));
+    }
+    cmp_ok(loaded.check("/d/foo.bak"), ==, PathCheckResult::Included);
+
+    GlobSet gs;
+    gs.finalize();
+    const auto globSetBlob = gs.serialize();
+    throws_with_msg(Matcher::deserialize(globSetBlob.data(),
+                                         globSetBlob.size()),
+                    "Not a serialized Matcher");
+
+    Matcher notReady;
+    notReady.addGlob("*.txt");
+    throws_with_msg(notReady.serialize(), "not ready");
+}
+
+void
+test_can_match_under()
+{
+    auto parent = make_shared<Matcher>(initializer_list<Path> {"/p/*.bak"},
+                                       "/");
+    Matcher m({"src/**/*.cpp", "!src/gen/**"}, "/r", parent);
+
+    ok(m.canMatchUnder("/"));
+    ok(m.canMatchUnder("/r"));
+    ok(m.canMatchUnder("/r/src/a"));
+    ok(m.canMatchUnder("/r/src/gen"));    // excludes are not considered
+    ok(m.canMatchUnder("/p"));            // from the delegate
+    ok(!m.canMatchUnder("/r/build"));
+    ok(!m.canMatchUnder("/q"));
+    throws_with_msg(m.canMatchUnder("r/src"), "must be absolute");
+
+    Matcher notReady;
+    notReady.addGlob("*.txt");
+    throws_with_msg(notReady.canMatchUnder("/"), "not ready");
+}
+
 /// https://github.com/editorconfig/editorconfig/issues/455
 void
 test_ec455()
@@ -301,6 +442,50 @@ test_path_namestart()
     ok(!m3.contains("/file"));
 }
 
+/// Tests of addIgnoreContents()
+void
+test_ignore_contents()
+{
+    Matcher m;
+    m.addIgnoreContents("# comment\n"
+                        "  *.txt  \r\n"
+                        "\n"
+                        "   \t\n"
+                        "!keep.txt # trailing comment\n"
+                        "\\#hash\n"
+                        "   # indented comment\n"
+                        "sub/dir\t#\n"
+                        "last", "/foo/");
+    m.finalize();
+    ok(m.contains("/foo/a.txt"));
+    ok(m.contains("/foo/bar/a.txt"));
+    ok(!m.contains("/a.txt"));
+    ok(!m.contains("/foo/keep.txt"));
+    ok(m.contains("/foo/#hash"));
+    ok(m.contains("/foo/sub/dir"));
+    ok(!m.contains("/foo/bar/sub/dir"));
+    ok(m.contains("/foo/last"));
+    ok(!m.contains("/foo/comment"));
+    ok(!m.contains("/foo/# comment"));
+    ok(!m.contains("/foo/trailing"));
+
+    // Views need not be NUL-terminated
+    const Path text("a\nbc\nd");
+    Matcher m2;
+    m2.addIgnoreContents(PathView(text.data(), 4), PathView("/dirx", 4));
+    m2.finalize();
+    ok(m2.contains("/dir/a"));
+    ok(m2.contains("/dir/bc"));
+    ok(!m2.contains("/dir/b"));
+    ok(!m2.contains("/dir/d"));
+
+    // Nothing but comments
+    Matcher m3;
+    m3.addIgnoreContents("#a\n#b", "/");
+    m3.finalize();
+    ok(!m3.contains("/a"));
+}
+
 // }}}1
 /// @}
 
@@ -1500,12 +1685,20 @@ test_multi_glob()
     ok(!m.contains("/foo/31"));
 }
 
-int
-main()
+// === main ==============================================================
+
+/// Run all the tests using the current GlobSet::defaultOptions()
+static void
+run_all()
 {
     TEST_CASE(test_empty);
     TEST_CASE(test_invalid);
     TEST_CASE(test_not_finalized);
+    TEST_CASE(test_context);
+    TEST_CASE(test_flattened);
+    TEST_CASE(test_check_many);
+    TEST_CASE(test_serialize);
+    TEST_CASE(test_can_match_under);
     TEST_CASE(test_ec455);
     TEST_CASE(test_specialchar_dirname);
 
@@ -1516,6 +1709,7 @@ main()
     TEST_CASE(test_namestart);
 
     TEST_CASE(test_path_namestart);
+    TEST_CASE(test_ignore_contents);
 
     TEST_CASE(test_core_star);
     TEST_CASE(test_core_question);
@@ -1525,6 +1719,25 @@ main()
     TEST_CASE(test_core_utf8);
 
     TEST_CASE(test_multi_glob);
+}
+
+int
+main()
+{
+    LOG_F(INFO, "Testing with the PCRE2 interpreter");
+    run_all();
+
+    GlobSetOptions options;
+    options.jit = true;
+    GlobSet::setDefaultOptions(options);
+    LOG_F(INFO, "Testing with the PCRE2 JIT, if available");
+    run_all();
+
+    options = GlobSetOptions();
+    options.engine = MatchEngine::Automaton;
+    GlobSet::setDefaultOptions(options);
+    LOG_F(INFO, "Testing with the automaton engine");
+    run_all();
 
     TEST_RETURN;
 }
@@ -0,0 +1,167 @@
+/// @file t/globstari-order-t.cpp
+/// @brief Tests of GlobstariOptions::order and GlobstariOptions::maxFrontier
+/// @author Christopher White <cxwembedded@gmail.com>
+/// @copyright Copyright (c) 2021--2022 Christopher White
+/// SPDX-License-Identifier: BSD-3-Clause
+
+#include <algorithm>
+#include <atomic>
+#include <set>
+
+#include "smallcxx/globstari.hpp"
+#include "smallcxx/test.hpp"
+
+TEST_FILE
+
+using namespace smallcxx;
+using namespace std;
+using smallcxx::glob::Path;
+
+/// Entries per directory in WideFileTree
+static constexpr size_t FANOUT = 20;
+
+/// Depth of the files in WideFileTree
+static constexpr int DEPTH = 3;
+
+/// An Entry that keeps track of how many Entries exist at once.
+/// Stands in for the memory a traversal uses.
+struct CountedEntry: public Entry {
+    static std::atomic<size_t> live;    ///< how many exist now
+    static std::atomic<size_t> peak;    ///< the most that have existed
+
+    CountedEntry(EntryType newTy, const Path& newCanonPath)
+        : Entry(newTy, newCanonPath)
+    {
+        const size_t now = ++live;
+        size_t old = peak;
+        while(now > old && !peak.compare_exchange_weak(old, now)) {
+            // try again
+        }
+    }
+
+    ~CountedEntry()
+    {
+        --live;
+    }
+
+    /// Start counting again.  Call when no CountedEntry exists.
+    static void
+    reset()
+    {
+        peak = live.load();
+    }
+};
+
+std::atomic<size_t> CountedEntry::live(0);
+std::atomic<size_t> CountedEntry::peak(0);
+
+/// A virtual tree that is much wider than it is deep: FANOUT entries per
+/// directory, with all the files DEPTH deep.  No ignore files.
+class WideFileTree: public IFileTree
+{
+public:
+    std::shared_ptr<Entry>
+    rootDir(const Path& rootPath) override
+    {
+        return std::make_shared<CountedEntry>(EntryType::Dir, rootPath);
+    }
+
+    std::vector< std::shared_ptr<Entry> >
+    readDir(const Path& dirPath) override
+    {
+        const auto depth = (dirPath == "/") ? 0 :
+                           std::count(dirPath.begin(), dirPath.end(), '/');
+        const auto ty = (depth < DEPTH - 1) ? EntryType::Dir : EntryType::File;
+        const auto prefix = (dirPath == "/") ? Path("/") : dirPath + "/";
+
+        std::vector< std::shared_ptr<Entry> > retval;
+        for(size_t i = 0; i < FANOUT; ++i) {
+            retval.push_back(std::make_shared<CountedEntry>(ty,
+                             prefix + std::to_string(i)));
+        }
+        return retval;
+    }
+
+    // LCOV_EXCL_START - canonicalize() says no ignore file exists
+    Bytes
+    readFile(const Path& path) override
+    {
+        return "";
+    }
+    // LCOV_EXCL_STOP
+
+    Path
+    canonicalize(const Path& path) const override
+    {
+        return (path == "/") ? path : "";
+    }
+}; // class WideFileTree
+
+/// Records the paths found, without holding on to the entries
+class SavePaths: public IProcessEntry
+{
+public:
+    std::set<Path> found;
+
+    IProcessEntry::Status
+    operator()(const std::shared_ptr<Entry>& entry) override
+    {
+        found.insert(entry->canonPath);
+        return IProcessEntry::Status::Continue;
+    }
+}; // class SavePaths
+
+/// Search WideFileTree with @p options
+/// @return the most Entries that existed at once
+static size_t
+peakEntries(const GlobstariOptions& options, std::set<Path>& found)
+{
+    WideFileTree fileTree;
+    SavePaths savePaths;
+
+    CountedEntry::reset();
+    globstari(fileTree, savePaths, "/", {"*"}, options);
+    cmp_ok(CountedEntry::live.load(), ==, 0);
+
+    found.swap(savePaths.found);
+    return CountedEntry::peak;
+}
+
+static void
+test_order()
+{
+    const size_t files = FANOUT * FANOUT * FANOUT;
+    std::set<Path> bfsFound, dfsFound, cappedFound, threadedFound;
+    GlobstariOptions options;
+
+    const auto bfsPeak = peakEntries(options, bfsFound);
+    LOG_F(INFO, "Breadth-first: at most %zu entries", bfsPeak);
+    cmp_ok(bfsFound.size(), >, files);
+    cmp_ok(bfsPeak, >=, files);    // the whole last level at once
+
+    options.order = TraversalOrder::DepthFirst;
+    const auto dfsPeak = peakEntries(options, dfsFound);
+    LOG_F(INFO, "Depth-first: at most %zu entries", dfsPeak);
+    ok(dfsFound == bfsFound);
+    cmp_ok(dfsPeak, <=, DEPTH * FANOUT + DEPTH + 2);
+
+    options.order = TraversalOrder::BreadthFirst;
+    options.maxFrontier = 100;
+    const auto cappedPeak = peakEntries(options, cappedFound);
+    LOG_F(INFO, "Breadth-first, frontier <= 100: at most %zu entries",
+          cappedPeak);
+    ok(cappedFound == bfsFound);
+    cmp_ok(cappedPeak, <=, 100 + DEPTH * FANOUT + DEPTH + 2);
+
+    // Each thread has its own frontier
+    options.order = TraversalOrder::DepthFirst;
+    options.maxFrontier = 0;
+    options.threads = 4;
+    const auto threadedPeak = peakEntries(options, threadedFound);
+    ok(threadedFound == bfsFound);
+    cmp_ok(threadedPeak, <=, 4 * (DEPTH * FANOUT + DEPTH + 2));
+}
+
+TEST_MAIN {
+    TEST_CASE(test_order);
+}
@@ -79,6 +79,48 @@ test_userdata()
     }
 }
 
+/// A DiskFileTree whose entries are all FatEntry instances
+class FatDiskFileTree: public DiskFileTree
+{
+public:
+    std::shared_ptr<Entry>
+    makeEntry(EntryType ty, const Path& canonPath) override
+    {
+        auto e = std::make_shared<FatEntry>(ty, canonPath);
+        e->userdata = 1337;
+        return e;
+    }
+}; // class FatDiskFileTree
+
+/// DiskFileTree creates its entries with IFileTree::makeEntry()
+static void
+test_make_entry()
+{
+    const Path basepath{SRCDIR "/globstari-basic-disk"};
+    for(const bool fat : {
+                false, true
+            }) {
+        DiskFileTree plainTree;
+        FatDiskFileTree fatTree;
+        DiskFileTree& fileTree = fat ? fatTree : plainTree;
+        SaveEntries processEntry;
+        globstari(fileTree, processEntry, basepath, {"*"});
+        cmp_ok(processEntry.foundEntries.size(), >, 2);
+
+        for(const auto& found : processEntry.foundEntries) {
+            const auto fatEntry = dynamic_pointer_cast<FatEntry>(found.second);
+            ok(!!fatEntry == fat);
+            if(fatEntry) {
+                cmp_ok(fatEntry->userdata, ==, 1337);
+            }
+        }
+
+        auto entry = fileTree.lookup(basepath + "/noext");
+        ok(entry && !!dynamic_pointer_cast<FatEntry>(entry) == fat);
+    }
+}
+
 TEST_MAIN {
     TEST_CASE(test_userdata);
+    TEST_CASE(test_make_entry);
 }